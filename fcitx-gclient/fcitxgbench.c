@@ -0,0 +1,167 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include "fcitxgbenchprivate.h"
+#include <signal.h>
+#include <sys/wait.h>
+
+#define FCITX_G_BENCH_MOCKD "fcitx5-gtk-mockd"
+
+static gint messages_sent = 0;
+
+static gchar *_fcitx_g_bench_find_mockd(void) {
+#ifdef FCITX_G_BENCH_MOCKD_PATH
+    if (g_file_test(FCITX_G_BENCH_MOCKD_PATH, G_FILE_TEST_IS_EXECUTABLE)) {
+        return g_strdup(FCITX_G_BENCH_MOCKD_PATH);
+    }
+#endif
+    g_autofree gchar *self = g_file_read_link("/proc/self/exe", NULL);
+    if (self) {
+        g_autofree gchar *dir = g_path_get_dirname(self);
+        gchar *path = g_build_filename(dir, FCITX_G_BENCH_MOCKD, NULL);
+        if (g_file_test(path, G_FILE_TEST_IS_EXECUTABLE)) {
+            return path;
+        }
+        g_free(path);
+    }
+    return g_find_program_in_path(FCITX_G_BENCH_MOCKD);
+}
+
+static gboolean _fcitx_g_bench_set_done(gpointer user_data) {
+    *(gboolean *)user_data = TRUE;
+    return FALSE;
+}
+
+gboolean _fcitx_g_bench_wait(const gboolean *done, guint timeout_seconds) {
+    gboolean timed_out = FALSE;
+    guint source = g_timeout_add_seconds(timeout_seconds,
+                                         _fcitx_g_bench_set_done, &timed_out);
+    while (!*done && !timed_out) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+    if (!timed_out) {
+        g_source_remove(source);
+    }
+    return *done;
+}
+
+static void _fcitx_g_bench_availability_changed(FcitxGWatcher *watcher,
+                                                G_GNUC_UNUSED gboolean
+                                                    available,
+                                                gpointer user_data) {
+    // The signal is emitted without its argument, so ask the watcher.
+    if (fcitx_g_watcher_is_service_available(watcher)) {
+        *(gboolean *)user_data = TRUE;
+    }
+}
+
+gboolean _fcitx_g_bench_bus_start(FcitxGBenchBus *bus,
+                                  const gchar *const *daemon_args,
+                                  GError **error) {
+    g_autofree gchar *mockd = _fcitx_g_bench_find_mockd();
+    if (!mockd) {
+        g_set_error(error, G_SPAWN_ERROR, G_SPAWN_ERROR_NOENT,
+                    "%s is not found", FCITX_G_BENCH_MOCKD);
+        return FALSE;
+    }
+
+    bus->bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    g_test_dbus_up(bus->bus);
+
+    g_autoptr(GPtrArray) argv = g_ptr_array_new();
+    g_ptr_array_add(argv, mockd);
+    for (guint i = 0; daemon_args && daemon_args[i]; i++) {
+        g_ptr_array_add(argv, (gchar *)daemon_args[i]);
+    }
+    g_ptr_array_add(argv, NULL);
+    if (!g_spawn_async(NULL, (gchar **)argv->pdata, NULL,
+                       G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL, &bus->daemon,
+                       error)) {
+        _fcitx_g_bench_bus_stop(bus);
+        return FALSE;
+    }
+
+    gboolean available = FALSE;
+    bus->watcher = fcitx_g_watcher_new();
+    g_signal_connect(bus->watcher, "availability-changed",
+                     G_CALLBACK(_fcitx_g_bench_availability_changed),
+                     &available);
+    fcitx_g_watcher_watch(bus->watcher);
+    _fcitx_g_bench_wait(&available, FCITX_G_BENCH_TIMEOUT_SECONDS);
+    g_signal_handlers_disconnect_by_data(bus->watcher, &available);
+    if (!available) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                    "Timed out waiting for %s", FCITX_G_BENCH_MOCKD);
+        _fcitx_g_bench_bus_stop(bus);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void _fcitx_g_bench_bus_stop(FcitxGBenchBus *bus) {
+    g_clear_object(&bus->watcher);
+    while (g_main_context_iteration(NULL, FALSE)) {
+    }
+    if (bus->daemon) {
+        kill(bus->daemon, SIGTERM);
+        waitpid(bus->daemon, NULL, 0);
+        g_spawn_close_pid(bus->daemon);
+        bus->daemon = 0;
+    }
+    if (bus->bus) {
+        // The shared connection of the clients may still be alive, so do not
+        // wait for it with g_test_dbus_down().
+        g_test_dbus_stop(bus->bus);
+        g_clear_object(&bus->bus);
+    }
+}
+
+static GDBusMessage *_fcitx_g_bench_message_filter(
+    G_GNUC_UNUSED GDBusConnection *connection, GDBusMessage *message,
+    gboolean incoming, G_GNUC_UNUSED gpointer user_data) {
+    // Runs on the worker thread of the connection.
+    if (!incoming) {
+        g_atomic_int_inc(&messages_sent);
+    }
+    return message;
+}
+
+void _fcitx_g_bench_count_messages(GDBusConnection *connection) {
+    g_dbus_connection_add_filter(connection, _fcitx_g_bench_message_filter,
+                                 NULL, NULL);
+}
+
+guint _fcitx_g_bench_messages_sent(void) {
+    return g_atomic_int_get(&messages_sent);
+}
+
+gdouble _fcitx_g_bench_ms(gint64 time) {
+    return (gdouble)time / G_TIME_SPAN_MILLISECOND;
+}
+
+static gint _fcitx_g_bench_compare_time(gconstpointer a, gconstpointer b) {
+    gint64 lhs = *(const gint64 *)a;
+    gint64 rhs = *(const gint64 *)b;
+    return lhs < rhs ? -1 : lhs > rhs;
+}
+
+static gdouble _fcitx_g_bench_percentile(GArray *sorted, guint percent) {
+    guint index = (sorted->len - 1) * percent / 100;
+    return _fcitx_g_bench_ms(g_array_index(sorted, gint64, index));
+}
+
+void _fcitx_g_bench_print_latency(const gchar *name, GArray *samples) {
+    if (!samples->len) {
+        g_print("%s latency: no samples\n", name);
+        return;
+    }
+    g_array_sort(samples, _fcitx_g_bench_compare_time);
+    g_print("%s latency (ms): n=%u p50=%.3f p90=%.3f p99=%.3f max=%.3f\n",
+            name, samples->len, _fcitx_g_bench_percentile(samples, 50),
+            _fcitx_g_bench_percentile(samples, 90),
+            _fcitx_g_bench_percentile(samples, 99),
+            _fcitx_g_bench_percentile(samples, 100));
+}
@@ -0,0 +1,55 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef _FCITX_GCLIENT_FCITXGBENCHPRIVATE_H_
+#define _FCITX_GCLIENT_FCITXGBENCHPRIVATE_H_
+
+#include "fcitxgwatcher.h"
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/* The extra object fcitx5-gtk-mockd exports to drive the benchmarks. */
+#define FCITX_G_BENCH_MOCK_PATH "/org/fcitx/gtk/mock"
+#define FCITX_G_BENCH_MOCK_INTERFACE "org.fcitx.GtkMock1"
+/* Time to wait for the daemon and for any single step of a benchmark. */
+#define FCITX_G_BENCH_TIMEOUT_SECONDS 10
+
+typedef struct _FcitxGBenchBus FcitxGBenchBus;
+
+struct _FcitxGBenchBus {
+    GTestDBus *bus;
+    GPid daemon;
+    FcitxGWatcher *watcher;
+};
+
+/*
+ * Start a private bus with fcitx5-gtk-mockd on it, which is looked up in the
+ * build tree, next to the running executable, then in PATH. @daemon_args are passed on to
+ * it. Returns once the daemon owns the fcitx service name, with @bus->watcher
+ * watching it.
+ */
+gboolean _fcitx_g_bench_bus_start(FcitxGBenchBus *bus,
+                                  const gchar *const *daemon_args,
+                                  GError **error);
+void _fcitx_g_bench_bus_stop(FcitxGBenchBus *bus);
+
+/*
+ * Iterate the default main context until @done is set, or @timeout_seconds
+ * passed. Returns whether @done is set.
+ */
+gboolean _fcitx_g_bench_wait(const gboolean *done, guint timeout_seconds);
+
+/* Count the messages sent on @connection from now on. */
+void _fcitx_g_bench_count_messages(GDBusConnection *connection);
+guint _fcitx_g_bench_messages_sent(void);
+
+/* Sort @samples in microseconds and print their percentiles. */
+void _fcitx_g_bench_print_latency(const gchar *name, GArray *samples);
+gdouble _fcitx_g_bench_ms(gint64 time);
+
+G_END_DECLS
+
+#endif // _FCITX_GCLIENT_FCITXGBENCHPRIVATE_H_
@@ -4,8 +4,12 @@
  * SPDX-License-Identifier: LGPL-2.1-or-later
  */
 #include "fcitxgclient.h"
+#include "fcitxgdbusprivate.h"
+#include "fcitxgjournalprivate.h"
 #include "fcitxgwatcher.h"
+#include "fcitxgwatcherprivate.h"
 #include "marshall.h"
+#include <string.h>
 
 typedef struct _ProcessKeyStruct ProcessKeyStruct;
 
@@ -54,119 +58,12 @@ struct _FcitxGClientPrivate {
 
     guint32 version;
     gboolean batch;
+    gboolean has_focus;
+    gboolean lazy_connect;
+    /* Whether an input context has been created once. */
+    gboolean connected_once;
 };
 
-static const gchar introspection_xml[] =
-    "<node>"
-    "  <interface name=\"org.fcitx.Fcitx.InputMethod1\">"
-    "    <method name=\"CreateInputContext\">\n"
-    "      <arg direction=\"in\" type=\"a(ss)\"/>\n"
-    "      <arg direction=\"out\" type=\"o\"/>\n"
-    "      <arg direction=\"out\" type=\"ay\"/>\n"
-    "    </method>\n"
-    "    <method name=\"Version\">\n"
-    "      <arg direction=\"out\" type=\"u\"/>\n"
-    "    </method>\n"
-    "  </interface>"
-    "</node>";
-
-static const gchar ic_introspection_xml[] =
-    "<node>\n"
-    "  <interface name=\"org.fcitx.Fcitx.InputContext1\">\n"
-    "    <method name=\"FocusIn\">\n"
-    "    </method>\n"
-    "    <method name=\"FocusOut\">\n"
-    "    </method>\n"
-    "    <method name=\"Reset\">\n"
-    "    </method>\n"
-    "    <method name=\"SetCursorRect\">\n"
-    "      <arg name=\"x\" direction=\"in\" type=\"i\"/>\n"
-    "      <arg name=\"y\" direction=\"in\" type=\"i\"/>\n"
-    "      <arg name=\"w\" direction=\"in\" type=\"i\"/>\n"
-    "      <arg name=\"h\" direction=\"in\" type=\"i\"/>\n"
-    "    </method>\n"
-    "    <method name=\"SetCursorRectV2\">\n"
-    "      <arg name=\"x\" direction=\"in\" type=\"i\"/>\n"
-    "      <arg name=\"y\" direction=\"in\" type=\"i\"/>\n"
-    "      <arg name=\"w\" direction=\"in\" type=\"i\"/>\n"
-    "      <arg name=\"h\" direction=\"in\" type=\"i\"/>\n"
-    "      <arg name=\"scale\" direction=\"in\" type=\"d\"/>\n"
-    "    </method>\n"
-    "    <method name=\"SetCapability\">\n"
-    "      <arg name=\"caps\" direction=\"in\" type=\"t\"/>\n"
-    "    </method>\n"
-    "    <method name=\"SetSurroundingText\">\n"
-    "      <arg name=\"text\" direction=\"in\" type=\"s\"/>\n"
-    "      <arg name=\"cursor\" direction=\"in\" type=\"u\"/>\n"
-    "      <arg name=\"anchor\" direction=\"in\" type=\"u\"/>\n"
-    "    </method>\n"
-    "    <method name=\"SetSurroundingTextPosition\">\n"
-    "      <arg name=\"cursor\" direction=\"in\" type=\"u\"/>\n"
-    "      <arg name=\"anchor\" direction=\"in\" type=\"u\"/>\n"
-    "    </method>\n"
-    "    <method name=\"DestroyIC\">\n"
-    "    </method>\n"
-    "    <method name=\"ProcessKeyEvent\">\n"
-    "      <arg name=\"keyval\" direction=\"in\" type=\"u\"/>\n"
-    "      <arg name=\"keycode\" direction=\"in\" type=\"u\"/>\n"
-    "      <arg name=\"state\" direction=\"in\" type=\"u\"/>\n"
-    "      <arg name=\"isRelease\" direction=\"in\" type=\"b\"/>\n"
-    "      <arg name=\"time\" direction=\"in\" type=\"u\"/>\n"
-    "      <arg name=\"ret\" direction=\"out\" type=\"b\"/>\n"
-    "    </method>\n"
-    "    <method name=\"ProcessKeyEventBatch\">\n"
-    "      <arg name=\"keyval\" direction=\"in\" type=\"u\"/>\n"
-    "      <arg name=\"keycode\" direction=\"in\" type=\"u\"/>\n"
-    "      <arg name=\"state\" direction=\"in\" type=\"u\"/>\n"
-    "      <arg name=\"isRelease\" direction=\"in\" type=\"b\"/>\n"
-    "      <arg name=\"time\" direction=\"in\" type=\"u\"/>\n"
-    "      <arg name=\"event\" direction=\"out\" type=\"a(uv)\"/>\n"
-    "      <arg name=\"ret\" direction=\"out\" type=\"b\"/>\n"
-    "    </method>\n"
-    "    <method name=\"PrevPage\">\n"
-    "    </method>\n"
-    "    <method name=\"NextPage\">\n"
-    "    </method>\n"
-    "    <method name=\"SelectCandidate\">\n"
-    "      <arg name=\"index\" direction=\"in\" type=\"i\"/>\n"
-    "    </method>\n"
-    "    <signal name=\"CommitString\">\n"
-    "      <arg name=\"str\" type=\"s\"/>\n"
-    "    </signal>\n"
-    "    <signal name=\"CurrentIM\">\n"
-    "      <arg name=\"name\" type=\"s\"/>\n"
-    "      <arg name=\"uniqueName\" type=\"s\"/>\n"
-    "      <arg name=\"langCode\" type=\"s\"/>\n"
-    "    </signal>\n"
-    "    <signal name=\"DeleteSurroundingText\">\n"
-    "      <arg name=\"offset\" type=\"i\"/>\n"
-    "      <arg name=\"nchar\" type=\"u\"/>\n"
-    "    </signal>\n"
-    "    <signal name=\"UpdateFormattedPreedit\">\n"
-    "      <arg name=\"str\" type=\"a(si)\"/>\n"
-    "      <arg name=\"cursorpos\" type=\"i\"/>\n"
-    "    </signal>\n"
-    "    <signal name=\"UpdateClientSideUI\">\n"
-    "      <arg name=\"preedit\" type=\"a(si)\"/>\n"
-    "      <arg name=\"cursorpos\" type=\"i\"/>\n"
-    "      <arg name=\"auxUp\" type=\"a(si)\"/>\n"
-    "      <arg name=\"auxDown\" type=\"a(si)\"/>\n"
-    "      <arg name=\"candidates\" type=\"a(ss)\"/>\n"
-    "      <arg name=\"candidateIndex\" type=\"i\"/>\n"
-    "      <arg name=\"layoutHint\" type=\"i\"/>\n"
-    "      <arg name=\"hasPrev\" type=\"b\"/>\n"
-    "      <arg name=\"hasNext\" type=\"b\"/>\n"
-    "    </signal>\n"
-    "    <signal name=\"ForwardKey\">\n"
-    "      <arg name=\"keyval\" type=\"u\"/>\n"
-    "      <arg name=\"state\" type=\"u\"/>\n"
-    "      <arg name=\"type\" type=\"b\"/>\n"
-    "    </signal>\n"
-    "    <signal name=\"NotifyFocusOut\">\n"
-    "    </signal>\n"
-    "  </interface>\n"
-    "</node>\n";
-
 G_DEFINE_TYPE_WITH_PRIVATE(FcitxGClient, fcitx_g_client, G_TYPE_OBJECT);
 
 enum {
@@ -194,7 +91,8 @@ static guint signals[LAST_SIGNAL] = {0};
 static GDBusInterfaceInfo *_fcitx_g_client_get_interface_info(void);
 static GDBusInterfaceInfo *_fcitx_g_client_get_clientic_info(void);
 
-static void _fcitx_g_client_update_availability(FcitxGClient *self);
+static void _fcitx_g_client_schedule_create_ic(FcitxGClient *self);
+static gboolean _fcitx_g_client_defer_reconnect(FcitxGClient *self);
 static void _fcitx_g_client_availability_changed(FcitxGWatcher *connection,
                                                  gboolean avail,
                                                  gpointer user_data);
@@ -216,7 +114,7 @@ static void _fcitx_g_client_g_signal(GDBusProxy *proxy, gchar *sender_name,
                                      gchar *signal_name, GVariant *parameters,
                                      gpointer user_data);
 static void _fcitx_g_client_clean_up(FcitxGClient *self);
-static gboolean _fcitx_g_client_recheck(gpointer user_data);
+static void _fcitx_g_client_recheck(gpointer user_data);
 static void _fcitx_g_client_handle_forward_key(FcitxGClient *self,
                                                GVariant *parameters);
 static void _fcitx_g_client_handle_commit_string(FcitxGClient *self,
@@ -233,22 +131,141 @@ static void fcitx_g_client_set_property(GObject *gobject, guint prop_id,
                                         const GValue *value, GParamSpec *pspec);
 
 static void _item_free(gpointer arg);
+static void _fcitx_g_client_journal(FcitxGClient *self,
+                                    FcitxGJournalRecordType type,
+                                    const gchar *member, GVariant *payload);
+static void _fcitx_g_client_journal_error(FcitxGClient *self,
+                                          const gchar *member,
+                                          const GError *error);
+static void _fcitx_g_client_call_ic(FcitxGClient *self, const gchar *method,
+                                    GVariant *parameters);
+
+static GDBusInterfaceInfo *_fcitx_g_client_get_interface_info(void) {
+    return (GDBusInterfaceInfo *)&fcitx_gdbus_input_method_interface;
+}
+
+static GDBusInterfaceInfo *_fcitx_g_client_get_clientic_info(void) {
+    return (GDBusInterfaceInfo *)&fcitx_gdbus_input_context_interface;
+}
+
+/*
+ * Typed helpers for the calls in org.fcitx.Fcitx.xml. They are the only place
+ * that spells out a method name or a signature, so callers pass C types and a
+ * wrong argument fails to compile.
+ */
+static void _fcitx_g_client_ic_focus_in(FcitxGClient *self) {
+    _fcitx_g_client_call_ic(self, "FocusIn", NULL);
+}
+
+static void _fcitx_g_client_ic_focus_out(FcitxGClient *self) {
+    _fcitx_g_client_call_ic(self, "FocusOut", NULL);
+}
+
+static void _fcitx_g_client_ic_reset(FcitxGClient *self) {
+    _fcitx_g_client_call_ic(self, "Reset", NULL);
+}
+
+static void _fcitx_g_client_ic_set_capability(FcitxGClient *self,
+                                              guint64 flags) {
+    _fcitx_g_client_call_ic(self, "SetCapability",
+                            g_variant_new("(t)", flags));
+}
+
+static void _fcitx_g_client_ic_set_cursor_rect(FcitxGClient *self, gint x,
+                                               gint y, gint w, gint h) {
+    _fcitx_g_client_call_ic(self, "SetCursorRect",
+                            g_variant_new("(iiii)", x, y, w, h));
+}
+
+static void _fcitx_g_client_ic_set_cursor_rect_v2(FcitxGClient *self, gint x,
+                                                  gint y, gint w, gint h,
+                                                  gdouble scale) {
+    _fcitx_g_client_call_ic(self, "SetCursorRectV2",
+                            g_variant_new("(iiiid)", x, y, w, h, scale));
+}
+
+static void _fcitx_g_client_ic_prev_page(FcitxGClient *self) {
+    _fcitx_g_client_call_ic(self, "PrevPage", NULL);
+}
+
+static void _fcitx_g_client_ic_next_page(FcitxGClient *self) {
+    _fcitx_g_client_call_ic(self, "NextPage", NULL);
+}
+
+static void _fcitx_g_client_ic_select_candidate(FcitxGClient *self,
+                                                gint index) {
+    _fcitx_g_client_call_ic(self, "SelectCandidate",
+                            g_variant_new("(i)", index));
+}
+
+static void _fcitx_g_client_ic_set_surrounding_text(FcitxGClient *self,
+                                                    const gchar *text,
+                                                    guint cursor,
+                                                    guint anchor) {
+    _fcitx_g_client_call_ic(self, "SetSurroundingText",
+                            g_variant_new("(suu)", text, cursor, anchor));
+}
+
+static void _fcitx_g_client_ic_set_surrounding_text_position(
+    FcitxGClient *self, guint cursor, guint anchor) {
+    _fcitx_g_client_call_ic(self, "SetSurroundingTextPosition",
+                            g_variant_new("(uu)", cursor, anchor));
+}
+
+static const gchar *_fcitx_g_client_process_key_method(FcitxGClient *self) {
+    return (self->priv->version > 0 && self->priv->batch)
+               ? "ProcessKeyEventBatch"
+               : "ProcessKeyEvent";
+}
+
+// Both process key methods take the same arguments.
+static GVariant *_fcitx_g_client_process_key_args(guint32 keyval,
+                                                  guint32 keycode,
+                                                  guint32 state,
+                                                  gboolean isRelease,
+                                                  guint32 t) {
+    return g_variant_ref_sink(
+        g_variant_new("(uuubu)", keyval, keycode, state, isRelease, t));
+}
 
-#define STATIC_INTERFACE_INFO(FUNCTION, XML)                                   \
-    static GDBusInterfaceInfo *FUNCTION(void) {                                \
-        static gsize has_info = 0;                                             \
-        static GDBusInterfaceInfo *info = NULL;                                \
-        if (g_once_init_enter(&has_info)) {                                    \
-            GDBusNodeInfo *introspection_data;                                 \
-            introspection_data = g_dbus_node_info_new_for_xml(XML, NULL);      \
-            info = introspection_data->interfaces[0];                          \
-            g_once_init_leave(&has_info, 1);                                   \
-        }                                                                      \
-        return info;                                                           \
+static GVariant *_fcitx_g_client_create_ic_args(const gchar *display,
+                                                const gchar *program) {
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ss)"));
+    if (display) {
+        g_variant_builder_add(&builder, "(ss)", "display", display);
+    }
+    if (program) {
+        g_variant_builder_add(&builder, "(ss)", "program", program);
     }
+    return g_variant_ref_sink(g_variant_new("(a(ss))", &builder));
+}
 
-STATIC_INTERFACE_INFO(_fcitx_g_client_get_interface_info, introspection_xml)
-STATIC_INTERFACE_INFO(_fcitx_g_client_get_clientic_info, ic_introspection_xml)
+static guint32 _fcitx_g_client_unpack_version(GVariant *result) {
+    guint32 version;
+    g_variant_get(result, "(u)", &version);
+    return version;
+}
+
+// Returns the object path of the new input context, owned by result.
+static const gchar *_fcitx_g_client_unpack_create_ic(GVariant *result,
+                                                     guint8 uuid[16]) {
+    const gchar *path;
+    g_autoptr(GVariant) uuidVariant = NULL;
+    g_variant_get(result, "(&o@ay)", &path, &uuidVariant);
+    gsize size = 0;
+    const guint8 *bytes = g_variant_get_fixed_array(uuidVariant, &size, 1);
+    if (size == 16) {
+        memcpy(uuid, bytes, 16);
+    }
+    return path;
+}
+
+static gboolean _fcitx_g_client_unpack_process_key(GVariant *result) {
+    gboolean ret = FALSE;
+    g_variant_get(result, "(b)", &ret);
+    return ret;
+}
 
 static void fcitx_g_client_class_init(FcitxGClientClass *klass) {
     GObjectClass *gobject_class;
@@ -390,6 +407,9 @@ static void fcitx_g_client_init(FcitxGClient *self) {
     self->priv->watch_id = 0;
     self->priv->version = 0;
     self->priv->batch = TRUE;
+    self->priv->has_focus = FALSE;
+    self->priv->lazy_connect = FALSE;
+    self->priv->connected_once = FALSE;
 }
 
 static void fcitx_g_client_constructed(GObject *object) {
@@ -417,10 +437,14 @@ static void fcitx_g_client_dispose(GObject *object) {
     FcitxGClient *self = FCITX_G_CLIENT(object);
 
     if (self->priv->icproxy) {
-        g_dbus_proxy_call(self->priv->icproxy, "DestroyIC", NULL,
-                          G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+        g_signal_handlers_disconnect_by_func(
+            self->priv->icproxy, G_CALLBACK(_fcitx_g_client_g_signal), self);
+        _fcitx_g_watcher_queue_destroy_ic(
+            self->priv->watcher, g_steal_pointer(&self->priv->icproxy));
     }
 
+    _fcitx_g_watcher_cancel_reconnect(self->priv->watcher, self);
+    _fcitx_g_watcher_set_focus_client(self->priv->watcher, self, FALSE);
     g_signal_handlers_disconnect_by_data(self->priv->watcher, self);
     _fcitx_g_client_clean_up(self);
 
@@ -446,12 +470,17 @@ const guint8 *fcitx_g_client_get_uuid(FcitxGClient *self) {
  * fcitx_g_client_focus_in:
  * @self: A #FcitxGClient
  *
- * tell fcitx current client has focus
+ * tell fcitx current client has focus, if the input context is not created
+ * yet, it will be created with priority.
  **/
 void fcitx_g_client_focus_in(FcitxGClient *self) {
-    g_return_if_fail(fcitx_g_client_is_valid(self));
-    g_dbus_proxy_call(self->priv->icproxy, "FocusIn", NULL,
-                      G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+    self->priv->has_focus = TRUE;
+    _fcitx_g_watcher_set_focus_client(self->priv->watcher, self, TRUE);
+    if (!fcitx_g_client_is_valid(self)) {
+        _fcitx_g_client_schedule_create_ic(self);
+        return;
+    }
+    _fcitx_g_client_ic_focus_in(self);
 }
 
 /**
@@ -461,9 +490,15 @@ void fcitx_g_client_focus_in(FcitxGClient *self) {
  * tell fcitx current client has lost focus
  **/
 void fcitx_g_client_focus_out(FcitxGClient *self) {
-    g_return_if_fail(fcitx_g_client_is_valid(self));
-    g_dbus_proxy_call(self->priv->icproxy, "FocusOut", NULL,
-                      G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+    self->priv->has_focus = FALSE;
+    _fcitx_g_watcher_set_focus_client(self->priv->watcher, self, FALSE);
+    if (!fcitx_g_client_is_valid(self)) {
+        if (_fcitx_g_client_defer_reconnect(self)) {
+            _fcitx_g_watcher_cancel_reconnect(self->priv->watcher, self);
+        }
+        return;
+    }
+    _fcitx_g_client_ic_focus_out(self);
 }
 
 /**
@@ -474,8 +509,7 @@ void fcitx_g_client_focus_out(FcitxGClient *self) {
  **/
 void fcitx_g_client_reset(FcitxGClient *self) {
     g_return_if_fail(fcitx_g_client_is_valid(self));
-    g_dbus_proxy_call(self->priv->icproxy, "Reset", NULL,
-                      G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+    _fcitx_g_client_ic_reset(self);
 }
 
 /**
@@ -487,9 +521,7 @@ void fcitx_g_client_reset(FcitxGClient *self) {
  **/
 void fcitx_g_client_set_capability(FcitxGClient *self, guint64 flags) {
     g_return_if_fail(fcitx_g_client_is_valid(self));
-    g_dbus_proxy_call(self->priv->icproxy, "SetCapability",
-                      g_variant_new("(t)", flags), G_DBUS_CALL_FLAGS_NONE, -1,
-                      NULL, NULL, NULL);
+    _fcitx_g_client_ic_set_capability(self, flags);
 }
 
 /**
@@ -506,9 +538,7 @@ void fcitx_g_client_set_cursor_rect(FcitxGClient *self, gint x, gint y, gint w,
                                     gint h) {
 
     g_return_if_fail(fcitx_g_client_is_valid(self));
-    g_dbus_proxy_call(self->priv->icproxy, "SetCursorRect",
-                      g_variant_new("(iiii)", x, y, w, h),
-                      G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+    _fcitx_g_client_ic_set_cursor_rect(self, x, y, w, h);
 }
 
 /**
@@ -527,9 +557,7 @@ void fcitx_g_client_set_cursor_rect_with_scale_factor(FcitxGClient *self,
                                                       gint h, gdouble scale) {
 
     g_return_if_fail(fcitx_g_client_is_valid(self));
-    g_dbus_proxy_call(self->priv->icproxy, "SetCursorRectV2",
-                      g_variant_new("(iiiid)", x, y, w, h, scale),
-                      G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+    _fcitx_g_client_ic_set_cursor_rect_v2(self, x, y, w, h, scale);
 }
 
 /**
@@ -540,8 +568,7 @@ void fcitx_g_client_set_cursor_rect_with_scale_factor(FcitxGClient *self,
  **/
 void fcitx_g_client_prev_page(FcitxGClient *self) {
     g_return_if_fail(fcitx_g_client_is_valid(self));
-    g_dbus_proxy_call(self->priv->icproxy, "PrevPage", NULL,
-                      G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+    _fcitx_g_client_ic_prev_page(self);
 }
 
 /**
@@ -552,8 +579,7 @@ void fcitx_g_client_prev_page(FcitxGClient *self) {
  **/
 void fcitx_g_client_next_page(FcitxGClient *self) {
     g_return_if_fail(fcitx_g_client_is_valid(self));
-    g_dbus_proxy_call(self->priv->icproxy, "NextPage", NULL,
-                      G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+    _fcitx_g_client_ic_next_page(self);
 }
 
 /**
@@ -565,9 +591,7 @@ void fcitx_g_client_next_page(FcitxGClient *self) {
  **/
 void fcitx_g_client_select_candidate(FcitxGClient *self, int index) {
     g_return_if_fail(fcitx_g_client_is_valid(self));
-    g_dbus_proxy_call(self->priv->icproxy, "SelectCandidate",
-                      g_variant_new("(i)", index), G_DBUS_CALL_FLAGS_NONE, -1,
-                      NULL, NULL, NULL);
+    _fcitx_g_client_ic_select_candidate(self, index);
 }
 
 /**
@@ -581,13 +605,9 @@ void fcitx_g_client_set_surrounding_text(FcitxGClient *self, gchar *text,
                                          guint cursor, guint anchor) {
     g_return_if_fail(fcitx_g_client_is_valid(self));
     if (text) {
-        g_dbus_proxy_call(self->priv->icproxy, "SetSurroundingText",
-                          g_variant_new("(suu)", text, cursor, anchor),
-                          G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+        _fcitx_g_client_ic_set_surrounding_text(self, text, cursor, anchor);
     } else {
-        g_dbus_proxy_call(self->priv->icproxy, "SetSurroundingTextPosition",
-                          g_variant_new("(uu)", cursor, anchor),
-                          G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+        _fcitx_g_client_ic_set_surrounding_text_position(self, cursor, anchor);
     }
 }
 
@@ -622,7 +642,7 @@ static gboolean _fcitx_g_client_handle_process_key_reply(FcitxGClient *self,
             g_variant_unref(event);
         }
     } else {
-        g_variant_get(result, "(b)", &ret);
+        ret = _fcitx_g_client_unpack_process_key(result);
     }
     return ret;
 }
@@ -641,10 +661,15 @@ gboolean fcitx_g_client_process_key_finish(FcitxGClient *self,
     g_return_val_if_fail(fcitx_g_client_is_valid(self), FALSE);
 
     gboolean ret = FALSE;
+    const char *method = _fcitx_g_client_process_key_method(self);
+    g_autoptr(GError) error = NULL;
     g_autoptr(GVariant) result =
-        g_dbus_proxy_call_finish(self->priv->icproxy, res, NULL);
+        g_dbus_proxy_call_finish(self->priv->icproxy, res, &error);
     if (result) {
+        _fcitx_g_client_journal(self, FCITX_G_JOURNAL_REPLY, method, result);
         ret = _fcitx_g_client_handle_process_key_reply(self, result);
+    } else {
+        _fcitx_g_client_journal_error(self, method, error);
     }
     return ret;
 }
@@ -688,14 +713,14 @@ void fcitx_g_client_process_key(FcitxGClient *self, guint32 keyval,
     pk->self = g_object_ref(self);
     pk->callback = callback;
     pk->user_data = user_data;
-    const char *method = (self->priv->version > 0 && self->priv->batch)
-                             ? "ProcessKeyEventBatch"
-                             : "ProcessKeyEvent";
-    g_dbus_proxy_call(
-        self->priv->icproxy, method,
-        g_variant_new("(uuubu)", keyval, keycode, state, isRelease, t),
-        G_DBUS_CALL_FLAGS_NONE, timeout_msec, cancellable,
-        _fcitx_g_client_process_key_cb, pk);
+    const char *method = _fcitx_g_client_process_key_method(self);
+    GVariant *parameters = _fcitx_g_client_process_key_args(
+        keyval, keycode, state, isRelease, t);
+    _fcitx_g_client_journal(self, FCITX_G_JOURNAL_CALL, method, parameters);
+    g_dbus_proxy_call(self->priv->icproxy, method, parameters,
+                      G_DBUS_CALL_FLAGS_NONE, timeout_msec, cancellable,
+                      _fcitx_g_client_process_key_cb, pk);
+    g_variant_unref(parameters);
 }
 
 /**
@@ -717,16 +742,20 @@ gboolean fcitx_g_client_process_key_sync(FcitxGClient *self, guint32 keyval,
     g_return_val_if_fail(fcitx_g_client_is_valid(self), FALSE);
     gboolean ret = FALSE;
 
-    const char *method = (self->priv->version > 0 && self->priv->batch)
-                             ? "ProcessKeyEventBatch"
-                             : "ProcessKeyEvent";
-    g_autoptr(GVariant) result = g_dbus_proxy_call_sync(
-        self->priv->icproxy, method,
-        g_variant_new("(uuubu)", keyval, keycode, state, isRelease, t),
-        G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+    const char *method = _fcitx_g_client_process_key_method(self);
+    g_autoptr(GVariant) parameters = _fcitx_g_client_process_key_args(
+        keyval, keycode, state, isRelease, t);
+    _fcitx_g_client_journal(self, FCITX_G_JOURNAL_CALL, method, parameters);
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GVariant) result =
+        g_dbus_proxy_call_sync(self->priv->icproxy, method, parameters,
+                               G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
 
     if (result) {
+        _fcitx_g_client_journal(self, FCITX_G_JOURNAL_REPLY, method, result);
         ret = _fcitx_g_client_handle_process_key_reply(self, result);
+    } else {
+        _fcitx_g_client_journal_error(self, method, error);
     }
     return ret;
 }
@@ -736,25 +765,46 @@ _fcitx_g_client_availability_changed(G_GNUC_UNUSED FcitxGWatcher *connection,
                                      G_GNUC_UNUSED gboolean avail,
                                      gpointer user_data) {
     FcitxGClient *self = user_data;
-    _fcitx_g_client_update_availability(self);
+    if (fcitx_g_watcher_is_service_available(self->priv->watcher)) {
+        _fcitx_g_client_schedule_create_ic(self);
+    } else {
+        _fcitx_g_client_clean_up(self);
+    }
 }
 
-static void _fcitx_g_client_update_availability(FcitxGClient *self) {
-    g_timeout_add_full(G_PRIORITY_DEFAULT, 100, _fcitx_g_client_recheck,
-                       g_object_ref(self), g_object_unref);
+static void _fcitx_g_client_schedule_create_ic(FcitxGClient *self) {
+    // Check we are not valid or in the process of create ic.
+    if (fcitx_g_client_is_valid(self) || self->priv->cancellable != NULL ||
+        !fcitx_g_watcher_is_service_available(self->priv->watcher)) {
+        return;
+    }
+    // Lazy client will be scheduled on next focus in.
+    if (_fcitx_g_client_defer_reconnect(self)) {
+        return;
+    }
+    // Only re-creating it after the connection was lost is staggered.
+    if (!self->priv->connected_once) {
+        _fcitx_g_client_create_ic(self);
+        return;
+    }
+    _fcitx_g_watcher_schedule_reconnect(self->priv->watcher, self,
+                                        _fcitx_g_client_recheck);
+}
+
+static gboolean _fcitx_g_client_defer_reconnect(FcitxGClient *self) {
+    // The first input context is always created eagerly, laziness only
+    // applies to re-creating it.
+    return self->priv->lazy_connect && self->priv->connected_once &&
+           !self->priv->has_focus;
 }
 
-static gboolean _fcitx_g_client_recheck(gpointer user_data) {
+static void _fcitx_g_client_recheck(gpointer user_data) {
     FcitxGClient *self = user_data;
     // Check we are not valid or in the process of create ic.
     if (!fcitx_g_client_is_valid(self) && self->priv->cancellable == NULL &&
         fcitx_g_watcher_is_service_available(self->priv->watcher)) {
         _fcitx_g_client_create_ic(self);
     }
-    if (!fcitx_g_watcher_is_service_available(self->priv->watcher)) {
-        _fcitx_g_client_clean_up(self);
-    }
-    return FALSE;
 }
 
 static void _fcitx_g_client_create_ic(FcitxGClient *self) {
@@ -785,7 +835,7 @@ _fcitx_g_client_service_vanished(G_GNUC_UNUSED GDBusConnection *conn,
                                  gpointer user_data) {
     FcitxGClient *self = user_data;
     _fcitx_g_client_clean_up(self);
-    _fcitx_g_client_update_availability(self);
+    _fcitx_g_client_schedule_create_ic(self);
 }
 
 static void
@@ -808,6 +858,7 @@ _fcitx_g_client_create_ic_phase1_finished(G_GNUC_UNUSED GObject *source_object,
 
     self->priv->cancellable = g_cancellable_new();
 
+    _fcitx_g_client_journal(self, FCITX_G_JOURNAL_CALL, "Version", NULL);
     g_dbus_proxy_call(self->priv->improxy, "Version", NULL,
                       G_DBUS_CALL_FLAGS_NONE, -1, /* timeout */
                       self->priv->cancellable, _fcitx_g_client_version_cb,
@@ -823,12 +874,19 @@ static void _fcitx_g_client_version_cb(G_GNUC_UNUSED GObject *source_object,
     g_autoptr(GVariant) result =
         g_dbus_proxy_call_finish(G_DBUS_PROXY(source_object), res, &error);
 
+    if (result) {
+        _fcitx_g_client_journal(self, FCITX_G_JOURNAL_REPLY, "Version",
+                                result);
+    } else {
+        _fcitx_g_client_journal_error(self, "Version", error);
+    }
+
     if (error && g_dbus_error_is_remote_error(error) &&
         g_strcmp0(g_dbus_error_get_remote_error(error),
                   "org.freedesktop.DBus.Error.UnknownMethod") == 0) {
         self->priv->version = 0;
     } else if (result) {
-        g_variant_get(result, "(u)", &self->priv->version);
+        self->priv->version = _fcitx_g_client_unpack_version(result);
     } else {
         _fcitx_g_client_clean_up(self);
         g_object_unref(self);
@@ -837,16 +895,11 @@ static void _fcitx_g_client_version_cb(G_GNUC_UNUSED GObject *source_object,
 
     self->priv->cancellable = g_cancellable_new();
 
-    GVariantBuilder builder;
-    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ss)"));
-    if (self->priv->display) {
-        g_variant_builder_add(&builder, "(ss)", "display", self->priv->display);
-    }
-    if (self->priv->program) {
-        g_variant_builder_add(&builder, "(ss)", "program", self->priv->program);
-    }
-    g_dbus_proxy_call(self->priv->improxy, "CreateInputContext",
-                      g_variant_new("(a(ss))", &builder),
+    g_autoptr(GVariant) parameters = _fcitx_g_client_create_ic_args(
+        self->priv->display, self->priv->program);
+    _fcitx_g_client_journal(self, FCITX_G_JOURNAL_CALL, "CreateInputContext",
+                            parameters);
+    g_dbus_proxy_call(self->priv->improxy, "CreateInputContext", parameters,
                       G_DBUS_CALL_FLAGS_NONE, -1, /* timeout */
                       self->priv->cancellable, _fcitx_g_client_create_ic_cb,
                       self);
@@ -858,33 +911,21 @@ static void _fcitx_g_client_create_ic_cb(GObject *source_object,
     FcitxGClient *self = (FcitxGClient *)user_data;
     g_clear_object(&self->priv->cancellable);
 
+    g_autoptr(GError) error = NULL;
     g_autoptr(GVariant) result =
-        g_dbus_proxy_call_finish(G_DBUS_PROXY(source_object), res, NULL);
+        g_dbus_proxy_call_finish(G_DBUS_PROXY(source_object), res, &error);
 
     if (!result) {
+        _fcitx_g_client_journal_error(self, "CreateInputContext", error);
         _fcitx_g_client_clean_up(self);
         g_object_unref(self);
         return;
     }
+    _fcitx_g_client_journal(self, FCITX_G_JOURNAL_REPLY, "CreateInputContext",
+                            result);
 
-    GVariantIter iter;
-    GVariantIter inner;
-    g_variant_iter_init(&iter, result);
-    g_autoptr(GVariant) pathVariant = g_variant_iter_next_value(&iter);
-    const gchar *path = g_variant_get_string(pathVariant, NULL);
-    g_autoptr(GVariant) uuidVariant = g_variant_iter_next_value(&iter);
-    size_t size = g_variant_iter_init(&inner, uuidVariant);
-    if (size == 16) {
-        int i = 0;
-        GVariant *byte;
-        while ((byte = g_variant_iter_next_value(&inner))) {
-            self->priv->uuid[i] = g_variant_get_byte(byte);
-            i++;
-            g_variant_unref(byte);
-        }
-    }
-
-    self->priv->icname = g_strdup(path);
+    self->priv->icname = g_strdup(
+        _fcitx_g_client_unpack_create_ic(result, self->priv->uuid));
     self->priv->cancellable = g_cancellable_new();
     g_dbus_proxy_new(
         g_dbus_proxy_get_connection(self->priv->improxy),
@@ -910,6 +951,7 @@ _fcitx_g_client_create_ic_phase2_finished(G_GNUC_UNUSED GObject *source_object,
         return;
     }
 
+    self->priv->connected_once = TRUE;
     g_signal_connect(self->priv->icproxy, "g-signal",
                      G_CALLBACK(_fcitx_g_client_g_signal), self);
     g_signal_emit(self, signals[CONNECTED_SIGNAL], 0);
@@ -1024,6 +1066,8 @@ static void _fcitx_g_client_g_signal(G_GNUC_UNUSED GDBusProxy *proxy,
                                      G_GNUC_UNUSED gchar *sender_name,
                                      gchar *signal_name, GVariant *parameters,
                                      gpointer user_data) {
+    _fcitx_g_client_journal(user_data, FCITX_G_JOURNAL_SIGNAL, signal_name,
+                            parameters);
     if (g_strcmp0(signal_name, "CommitString") == 0) {
         _fcitx_g_client_handle_commit_string(user_data, parameters);
     } else if (g_strcmp0(signal_name, "CurrentIM") == 0) {
@@ -1152,6 +1196,30 @@ void fcitx_g_client_set_use_batch_process_key_event(FcitxGClient *self,
     self->priv->batch = batch;
 }
 
+/**
+ * fcitx_g_client_set_lazy_connect:
+ * @self: A #FcitxGClient
+ * @lazy: whether only re-create input context when focused
+ *
+ * Set whether to defer re-creating the input context, e.g. after fcitx
+ * restarts, until the client gains focus with fcitx_g_client_focus_in(),
+ * default is false. The first input context is always created right away.
+ *
+ * A lazy client must report every focus change with fcitx_g_client_focus_in()
+ * and fcitx_g_client_focus_out(), also while fcitx_g_client_is_valid() returns
+ * false, otherwise its input context is never re-created.
+ *
+ * Since: 5.1.8
+ **/
+void fcitx_g_client_set_lazy_connect(FcitxGClient *self, gboolean lazy) {
+    self->priv->lazy_connect = lazy;
+    if (_fcitx_g_client_defer_reconnect(self)) {
+        _fcitx_g_watcher_cancel_reconnect(self->priv->watcher, self);
+    } else {
+        _fcitx_g_client_schedule_create_ic(self);
+    }
+}
+
 /**
  * fcitx_g_client_is_valid:
  * @self: A #FcitxGClient
@@ -1183,6 +1251,31 @@ static void fcitx_g_client_set_property(GObject *gobject, guint prop_id,
     }
 }
 
+static void _fcitx_g_client_journal(FcitxGClient *self,
+                                    FcitxGJournalRecordType type,
+                                    const gchar *member, GVariant *payload) {
+    _fcitx_g_journal_record(type, self->priv->icname, member, payload);
+}
+
+static void _fcitx_g_client_journal_error(FcitxGClient *self,
+                                          const gchar *member,
+                                          const GError *error) {
+    _fcitx_g_journal_record_error(self->priv->icname, member, error);
+}
+
+static void _fcitx_g_client_call_ic(FcitxGClient *self, const gchar *method,
+                                    GVariant *parameters) {
+    if (parameters) {
+        g_variant_ref_sink(parameters);
+    }
+    _fcitx_g_client_journal(self, FCITX_G_JOURNAL_CALL, method, parameters);
+    g_dbus_proxy_call(self->priv->icproxy, method, parameters,
+                      G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+    if (parameters) {
+        g_variant_unref(parameters);
+    }
+}
+
 static void _fcitx_g_client_clean_up(FcitxGClient *self) {
     if (self->priv->cancellable) {
         g_cancellable_cancel(self->priv->cancellable);
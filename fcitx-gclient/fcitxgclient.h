@@ -56,6 +56,7 @@ void fcitx_g_client_set_display(FcitxGClient *self, const gchar *display);
 void fcitx_g_client_set_program(FcitxGClient *self, const gchar *program);
 void fcitx_g_client_set_use_batch_process_key_event(FcitxGClient *self,
                                                     gboolean batch);
+void fcitx_g_client_set_lazy_connect(FcitxGClient *self, gboolean lazy);
 void fcitx_g_client_set_cursor_rect(FcitxGClient *self, gint x, gint y, gint w,
                                     gint h);
 void fcitx_g_client_set_cursor_rect_with_scale_factor(FcitxGClient *self,
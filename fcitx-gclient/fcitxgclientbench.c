@@ -0,0 +1,244 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/*
+ * gclient-bench measures FcitxGClient against fcitx5-gtk-mockd on a private
+ * bus: the bring-up time of input contexts created one after another, the
+ * round trip of key events on one of them, and how fast the signals of the
+ * input context are decoded into FcitxGClient signals. Arguments after "--"
+ * are passed on to fcitx5-gtk-mockd, e.g. to add latency or a script.
+ */
+
+#include "fcitxgbenchprivate.h"
+#include "fcitxgclient.h"
+#include "fcitxgstandinprivate.h"
+
+typedef struct _FcitxGClientBenchFlood FcitxGClientBenchFlood;
+
+struct _FcitxGClientBenchFlood {
+    guint received;
+    gboolean replied;
+    gboolean done;
+    guint count;
+    GError *error;
+};
+
+static gint contexts = 100;
+static gint keys = 1000;
+static gint signal_count = 10000;
+static gboolean sync_keys = FALSE;
+static gboolean no_batch = FALSE;
+
+static GOptionEntry entries[] = {
+    {"contexts", 'c', 0, G_OPTION_ARG_INT, &contexts,
+     "Number of input contexts to bring up", "N"},
+    {"keys", 'k', 0, G_OPTION_ARG_INT, &keys,
+     "Number of key presses and releases to send", "N"},
+    {"signals", 's', 0, G_OPTION_ARG_INT, &signal_count,
+     "Number of signals of each kind to decode", "N"},
+    {"sync", 0, 0, G_OPTION_ARG_NONE, &sync_keys,
+     "Send key events synchronously, dropped replies then stall for the "
+     "default D-Bus timeout",
+     NULL},
+    {"no-batch", 0, 0, G_OPTION_ARG_NONE, &no_batch,
+     "Use ProcessKeyEvent instead of ProcessKeyEventBatch", NULL},
+    {NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
+
+static const gchar *const flooded_signals[][2] = {
+    {"CommitString", "commit-string"},
+    {"UpdateFormattedPreedit", "update-formatted-preedit"},
+    {"UpdateClientSideUI", "update-client-side-ui"},
+};
+
+static void _fcitx_g_client_bench_set_done(gboolean *done) { *done = TRUE; }
+
+static void _fcitx_g_client_bench_count(guint *count) { (*count)++; }
+
+static void _fcitx_g_client_bench_key_finished(GObject *source_object,
+                                               GAsyncResult *res,
+                                               gpointer user_data) {
+    fcitx_g_client_process_key_finish(FCITX_G_CLIENT(source_object), res);
+    _fcitx_g_client_bench_set_done(user_data);
+}
+
+static void
+_fcitx_g_client_bench_flood_received(FcitxGClientBenchFlood *flood) {
+    flood->received++;
+    flood->done = flood->replied && flood->received >= flood->count;
+}
+
+static void _fcitx_g_client_bench_flood_finished(GObject *source_object,
+                                                 GAsyncResult *res,
+                                                 gpointer user_data) {
+    FcitxGClientBenchFlood *flood = user_data;
+    g_autoptr(GVariant) result = g_dbus_connection_call_finish(
+        G_DBUS_CONNECTION(source_object), res, &flood->error);
+    flood->replied = TRUE;
+    flood->done = flood->error || flood->received >= flood->count;
+}
+
+static void _fcitx_g_client_bench_print_messages(const gchar *name,
+                                                 guint messages, guint count,
+                                                 const gchar *unit) {
+    g_print("%s messages sent: %u (%.2f per %s)\n", name, messages,
+            count ? (gdouble)messages / count : 0.0, unit);
+}
+
+static gboolean _fcitx_g_client_bench_bring_up(FcitxGBenchBus *bus,
+                                               GPtrArray *clients) {
+    g_autoptr(GArray) latency = g_array_new(FALSE, FALSE, sizeof(gint64));
+    guint messages = _fcitx_g_bench_messages_sent();
+    gint64 start = g_get_monotonic_time();
+    for (gint i = 0; i < contexts; i++) {
+        gboolean connected = FALSE;
+        gint64 time = g_get_monotonic_time();
+        FcitxGClient *client = fcitx_g_client_new_with_watcher(bus->watcher);
+        g_ptr_array_add(clients, client);
+        gulong id = g_signal_connect_swapped(
+            client, "connected", G_CALLBACK(_fcitx_g_client_bench_set_done),
+            &connected);
+        if (!_fcitx_g_bench_wait(&connected, FCITX_G_BENCH_TIMEOUT_SECONDS)) {
+            g_printerr("Timed out creating an input context\n");
+            return FALSE;
+        }
+        g_signal_handler_disconnect(client, id);
+        time = g_get_monotonic_time() - time;
+        g_array_append_val(latency, time);
+    }
+    g_print("bring-up wall time (ms): %.3f\n",
+            _fcitx_g_bench_ms(g_get_monotonic_time() - start));
+    _fcitx_g_bench_print_latency("bring-up", latency);
+    _fcitx_g_client_bench_print_messages(
+        "bring-up", _fcitx_g_bench_messages_sent() - messages, latency->len,
+        "context");
+    return TRUE;
+}
+
+static gboolean _fcitx_g_client_bench_keys(FcitxGClient *client) {
+    g_autoptr(GArray) press = g_array_new(FALSE, FALSE, sizeof(gint64));
+    g_autoptr(GArray) release = g_array_new(FALSE, FALSE, sizeof(gint64));
+    guint received = 0;
+    for (guint i = 0; i < G_N_ELEMENTS(flooded_signals); i++) {
+        g_signal_connect_swapped(client, flooded_signals[i][1],
+                                 G_CALLBACK(_fcitx_g_client_bench_count),
+                                 &received);
+    }
+    fcitx_g_client_set_use_batch_process_key_event(client, !no_batch);
+    fcitx_g_client_focus_in(client);
+
+    guint messages = _fcitx_g_bench_messages_sent();
+    for (gint i = 0; i < keys * 2; i++) {
+        guint32 keyval = 'a' + (i / 2) % 26;
+        gboolean is_release = i % 2;
+        gint64 time = g_get_monotonic_time();
+        if (sync_keys) {
+            fcitx_g_client_process_key_sync(client, keyval, 0, 0, is_release,
+                                            i);
+        } else {
+            gboolean done = FALSE;
+            fcitx_g_client_process_key(
+                client, keyval, 0, 0, is_release, i,
+                FCITX_G_BENCH_TIMEOUT_SECONDS * 1000, NULL,
+                _fcitx_g_client_bench_key_finished, &done);
+            _fcitx_g_bench_wait(&done, FCITX_G_BENCH_TIMEOUT_SECONDS + 1);
+        }
+        time = g_get_monotonic_time() - time;
+        g_array_append_val(is_release ? release : press, time);
+    }
+    _fcitx_g_bench_print_latency("key press", press);
+    _fcitx_g_bench_print_latency("key release", release);
+    _fcitx_g_client_bench_print_messages(
+        "key", _fcitx_g_bench_messages_sent() - messages, keys * 2,
+        "key event");
+    g_print("key signals received: %u\n", received);
+    g_signal_handlers_disconnect_by_data(client, &received);
+    return TRUE;
+}
+
+static gboolean _fcitx_g_client_bench_signals(FcitxGClient *client) {
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GDBusConnection) connection =
+        g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+    if (!connection) {
+        g_printerr("Failed to connect to the bus: %s\n", error->message);
+        return FALSE;
+    }
+
+    for (guint i = 0; i < G_N_ELEMENTS(flooded_signals); i++) {
+        FcitxGClientBenchFlood flood = {0};
+        flood.count = signal_count;
+        gulong id = g_signal_connect_swapped(
+            client, flooded_signals[i][1],
+            G_CALLBACK(_fcitx_g_client_bench_flood_received), &flood);
+        gint64 time = g_get_monotonic_time();
+        g_dbus_connection_call(
+            connection, FCITX_G_STAND_IN_SERVICE_NAME, FCITX_G_BENCH_MOCK_PATH,
+            FCITX_G_BENCH_MOCK_INTERFACE, "Flood",
+            g_variant_new("(su)", flooded_signals[i][0], flood.count), NULL,
+            G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+            _fcitx_g_client_bench_flood_finished, &flood);
+        gboolean done = _fcitx_g_bench_wait(&flood.done,
+                                            FCITX_G_BENCH_TIMEOUT_SECONDS);
+        time = g_get_monotonic_time() - time;
+        g_signal_handler_disconnect(client, id);
+        if (flood.error || !done) {
+            g_printerr("Failed to flood %s: %s\n", flooded_signals[i][0],
+                       flood.error ? flood.error->message : "timed out");
+            g_clear_error(&flood.error);
+            // Let the outstanding call finish before its data goes away.
+            _fcitx_g_bench_wait(&flood.replied, FCITX_G_BENCH_TIMEOUT_SECONDS);
+            return FALSE;
+        }
+        g_print("%s: %u signals in %.3f ms, %.0f signals/s\n",
+                flooded_signals[i][0], flood.received, _fcitx_g_bench_ms(time),
+                flood.received * (gdouble)G_TIME_SPAN_SECOND / MAX(time, 1));
+    }
+    return TRUE;
+}
+
+int main(int argc, char *argv[]) {
+    g_autoptr(GOptionContext) context =
+        g_option_context_new("[-- MOCKD-ARGUMENTS...]");
+    g_option_context_set_summary(
+        context, "Benchmark FcitxGClient against fcitx5-gtk-mockd.");
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_autoptr(GError) error = NULL;
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        return 1;
+    }
+    if (contexts < 1 || keys < 0 || signal_count < 0) {
+        g_printerr("Invalid count\n");
+        return 1;
+    }
+    // GOption keeps "--" when the arguments after it look like options.
+    gchar **daemon_args = argv + 1;
+    if (g_strcmp0(daemon_args[0], "--") == 0) {
+        daemon_args++;
+    }
+
+    // Do not record the benchmark.
+    g_unsetenv("FCITX_GCLIENT_JOURNAL");
+    FcitxGBenchBus bus = {0};
+    if (!_fcitx_g_bench_bus_start(&bus, (const gchar *const *)daemon_args,
+                                  &error)) {
+        g_printerr("Failed to start the daemon: %s\n", error->message);
+        return 1;
+    }
+    g_autoptr(GDBusConnection) connection =
+        g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, NULL);
+    if (connection) {
+        _fcitx_g_bench_count_messages(connection);
+    }
+
+    GPtrArray *clients = g_ptr_array_new_with_free_func(g_object_unref);
+    gboolean ok = _fcitx_g_client_bench_bring_up(&bus, clients) &&
+                  _fcitx_g_client_bench_keys(g_ptr_array_index(clients, 0)) &&
+                  _fcitx_g_client_bench_signals(g_ptr_array_index(clients, 0));
+    g_ptr_array_unref(clients);
+    _fcitx_g_bench_bus_stop(&bus);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,219 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/*
+ * gclient-stress creates, focuses, cycles and destroys many FcitxGClients
+ * against fcitx5-gtk-mockd on a private bus, for 10, 100, ... contexts up to
+ * --max. For each round it reports the wall time and D-Bus messages sent of
+ * every phase, and how much the resident set and the malloc heap of the
+ * process grew with all contexts alive and again after they were destroyed.
+ * Arguments after "--" are passed on to fcitx5-gtk-mockd.
+ */
+
+#include "config.h"
+#include "fcitxgbenchprivate.h"
+#include "fcitxgclient.h"
+#include <stdio.h>
+#include <unistd.h>
+#ifdef HAVE_MALLINFO2
+#include <malloc.h>
+#endif
+
+typedef struct _FcitxGClientStressUsage FcitxGClientStressUsage;
+typedef struct _FcitxGClientStressConnect FcitxGClientStressConnect;
+
+struct _FcitxGClientStressUsage {
+    gint64 time;
+    guint messages;
+    gint64 rss;
+    gint64 heap;
+};
+
+struct _FcitxGClientStressConnect {
+    guint connected;
+    guint expected;
+    gboolean done;
+};
+
+static gint max_contexts = 10000;
+static gint cycles = 3;
+
+static GOptionEntry entries[] = {
+    {"max", 'm', 0, G_OPTION_ARG_INT, &max_contexts,
+     "Largest number of input contexts to create", "N"},
+    {"cycles", 'c', 0, G_OPTION_ARG_INT, &cycles,
+     "Focus cycles of every input context", "N"},
+    {NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
+
+static gint64 _fcitx_g_client_stress_rss(void) {
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%*ld %ld", &pages) != 1) {
+            pages = 0;
+        }
+        fclose(statm);
+    }
+    return (gint64)pages * sysconf(_SC_PAGESIZE);
+}
+
+static gint64 _fcitx_g_client_stress_heap(void) {
+#ifdef HAVE_MALLINFO2
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+#else
+    return -1;
+#endif
+}
+
+static void _fcitx_g_client_stress_sample(FcitxGClientStressUsage *usage) {
+    usage->time = g_get_monotonic_time();
+    usage->messages = _fcitx_g_bench_messages_sent();
+    usage->rss = _fcitx_g_client_stress_rss();
+    usage->heap = _fcitx_g_client_stress_heap();
+}
+
+/* Let the queued calls go out, so they are counted and their memory freed. */
+static void _fcitx_g_client_stress_settle(GDBusConnection *connection) {
+    while (g_main_context_iteration(NULL, FALSE)) {
+    }
+    g_dbus_connection_flush_sync(connection, NULL, NULL);
+    while (g_main_context_iteration(NULL, FALSE)) {
+    }
+}
+
+static void _fcitx_g_client_stress_print_phase(
+    const gchar *name, const FcitxGClientStressUsage *start,
+    const FcitxGClientStressUsage *end, guint n) {
+    guint messages = end->messages - start->messages;
+    g_print("  %s: wall time (ms)=%.3f messages sent=%u (%.2f per context)\n",
+            name, _fcitx_g_bench_ms(end->time - start->time), messages,
+            (gdouble)messages / n);
+}
+
+static void _fcitx_g_client_stress_print_growth(
+    const gchar *name, const FcitxGClientStressUsage *base,
+    const FcitxGClientStressUsage *usage, guint n) {
+    gint64 rss = usage->rss - base->rss;
+    g_print("  %s: rss growth (KiB)=%" G_GINT64_FORMAT " (%.0f B per context)",
+            name, rss / 1024, (gdouble)rss / n);
+    if (usage->heap >= 0) {
+        g_print(" heap growth (B)=%" G_GINT64_FORMAT " (%.0f per context)",
+                usage->heap - base->heap,
+                (gdouble)(usage->heap - base->heap) / n);
+    }
+    g_print("\n");
+}
+
+static void _fcitx_g_client_stress_connected(FcitxGClientStressConnect *data) {
+    data->connected++;
+    data->done = data->connected >= data->expected;
+}
+
+static gboolean _fcitx_g_client_stress_round(FcitxGBenchBus *bus,
+                                             GDBusConnection *connection,
+                                             guint n) {
+    FcitxGClientStressUsage base, created, focused, destroyed;
+    FcitxGClientStressConnect data = {0};
+    data.expected = n;
+    _fcitx_g_client_stress_settle(connection);
+    _fcitx_g_client_stress_sample(&base);
+
+    FcitxGClient **clients = g_new0(FcitxGClient *, n);
+    for (guint i = 0; i < n; i++) {
+        clients[i] = fcitx_g_client_new_with_watcher(bus->watcher);
+        g_signal_connect_swapped(clients[i], "connected",
+                                 G_CALLBACK(_fcitx_g_client_stress_connected),
+                                 &data);
+    }
+    gboolean ok = _fcitx_g_bench_wait(
+        &data.done, FCITX_G_BENCH_TIMEOUT_SECONDS + n / 100);
+    _fcitx_g_client_stress_settle(connection);
+    _fcitx_g_client_stress_sample(&created);
+
+    for (gint cycle = 0; ok && cycle < cycles; cycle++) {
+        for (guint i = 0; i < n; i++) {
+            FcitxGClient *client = clients[i];
+            fcitx_g_client_focus_in(client);
+            fcitx_g_client_set_capability(client, cycle);
+            fcitx_g_client_set_cursor_rect(client, i % 1000, cycle, 1, 20);
+            fcitx_g_client_set_surrounding_text(
+                client, (gchar *)"surrounding", cycle % 12, cycle % 12);
+            fcitx_g_client_reset(client);
+            fcitx_g_client_focus_out(client);
+        }
+        _fcitx_g_client_stress_settle(connection);
+    }
+    _fcitx_g_client_stress_sample(&focused);
+
+    for (guint i = 0; i < n; i++) {
+        g_signal_handlers_disconnect_by_data(clients[i], &data);
+        g_object_unref(clients[i]);
+    }
+    g_free(clients);
+    _fcitx_g_client_stress_settle(connection);
+    _fcitx_g_client_stress_sample(&destroyed);
+
+    if (!ok) {
+        g_printerr("Timed out with %u of %u input contexts connected\n",
+                   data.connected, n);
+        return FALSE;
+    }
+    g_print("contexts=%u\n", n);
+    _fcitx_g_client_stress_print_phase("create", &base, &created, n);
+    _fcitx_g_client_stress_print_phase("focus", &created, &focused, n);
+    _fcitx_g_client_stress_print_phase("destroy", &focused, &destroyed, n);
+    _fcitx_g_client_stress_print_growth("alive", &base, &created, n);
+    _fcitx_g_client_stress_print_growth("destroyed", &base, &destroyed, n);
+    return TRUE;
+}
+
+int main(int argc, char *argv[]) {
+    g_autoptr(GOptionContext) context =
+        g_option_context_new("[-- MOCKD-ARGUMENTS...]");
+    g_option_context_set_summary(
+        context, "Stress FcitxGClient with many input contexts against "
+                 "fcitx5-gtk-mockd.");
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_autoptr(GError) error = NULL;
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        return 1;
+    }
+    if (max_contexts < 1 || cycles < 0) {
+        g_printerr("Invalid count\n");
+        return 1;
+    }
+    // GOption keeps "--" when the arguments after it look like options.
+    gchar **daemon_args = argv + 1;
+    if (g_strcmp0(daemon_args[0], "--") == 0) {
+        daemon_args++;
+    }
+
+    // Do not record the benchmark.
+    g_unsetenv("FCITX_GCLIENT_JOURNAL");
+    FcitxGBenchBus bus = {0};
+    if (!_fcitx_g_bench_bus_start(&bus, (const gchar *const *)daemon_args,
+                                  &error)) {
+        g_printerr("Failed to start the daemon: %s\n", error->message);
+        return 1;
+    }
+    g_autoptr(GDBusConnection) connection =
+        g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+    if (!connection) {
+        g_printerr("Failed to connect to the bus: %s\n", error->message);
+        _fcitx_g_bench_bus_stop(&bus);
+        return 1;
+    }
+    _fcitx_g_bench_count_messages(connection);
+
+    gboolean ok = TRUE;
+    for (gint64 n = MIN(10, max_contexts); ok && n <= max_contexts; n *= 10) {
+        ok = _fcitx_g_client_stress_round(&bus, connection, n);
+    }
+    _fcitx_g_bench_bus_stop(&bus);
+    return ok ? 0 : 1;
+}
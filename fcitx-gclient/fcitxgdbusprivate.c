@@ -0,0 +1,10 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include "fcitxgdbusprivate.h"
+
+#pragma GCC visibility push(hidden)
+#include "fcitxgdbus.c"
+#pragma GCC visibility pop
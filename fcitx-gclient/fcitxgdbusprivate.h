@@ -0,0 +1,15 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef _FCITX_GCLIENT_FCITXGDBUSPRIVATE_H_
+#define _FCITX_GCLIENT_FCITXGDBUSPRIVATE_H_
+
+// gdbus-codegen has no option to make the interface info internal, keep it
+// out of the exported symbols of the library.
+#pragma GCC visibility push(hidden)
+#include "fcitxgdbus.h"
+#pragma GCC visibility pop
+
+#endif // _FCITX_GCLIENT_FCITXGDBUSPRIVATE_H_
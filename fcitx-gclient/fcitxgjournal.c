@@ -0,0 +1,54 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#include "fcitxgjournalprivate.h"
+#include <glib/gstdio.h>
+#include <stdio.h>
+
+static FILE *_fcitx_g_journal_get_file(void) {
+    static gsize has_journal = 0;
+    static FILE *journal = NULL;
+    if (g_once_init_enter(&has_journal)) {
+        const gchar *path = g_getenv("FCITX_GCLIENT_JOURNAL");
+        if (path && path[0]) {
+            journal = g_fopen(path, "ab");
+        }
+        g_once_init_leave(&has_journal, 1);
+    }
+    return journal;
+}
+
+void _fcitx_g_journal_record(FcitxGJournalRecordType type, const gchar *path,
+                             const gchar *member, GVariant *payload) {
+    static GMutex mutex;
+    FILE *journal = _fcitx_g_journal_get_file();
+    if (!journal) {
+        return;
+    }
+
+    g_autoptr(GVariant) record = g_variant_ref_sink(g_variant_new(
+        FCITX_G_JOURNAL_RECORD_TYPE, g_get_monotonic_time(), (guchar)type,
+        path ? path : "", member, payload ? payload : g_variant_new("()")));
+    gsize size = g_variant_get_size(record);
+    guint32 size_le = GUINT32_TO_LE(size);
+
+    g_mutex_lock(&mutex);
+    fwrite(&size_le, sizeof(size_le), 1, journal);
+    fwrite(g_variant_get_data(record), size, 1, journal);
+    fflush(journal);
+    g_mutex_unlock(&mutex);
+}
+
+void _fcitx_g_journal_record_error(const gchar *path, const gchar *member,
+                                   const GError *error) {
+    if (!_fcitx_g_journal_get_file() ||
+        g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        return;
+    }
+    g_autofree gchar *name = g_dbus_error_get_remote_error(error);
+    _fcitx_g_journal_record(FCITX_G_JOURNAL_ERROR, path, member,
+                            g_variant_new("(ss)", name ? name : "",
+                                          error->message));
+}
@@ -0,0 +1,44 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef _FCITX_GCLIENT_FCITXGJOURNALPRIVATE_H_
+#define _FCITX_GCLIENT_FCITXGJOURNALPRIVATE_H_
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Setting FCITX_GCLIENT_JOURNAL to a file path records the input context
+ * traffic of the process into that file, which can be used to reproduce input
+ * lag. Each record is a little-endian guint32 size, followed by a serialized
+ * GVariant of type FCITX_G_JOURNAL_RECORD_TYPE in native byte order:
+ * monotonic time in microseconds, record type, input context path, member name
+ * and the parameters.
+ *
+ * Calls and replies on the input method object, e.g. CreateInputContext, are
+ * recorded with an empty path. Errors are recorded with the (ss) payload of
+ * the D-Bus error name and message.
+ */
+#define FCITX_G_JOURNAL_RECORD_TYPE "(xyssv)"
+
+typedef enum {
+    FCITX_G_JOURNAL_CALL = 0,
+    FCITX_G_JOURNAL_REPLY,
+    FCITX_G_JOURNAL_SIGNAL,
+    FCITX_G_JOURNAL_ERROR,
+} FcitxGJournalRecordType;
+
+G_GNUC_INTERNAL void _fcitx_g_journal_record(FcitxGJournalRecordType type,
+                                             const gchar *path,
+                                             const gchar *member,
+                                             GVariant *payload);
+G_GNUC_INTERNAL void _fcitx_g_journal_record_error(const gchar *path,
+                                                   const gchar *member,
+                                                   const GError *error);
+
+G_END_DECLS
+
+#endif // _FCITX_GCLIENT_FCITXGJOURNALPRIVATE_H_
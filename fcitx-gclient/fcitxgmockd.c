@@ -0,0 +1,480 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/*
+ * fcitx5-gtk-mockd stands in for the fcitx daemon to benchmark FcitxGClient
+ * and the im modules against. It serves the session bus, or with
+ * --private-bus a bus of its own started with GTestDBus, whose address is
+ * printed on the first line of the output.
+ *
+ * Replies can be held back by a per-method latency and random jitter, and
+ * dropped at a per-method rate. Key presses are answered by the steps of a
+ * script, one step per key press, starting over at the end. Each line of the
+ * script is a step made of actions separated by ';':
+ *
+ *   commit TEXT          commit TEXT
+ *   preedit [TEXT]       show TEXT as preedit, or clear it
+ *   candidates [A B ..]  show a client side candidate list, or hide it
+ *   forward              forward the key back to the client
+ *   pass                 leave the key unhandled
+ *
+ * Key releases are always left unhandled. Batched key events get their
+ * commit, preedit and forwarded key in the reply, like fcitx does.
+ *
+ * The extra FCITX_G_BENCH_MOCK_INTERFACE object has a Flood(member, count)
+ * method, which emits count CommitString, UpdateFormattedPreedit or
+ * UpdateClientSideUI signals on the input context that was focused last.
+ */
+
+#include "fcitxgbenchprivate.h"
+#include "fcitxgstandinprivate.h"
+#include <glib-unix.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Keep in sync with the batched event types in fcitxgclient.c. */
+enum {
+    FCITX_G_MOCKD_BATCHED_COMMIT_STRING = 0,
+    FCITX_G_MOCKD_BATCHED_PREEDIT,
+    FCITX_G_MOCKD_BATCHED_FORWARD_KEY,
+};
+
+/* Candidates in a flooded UpdateClientSideUI. */
+#define FCITX_G_MOCKD_FLOOD_CANDIDATES 10
+
+typedef struct _FcitxGMockd FcitxGMockd;
+typedef struct _FcitxGMockdMethod FcitxGMockdMethod;
+typedef struct _FcitxGMockdStep FcitxGMockdStep;
+
+struct _FcitxGMockdMethod {
+    gint latency;
+    gint jitter;
+    gdouble drop;
+};
+
+struct _FcitxGMockdStep {
+    gchar *commit;
+    gchar *preedit;
+    gboolean has_preedit;
+    gchar **candidates;
+    gboolean forward;
+    gboolean pass;
+};
+
+struct _FcitxGMockd {
+    /* Member name, or "*" for any other, to FcitxGMockdMethod. */
+    GHashTable *methods;
+    GPtrArray *script;
+    guint next_step;
+    gchar *focus_path;
+    FcitxGStandIn *stand_in;
+};
+
+static const gchar default_script[] = "preedit n; candidates n N\n"
+                                      "preedit ni; candidates ni NI\n"
+                                      "commit ni; preedit; candidates\n";
+
+static gchar **latency = NULL;
+static gchar **drop = NULL;
+static gchar *script_file = NULL;
+static gint seed = 0;
+static gboolean private_bus = FALSE;
+
+static GOptionEntry entries[] = {
+    {"latency", 'l', 0, G_OPTION_ARG_STRING_ARRAY, &latency,
+     "Hold the replies of METHOD, or * for any, back by MS plus a random "
+     "jitter up to JITTER milliseconds",
+     "METHOD=MS[+JITTER]"},
+    {"drop", 'd', 0, G_OPTION_ARG_STRING_ARRAY, &drop,
+     "Drop PERCENT of the replies of METHOD, or * for any", "METHOD=PERCENT"},
+    {"script", 's', 0, G_OPTION_ARG_FILENAME, &script_file,
+     "Answer key presses with the steps in FILE", "FILE"},
+    {"seed", 0, 0, G_OPTION_ARG_INT, &seed,
+     "Seed of the jitter and the dropped replies", "SEED"},
+    {"private-bus", 'p', 0, G_OPTION_ARG_NONE, &private_bus,
+     "Start a private bus and print its address", NULL},
+    {NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
+
+static const gchar mock_introspection[] =
+    "<node>"
+    "  <interface name='" FCITX_G_BENCH_MOCK_INTERFACE "'>"
+    "    <method name='Flood'>"
+    "      <arg name='member' direction='in' type='s'/>"
+    "      <arg name='count' direction='in' type='u'/>"
+    "    </method>"
+    "  </interface>"
+    "</node>";
+
+static void _fcitx_g_mockd_step_free(gpointer data) {
+    FcitxGMockdStep *step = data;
+    g_free(step->commit);
+    g_free(step->preedit);
+    g_strfreev(step->candidates);
+    g_free(step);
+}
+
+static gboolean _fcitx_g_mockd_parse_methods(GHashTable *methods,
+                                             gchar **specs,
+                                             gboolean is_drop,
+                                             GError **error) {
+    for (guint i = 0; specs && specs[i]; i++) {
+        const gchar *value = strchr(specs[i], '=');
+        if (!value || value == specs[i]) {
+            g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                        "Invalid method setting: %s", specs[i]);
+            return FALSE;
+        }
+        g_autofree gchar *member = g_strndup(specs[i], value - specs[i]);
+        value++;
+        FcitxGMockdMethod *method = g_hash_table_lookup(methods, member);
+        if (!method) {
+            method = g_new0(FcitxGMockdMethod, 1);
+            g_hash_table_insert(methods, g_strdup(member), method);
+        }
+
+        gchar *end = NULL;
+        if (is_drop) {
+            method->drop = g_ascii_strtod(value, &end);
+        } else {
+            method->latency = g_ascii_strtoll(value, &end, 10);
+            if (*end == '+') {
+                method->jitter = g_ascii_strtoll(end + 1, &end, 10);
+            }
+        }
+        if (end == value || *end || method->latency < 0 ||
+            method->jitter < 0 || method->drop < 0 || method->drop > 100) {
+            g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                        "Invalid method setting: %s", specs[i]);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static FcitxGMockdStep *_fcitx_g_mockd_parse_step(const gchar *line,
+                                                  GError **error) {
+    FcitxGMockdStep *step = g_new0(FcitxGMockdStep, 1);
+    g_auto(GStrv) actions = g_strsplit(line, ";", -1);
+    for (guint i = 0; actions[i]; i++) {
+        gchar *action = g_strstrip(actions[i]);
+        if (!action[0]) {
+            continue;
+        }
+        gchar *arg = strchr(action, ' ');
+        if (arg) {
+            *arg = '\0';
+            arg = g_strstrip(arg + 1);
+        }
+        if (g_strcmp0(action, "commit") == 0 && arg) {
+            g_free(step->commit);
+            step->commit = g_strdup(arg);
+        } else if (g_strcmp0(action, "preedit") == 0) {
+            g_free(step->preedit);
+            step->preedit = g_strdup(arg ? arg : "");
+            step->has_preedit = TRUE;
+        } else if (g_strcmp0(action, "candidates") == 0) {
+            g_strfreev(step->candidates);
+            step->candidates = g_strsplit_set(arg ? arg : "", " ", -1);
+        } else if (g_strcmp0(action, "forward") == 0 && !arg) {
+            step->forward = TRUE;
+        } else if (g_strcmp0(action, "pass") == 0 && !arg) {
+            step->pass = TRUE;
+        } else {
+            g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                        "Invalid action: %s", action);
+            _fcitx_g_mockd_step_free(step);
+            return NULL;
+        }
+    }
+    return step;
+}
+
+static GPtrArray *_fcitx_g_mockd_parse_script(const gchar *contents,
+                                              GError **error) {
+    GPtrArray *script =
+        g_ptr_array_new_with_free_func(_fcitx_g_mockd_step_free);
+    g_auto(GStrv) lines = g_strsplit(contents, "\n", -1);
+    for (guint i = 0; lines[i]; i++) {
+        const gchar *line = g_strstrip(lines[i]);
+        if (!line[0] || line[0] == '#') {
+            continue;
+        }
+        g_autoptr(GError) step_error = NULL;
+        FcitxGMockdStep *step = _fcitx_g_mockd_parse_step(line, &step_error);
+        if (!step) {
+            g_set_error(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                        "Line %u: %s", i + 1, step_error->message);
+            g_ptr_array_unref(script);
+            return NULL;
+        }
+        g_ptr_array_add(script, step);
+    }
+    if (!script->len) {
+        g_set_error_literal(error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                            "The script has no steps");
+        g_ptr_array_unref(script);
+        return NULL;
+    }
+    return script;
+}
+
+static GVariant *_fcitx_g_mockd_preedit(const gchar *text) {
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(si)"));
+    if (text[0]) {
+        g_variant_builder_add(&builder, "(si)", text, 0);
+    }
+    return g_variant_new("(a(si)i)", &builder, (gint32)strlen(text));
+}
+
+static GVariant *_fcitx_g_mockd_client_side_ui(const gchar *const *candidates) {
+    GVariantBuilder preedit, aux_up, aux_down, list;
+    g_variant_builder_init(&preedit, G_VARIANT_TYPE("a(si)"));
+    g_variant_builder_init(&aux_up, G_VARIANT_TYPE("a(si)"));
+    g_variant_builder_init(&aux_down, G_VARIANT_TYPE("a(si)"));
+    g_variant_builder_init(&list, G_VARIANT_TYPE("a(ss)"));
+    guint n = 0;
+    for (; candidates && candidates[n]; n++) {
+        g_autofree gchar *label = g_strdup_printf("%u. ", n + 1);
+        g_variant_builder_add(&list, "(ss)", label, candidates[n]);
+    }
+    return g_variant_new("(a(si)ia(si)a(si)a(ss)iibb)", &preedit, -1, &aux_up,
+                         &aux_down, &list, n ? 0 : -1, 0, FALSE, FALSE);
+}
+
+/* Batched events go into the reply, the others are sent as signals. */
+static void _fcitx_g_mockd_add_event(FcitxGStandInAnswer *answer,
+                                     const gchar *path,
+                                     GVariantBuilder *events, guint32 type,
+                                     const gchar *member, GVariant *payload) {
+    if (events) {
+        g_variant_builder_add(events, "(uv)", type, payload);
+    } else {
+        _fcitx_g_stand_in_answer_add_signal(answer, path, member, payload);
+    }
+}
+
+static void _fcitx_g_mockd_answer_key(FcitxGMockd *mockd, const gchar *path,
+                                      const gchar *member,
+                                      GVariant *parameters,
+                                      FcitxGStandInAnswer *answer) {
+    guint32 keyval, keycode, state, time;
+    gboolean is_release;
+    g_variant_get(parameters, "(uuubu)", &keyval, &keycode, &state,
+                  &is_release, &time);
+    if (is_release) {
+        return;
+    }
+    FcitxGMockdStep *step = g_ptr_array_index(
+        mockd->script, mockd->next_step++ % mockd->script->len);
+
+    gboolean batch = g_strcmp0(member, "ProcessKeyEventBatch") == 0;
+    GVariantBuilder events;
+    g_variant_builder_init(&events, G_VARIANT_TYPE("a(uv)"));
+    GVariantBuilder *target = batch ? &events : NULL;
+    if (step->commit) {
+        _fcitx_g_mockd_add_event(answer, path, target,
+                                 FCITX_G_MOCKD_BATCHED_COMMIT_STRING,
+                                 "CommitString",
+                                 g_variant_new("(s)", step->commit));
+    }
+    if (step->has_preedit) {
+        _fcitx_g_mockd_add_event(answer, path, target,
+                                 FCITX_G_MOCKD_BATCHED_PREEDIT,
+                                 "UpdateFormattedPreedit",
+                                 _fcitx_g_mockd_preedit(step->preedit));
+    }
+    if (step->forward) {
+        _fcitx_g_mockd_add_event(answer, path, target,
+                                 FCITX_G_MOCKD_BATCHED_FORWARD_KEY,
+                                 "ForwardKey",
+                                 g_variant_new("(uub)", keyval, state, FALSE));
+    }
+    if (step->candidates) {
+        _fcitx_g_stand_in_answer_add_signal(
+            answer, path, "UpdateClientSideUI",
+            _fcitx_g_mockd_client_side_ui(
+                (const gchar *const *)step->candidates));
+    }
+
+    if (batch) {
+        _fcitx_g_stand_in_answer_set_reply(
+            answer, g_variant_new("(a(uv)b)", &events, !step->pass));
+    } else {
+        g_variant_builder_clear(&events);
+        _fcitx_g_stand_in_answer_set_reply(answer,
+                                           g_variant_new("(b)", !step->pass));
+    }
+}
+
+static void _fcitx_g_mockd_answer(G_GNUC_UNUSED FcitxGStandIn *stand_in,
+                                  const gchar *path, const gchar *member,
+                                  GVariant *parameters,
+                                  FcitxGStandInAnswer *answer,
+                                  gpointer user_data) {
+    FcitxGMockd *mockd = user_data;
+    FcitxGMockdMethod *method = g_hash_table_lookup(mockd->methods, member);
+    if (!method) {
+        method = g_hash_table_lookup(mockd->methods, "*");
+    }
+    if (method) {
+        gint delay = method->latency;
+        if (method->jitter) {
+            delay += g_random_int_range(0, method->jitter + 1);
+        }
+        _fcitx_g_stand_in_answer_set_delay(answer,
+                                           delay * G_TIME_SPAN_MILLISECOND);
+        if (method->drop > 0 && g_random_double_range(0, 100) < method->drop) {
+            _fcitx_g_stand_in_answer_drop(answer);
+        }
+    }
+
+    if (g_strcmp0(member, "FocusIn") == 0) {
+        g_free(mockd->focus_path);
+        mockd->focus_path = g_strdup(path);
+    } else if (g_strcmp0(member, "ProcessKeyEvent") == 0 ||
+               g_strcmp0(member, "ProcessKeyEventBatch") == 0) {
+        _fcitx_g_mockd_answer_key(mockd, path, member, parameters, answer);
+    }
+}
+
+static GVariant *_fcitx_g_mockd_flood_payload(const gchar *member) {
+    if (g_strcmp0(member, "CommitString") == 0) {
+        return g_variant_new("(s)", "commit");
+    }
+    if (g_strcmp0(member, "UpdateFormattedPreedit") == 0) {
+        return _fcitx_g_mockd_preedit("preedit");
+    }
+    if (g_strcmp0(member, "UpdateClientSideUI") == 0) {
+        const gchar *candidates[FCITX_G_MOCKD_FLOOD_CANDIDATES + 1] = {NULL};
+        for (guint i = 0; i < FCITX_G_MOCKD_FLOOD_CANDIDATES; i++) {
+            candidates[i] = "candidate";
+        }
+        return _fcitx_g_mockd_client_side_ui(candidates);
+    }
+    return NULL;
+}
+
+static void _fcitx_g_mockd_method_call(
+    G_GNUC_UNUSED GDBusConnection *connection,
+    G_GNUC_UNUSED const gchar *sender, G_GNUC_UNUSED const gchar *object_path,
+    G_GNUC_UNUSED const gchar *interface_name,
+    G_GNUC_UNUSED const gchar *method_name, GVariant *parameters,
+    GDBusMethodInvocation *invocation, gpointer user_data) {
+    FcitxGMockd *mockd = user_data;
+    const gchar *member;
+    guint32 count;
+    g_variant_get(parameters, "(&su)", &member, &count);
+    GVariant *payload = _fcitx_g_mockd_flood_payload(member);
+    if (!payload || !mockd->focus_path) {
+        g_dbus_method_invocation_return_dbus_error(
+            invocation, "org.freedesktop.DBus.Error.InvalidArgs",
+            payload ? "No input context is focused" : "Unknown signal");
+        g_clear_pointer(&payload, g_variant_unref);
+        return;
+    }
+    g_variant_ref_sink(payload);
+    for (guint32 i = 0; i < count; i++) {
+        _fcitx_g_stand_in_emit(mockd->stand_in, mockd->focus_path, member,
+                               payload);
+    }
+    g_variant_unref(payload);
+    g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static const GDBusInterfaceVTable _fcitx_g_mockd_vtable = {
+    _fcitx_g_mockd_method_call, NULL, NULL, {0}};
+
+static gboolean _fcitx_g_mockd_quit(gpointer user_data) {
+    g_main_loop_quit(user_data);
+    return FALSE;
+}
+
+static int _fcitx_g_mockd_serve(FcitxGMockd *mockd) {
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GDBusConnection) connection =
+        g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+    if (!connection) {
+        g_printerr("Failed to connect to the bus: %s\n", error->message);
+        return 1;
+    }
+    mockd->stand_in = _fcitx_g_stand_in_new(connection, _fcitx_g_mockd_answer,
+                                            mockd, &error);
+    if (!mockd->stand_in) {
+        g_printerr("Failed to export the input method: %s\n", error->message);
+        return 1;
+    }
+    g_autoptr(GDBusNodeInfo) info =
+        g_dbus_node_info_new_for_xml(mock_introspection, NULL);
+    g_dbus_connection_register_object(connection, FCITX_G_BENCH_MOCK_PATH,
+                                      info->interfaces[0],
+                                      &_fcitx_g_mockd_vtable, mockd, NULL,
+                                      NULL);
+    g_bus_own_name_on_connection(connection, FCITX_G_STAND_IN_SERVICE_NAME,
+                                 G_BUS_NAME_OWNER_FLAGS_NONE, NULL, NULL,
+                                 NULL, NULL);
+
+    // Runs until terminated, or the bus goes away.
+    GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+    g_unix_signal_add(SIGTERM, _fcitx_g_mockd_quit, loop);
+    g_unix_signal_add(SIGINT, _fcitx_g_mockd_quit, loop);
+    g_main_loop_run(loop);
+    g_main_loop_unref(loop);
+    g_clear_pointer(&mockd->stand_in, _fcitx_g_stand_in_free);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    g_autoptr(GOptionContext) context = g_option_context_new(NULL);
+    g_option_context_set_summary(
+        context, "Stand in for the fcitx daemon to benchmark the clients.");
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_autoptr(GError) error = NULL;
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        return 1;
+    }
+
+    FcitxGMockd mockd = {0};
+    mockd.methods =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    g_autofree gchar *contents = NULL;
+    if (script_file &&
+        !g_file_get_contents(script_file, &contents, NULL, &error)) {
+        g_printerr("Failed to read %s: %s\n", script_file, error->message);
+        return 1;
+    }
+    if (!_fcitx_g_mockd_parse_methods(mockd.methods, latency, FALSE,
+                                      &error) ||
+        !_fcitx_g_mockd_parse_methods(mockd.methods, drop, TRUE, &error) ||
+        !(mockd.script = _fcitx_g_mockd_parse_script(
+              contents ? contents : default_script, &error))) {
+        g_printerr("%s\n", error->message);
+        return 1;
+    }
+    if (seed) {
+        g_random_set_seed(seed);
+    }
+
+    g_autoptr(GTestDBus) bus = NULL;
+    if (private_bus) {
+        bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+        g_test_dbus_up(bus);
+        g_print("%s\n", g_test_dbus_get_bus_address(bus));
+        fflush(stdout);
+    }
+
+    int ret = _fcitx_g_mockd_serve(&mockd);
+
+    if (bus) {
+        g_test_dbus_stop(bus);
+    }
+    g_free(mockd.focus_path);
+    g_ptr_array_unref(mockd.script);
+    g_hash_table_unref(mockd.methods);
+    return ret;
+}
@@ -0,0 +1,642 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+/*
+ * fcitx5-gclient-replay replays a journal recorded with FCITX_GCLIENT_JOURNAL.
+ *
+ * It starts a private bus with GTestDBus and a stand-in daemon on it, which
+ * answers every call with the reply and the signals recorded for it. The calls
+ * are answered one by one in arrival order, like fcitx does. The recorded calls
+ * are then issued again through FcitxGClient, either at the recorded pacing or
+ * as fast as possible, and the CPU time of the client process is reported
+ * together with the input context bring-up and key round-trip latency.
+ *
+ * Signals recorded while a key event is pending are emitted right before its
+ * reply, other signals right before the reply of the last call on the same
+ * input context. The journal is read in native byte order, so it needs to be
+ * replayed on a machine with the same endianness.
+ */
+
+#include "fcitxgbenchprivate.h"
+#include "fcitxgclient.h"
+#include "fcitxgjournalprivate.h"
+#include "fcitxgstandinprivate.h"
+#include "fcitxgwatcher.h"
+#include <signal.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* Time to wait for the stand-in daemon and for each input context. */
+#define FCITX_REPLAY_TIMEOUT_SECONDS 10
+
+typedef struct _FcitxGReplayRecord FcitxGReplayRecord;
+typedef struct _FcitxGReplayExchange FcitxGReplayExchange;
+typedef struct _FcitxGReplayDriver FcitxGReplayDriver;
+typedef struct _FcitxGReplayKey FcitxGReplayKey;
+
+struct _FcitxGReplayRecord {
+    gint64 time;
+    FcitxGJournalRecordType type;
+    gchar *path;
+    gchar *member;
+    GVariant *payload;
+};
+
+/* A recorded call together with everything the daemon sent for it. */
+struct _FcitxGReplayExchange {
+    FcitxGReplayRecord *call;
+    FcitxGReplayRecord *reply;
+    GPtrArray *signals;
+};
+
+struct _FcitxGReplayDriver {
+    GPtrArray *records;
+    guint next;
+    GMainLoop *loop;
+    FcitxGWatcher *watcher;
+    gboolean started;
+    gboolean failed;
+    guint source;
+    guint timeout_source;
+    gint64 start_time;
+    gint64 first_record_time;
+
+    /* Recorded input context path to FcitxGClient. */
+    GHashTable *clients;
+    FcitxGClient *connecting;
+    gint64 connect_time;
+    guint in_flight;
+
+    guint calls;
+    guint skipped;
+    GArray *bring_up_latency;
+    GArray *key_latency;
+};
+
+struct _FcitxGReplayKey {
+    FcitxGReplayDriver *driver;
+    gint64 time;
+};
+
+static gboolean fast = FALSE;
+static gboolean stand_in_daemon = FALSE;
+
+static GOptionEntry entries[] = {
+    {"fast", 'f', 0, G_OPTION_ARG_NONE, &fast,
+     "Replay as fast as possible instead of the recorded pacing", NULL},
+    {"stand-in-daemon", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE,
+     &stand_in_daemon, NULL, NULL},
+    {NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
+
+static void _fcitx_g_replay_record_free(gpointer data) {
+    FcitxGReplayRecord *record = data;
+    g_free(record->path);
+    g_free(record->member);
+    g_variant_unref(record->payload);
+    g_free(record);
+}
+
+static gboolean _fcitx_g_replay_payload_is(GVariant *payload,
+                                           const gchar *type) {
+    return g_variant_is_of_type(payload, G_VARIANT_TYPE(type));
+}
+
+static GPtrArray *_fcitx_g_replay_load_journal(const gchar *path,
+                                               GError **error) {
+    gchar *contents = NULL;
+    gsize length = 0;
+    if (!g_file_get_contents(path, &contents, &length, error)) {
+        return NULL;
+    }
+
+    GPtrArray *records =
+        g_ptr_array_new_with_free_func(_fcitx_g_replay_record_free);
+    gsize offset = 0;
+    while (length - offset >= sizeof(guint32)) {
+        guint32 size_le;
+        memcpy(&size_le, contents + offset, sizeof(size_le));
+        offset += sizeof(size_le);
+        gsize size = GUINT32_FROM_LE(size_le);
+        if (size > length - offset) {
+            // Truncated by a crash while writing the last record.
+            break;
+        }
+        // Copy the record, so it is aligned as GVariant requires.
+        GBytes *bytes = g_bytes_new(contents + offset, size);
+        offset += size;
+        g_autoptr(GVariant) variant =
+            g_variant_ref_sink(g_variant_new_from_bytes(
+                G_VARIANT_TYPE(FCITX_G_JOURNAL_RECORD_TYPE), bytes, FALSE));
+        g_bytes_unref(bytes);
+        if (!g_variant_is_normal_form(variant)) {
+            continue;
+        }
+
+        FcitxGReplayRecord *record = g_new0(FcitxGReplayRecord, 1);
+        guchar type;
+        g_variant_get(variant, FCITX_G_JOURNAL_RECORD_TYPE, &record->time,
+                      &type, &record->path, &record->member, &record->payload);
+        record->type = type;
+        g_ptr_array_add(records, record);
+    }
+    g_free(contents);
+    return records;
+}
+
+static gboolean _fcitx_g_replay_is_key(const gchar *member) {
+    return g_strcmp0(member, "ProcessKeyEvent") == 0 ||
+           g_strcmp0(member, "ProcessKeyEventBatch") == 0;
+}
+
+static gboolean _fcitx_g_replay_expects_reply(const gchar *member) {
+    return _fcitx_g_replay_is_key(member) ||
+           g_strcmp0(member, "Version") == 0 ||
+           g_strcmp0(member, "CreateInputContext") == 0;
+}
+
+static gboolean _fcitx_g_replay_is_failed_create(FcitxGReplayRecord *record) {
+    return record->type == FCITX_G_JOURNAL_ERROR && !record->path[0] &&
+           g_strcmp0(record->member, "CreateInputContext") == 0;
+}
+
+static void _fcitx_g_replay_exchange_free(gpointer data) {
+    FcitxGReplayExchange *exchange = data;
+    g_ptr_array_unref(exchange->signals);
+    g_free(exchange);
+}
+
+static void _fcitx_g_replay_exchange_queue_free(gpointer data) {
+    g_queue_free_full(data, _fcitx_g_replay_exchange_free);
+}
+
+/*
+ * Pair every recorded call with its reply and signals, grouped by the path of
+ * the object it was called on.
+ */
+static GHashTable *_fcitx_g_replay_build_exchanges(GPtrArray *records) {
+    GHashTable *exchanges = g_hash_table_new_full(
+        g_str_hash, g_str_equal, NULL, _fcitx_g_replay_exchange_queue_free);
+    for (guint i = 0; i < records->len; i++) {
+        FcitxGReplayRecord *record = g_ptr_array_index(records, i);
+        GQueue *queue = g_hash_table_lookup(exchanges, record->path);
+        if (record->type == FCITX_G_JOURNAL_CALL) {
+            if (!queue) {
+                queue = g_queue_new();
+                g_hash_table_insert(exchanges, record->path, queue);
+            }
+            FcitxGReplayExchange *exchange = g_new0(FcitxGReplayExchange, 1);
+            exchange->call = record;
+            exchange->signals = g_ptr_array_new();
+            g_queue_push_tail(queue, exchange);
+            continue;
+        }
+        if (!queue) {
+            continue;
+        }
+
+        FcitxGReplayExchange *target = NULL;
+        for (GList *link = queue->head; link; link = link->next) {
+            FcitxGReplayExchange *exchange = link->data;
+            const gchar *member = exchange->call->member;
+            if (exchange->reply || !_fcitx_g_replay_expects_reply(member)) {
+                continue;
+            }
+            if (record->type == FCITX_G_JOURNAL_SIGNAL
+                    ? _fcitx_g_replay_is_key(member)
+                    : g_strcmp0(member, record->member) == 0) {
+                target = exchange;
+                if (_fcitx_g_replay_is_failed_create(record)) {
+                    // The client gives up on a failed input context, so
+                    // the replay does not create one for it at all.
+                    g_queue_delete_link(queue, link);
+                    _fcitx_g_replay_exchange_free(exchange);
+                    target = NULL;
+                }
+                break;
+            }
+        }
+        if (record->type == FCITX_G_JOURNAL_SIGNAL) {
+            if (!target) {
+                target = g_queue_peek_tail(queue);
+            }
+            if (target) {
+                g_ptr_array_add(target->signals, record);
+            }
+        } else if (target) {
+            target->reply = record;
+        }
+    }
+    return exchanges;
+}
+
+static FcitxGReplayExchange *
+_fcitx_g_replay_take_exchange(GHashTable *exchanges, const gchar *path,
+                              const gchar *member) {
+    GQueue *queue = g_hash_table_lookup(exchanges, path);
+    if (!queue) {
+        return NULL;
+    }
+    for (GList *link = queue->head; link; link = link->next) {
+        FcitxGReplayExchange *exchange = link->data;
+        if (g_strcmp0(exchange->call->member, member) == 0) {
+            g_queue_delete_link(queue, link);
+            return exchange;
+        }
+    }
+    return NULL;
+}
+
+/* Answer with the recorded reply and signals, if the call was recorded. */
+static void _fcitx_g_replay_answer(G_GNUC_UNUSED FcitxGStandIn *stand_in,
+                                   const gchar *path, const gchar *member,
+                                   G_GNUC_UNUSED GVariant *parameters,
+                                   FcitxGStandInAnswer *answer,
+                                   gpointer user_data) {
+    GHashTable *exchanges = user_data;
+    FcitxGReplayExchange *exchange =
+        _fcitx_g_replay_take_exchange(exchanges, path, member);
+    if (!exchange) {
+        return;
+    }
+    for (guint i = 0; i < exchange->signals->len; i++) {
+        FcitxGReplayRecord *signal = g_ptr_array_index(exchange->signals, i);
+        _fcitx_g_stand_in_answer_add_signal(answer, signal->path,
+                                            signal->member, signal->payload);
+    }
+
+    FcitxGReplayRecord *reply = exchange->reply;
+    if (reply && !fast) {
+        _fcitx_g_stand_in_answer_set_delay(answer,
+                                           reply->time - exchange->call->time);
+    }
+    if (reply && reply->type == FCITX_G_JOURNAL_ERROR) {
+        const gchar *name = NULL;
+        const gchar *message = NULL;
+        if (_fcitx_g_replay_payload_is(reply->payload, "(ss)")) {
+            g_variant_get(reply->payload, "(&s&s)", &name, &message);
+        }
+        _fcitx_g_stand_in_answer_set_error(answer, name, message);
+    } else if (reply) {
+        _fcitx_g_stand_in_answer_set_reply(answer, reply->payload);
+    }
+    _fcitx_g_replay_exchange_free(exchange);
+}
+
+static int _fcitx_g_replay_run_daemon(GPtrArray *records) {
+    GHashTable *exchanges = _fcitx_g_replay_build_exchanges(records);
+    int ret = _fcitx_g_stand_in_run(_fcitx_g_replay_answer, exchanges);
+    g_hash_table_unref(exchanges);
+    return ret;
+}
+
+static void _fcitx_g_replay_driver_step(FcitxGReplayDriver *driver);
+
+static gboolean _fcitx_g_replay_driver_timeout(gpointer user_data) {
+    FcitxGReplayDriver *driver = user_data;
+    driver->source = 0;
+    _fcitx_g_replay_driver_step(driver);
+    return FALSE;
+}
+
+static gboolean _fcitx_g_replay_driver_give_up(gpointer user_data) {
+    FcitxGReplayDriver *driver = user_data;
+    driver->timeout_source = 0;
+    g_printerr(driver->started ? "Timed out creating an input context\n"
+                               : "Timed out waiting for the daemon\n");
+    driver->failed = TRUE;
+    g_main_loop_quit(driver->loop);
+    return FALSE;
+}
+
+static void _fcitx_g_replay_driver_connected(FcitxGClient *client,
+                                             gpointer user_data) {
+    FcitxGReplayDriver *driver = user_data;
+    if (client != driver->connecting) {
+        return;
+    }
+    gint64 latency = g_get_monotonic_time() - driver->connect_time;
+    g_array_append_val(driver->bring_up_latency, latency);
+    driver->connecting = NULL;
+    g_clear_handle_id(&driver->timeout_source, g_source_remove);
+    _fcitx_g_replay_driver_step(driver);
+}
+
+static void _fcitx_g_replay_driver_key_finished(GObject *source_object,
+                                                GAsyncResult *res,
+                                                gpointer user_data) {
+    FcitxGReplayKey *key = user_data;
+    FcitxGReplayDriver *driver = key->driver;
+    FcitxGClient *client = FCITX_G_CLIENT(source_object);
+    // The input context may be destroyed by a later record at recorded pacing.
+    if (fcitx_g_client_is_valid(client)) {
+        fcitx_g_client_process_key_finish(client, res);
+    }
+    gint64 latency = g_get_monotonic_time() - key->time;
+    g_array_append_val(driver->key_latency, latency);
+    g_free(key);
+    driver->in_flight--;
+    _fcitx_g_replay_driver_step(driver);
+}
+
+static void _fcitx_g_replay_driver_create(FcitxGReplayDriver *driver,
+                                          FcitxGReplayRecord *record) {
+    const gchar *path = NULL;
+    if (!_fcitx_g_replay_payload_is(record->payload, "(oay)")) {
+        driver->skipped++;
+        return;
+    }
+    g_variant_get(record->payload, "(&o@ay)", &path, NULL);
+
+    FcitxGClient *client = fcitx_g_client_new_with_watcher(driver->watcher);
+    fcitx_g_client_set_program(client, g_get_prgname());
+    g_signal_connect(client, "connected",
+                     G_CALLBACK(_fcitx_g_replay_driver_connected), driver);
+    g_hash_table_replace(driver->clients, g_strdup(path), client);
+    driver->connecting = client;
+    driver->connect_time = g_get_monotonic_time();
+    driver->timeout_source =
+        g_timeout_add_seconds(FCITX_REPLAY_TIMEOUT_SECONDS,
+                              _fcitx_g_replay_driver_give_up, driver);
+}
+
+static void _fcitx_g_replay_driver_dispatch(FcitxGReplayDriver *driver,
+                                            FcitxGReplayRecord *record) {
+    if (!record->path[0]) {
+        _fcitx_g_replay_driver_create(driver, record);
+        return;
+    }
+
+    FcitxGClient *client = g_hash_table_lookup(driver->clients, record->path);
+    if (!client || !fcitx_g_client_is_valid(client)) {
+        driver->skipped++;
+        return;
+    }
+
+    const gchar *member = record->member;
+    GVariant *payload = record->payload;
+    driver->calls++;
+    if (g_strcmp0(member, "FocusIn") == 0) {
+        fcitx_g_client_focus_in(client);
+    } else if (g_strcmp0(member, "FocusOut") == 0) {
+        fcitx_g_client_focus_out(client);
+    } else if (g_strcmp0(member, "Reset") == 0) {
+        fcitx_g_client_reset(client);
+    } else if (g_strcmp0(member, "PrevPage") == 0) {
+        fcitx_g_client_prev_page(client);
+    } else if (g_strcmp0(member, "NextPage") == 0) {
+        fcitx_g_client_next_page(client);
+    } else if (g_strcmp0(member, "SelectCandidate") == 0 &&
+               _fcitx_g_replay_payload_is(payload, "(i)")) {
+        gint32 index;
+        g_variant_get(payload, "(i)", &index);
+        fcitx_g_client_select_candidate(client, index);
+    } else if (g_strcmp0(member, "SetCapability") == 0 &&
+               _fcitx_g_replay_payload_is(payload, "(t)")) {
+        guint64 flags;
+        g_variant_get(payload, "(t)", &flags);
+        fcitx_g_client_set_capability(client, flags);
+    } else if (g_strcmp0(member, "SetCursorRect") == 0 &&
+               _fcitx_g_replay_payload_is(payload, "(iiii)")) {
+        gint32 x, y, w, h;
+        g_variant_get(payload, "(iiii)", &x, &y, &w, &h);
+        fcitx_g_client_set_cursor_rect(client, x, y, w, h);
+    } else if (g_strcmp0(member, "SetCursorRectV2") == 0 &&
+               _fcitx_g_replay_payload_is(payload, "(iiiid)")) {
+        gint32 x, y, w, h;
+        gdouble scale;
+        g_variant_get(payload, "(iiiid)", &x, &y, &w, &h, &scale);
+        fcitx_g_client_set_cursor_rect_with_scale_factor(client, x, y, w, h,
+                                                         scale);
+    } else if (g_strcmp0(member, "SetSurroundingText") == 0 &&
+               _fcitx_g_replay_payload_is(payload, "(suu)")) {
+        const gchar *text;
+        guint32 cursor, anchor;
+        g_variant_get(payload, "(&suu)", &text, &cursor, &anchor);
+        fcitx_g_client_set_surrounding_text(client, (gchar *)text, cursor,
+                                            anchor);
+    } else if (g_strcmp0(member, "SetSurroundingTextPosition") == 0 &&
+               _fcitx_g_replay_payload_is(payload, "(uu)")) {
+        guint32 cursor, anchor;
+        g_variant_get(payload, "(uu)", &cursor, &anchor);
+        fcitx_g_client_set_surrounding_text(client, NULL, cursor, anchor);
+    } else if (_fcitx_g_replay_is_key(member) &&
+               _fcitx_g_replay_payload_is(payload, "(uuubu)")) {
+        guint32 keyval, keycode, state, time;
+        gboolean is_release;
+        g_variant_get(payload, "(uuubu)", &keyval, &keycode, &state,
+                      &is_release, &time);
+        fcitx_g_client_set_use_batch_process_key_event(
+            client, g_strcmp0(member, "ProcessKeyEventBatch") == 0);
+        FcitxGReplayKey *key = g_new0(FcitxGReplayKey, 1);
+        key->driver = driver;
+        key->time = g_get_monotonic_time();
+        driver->in_flight++;
+        fcitx_g_client_process_key(client, keyval, keycode, state,
+                                   is_release, time, -1, NULL,
+                                   _fcitx_g_replay_driver_key_finished, key);
+    } else if (g_strcmp0(member, "DestroyIC") == 0) {
+        g_hash_table_remove(driver->clients, record->path);
+    } else {
+        driver->calls--;
+        driver->skipped++;
+    }
+}
+
+/*
+ * Input context calls are replayed as they are. Input method calls are made
+ * by FcitxGClient itself, so a new client is created for each successful
+ * CreateInputContext reply instead.
+ */
+static gboolean _fcitx_g_replay_is_trigger(FcitxGReplayRecord *record) {
+    if (!record->path[0]) {
+        return record->type == FCITX_G_JOURNAL_REPLY &&
+               g_strcmp0(record->member, "CreateInputContext") == 0;
+    }
+    return record->type == FCITX_G_JOURNAL_CALL;
+}
+
+static void _fcitx_g_replay_driver_step(FcitxGReplayDriver *driver) {
+    while (driver->next < driver->records->len) {
+        // Bring-up is serialized, so the daemon hands out the recorded input
+        // context paths in the same order. In fast mode, also wait for the
+        // key events in flight to measure them without queueing.
+        if (driver->connecting || driver->source ||
+            (fast && driver->in_flight)) {
+            return;
+        }
+        FcitxGReplayRecord *record =
+            g_ptr_array_index(driver->records, driver->next);
+        if (!_fcitx_g_replay_is_trigger(record)) {
+            driver->next++;
+            continue;
+        }
+        if (!fast) {
+            gint64 due = driver->start_time +
+                         (record->time - driver->first_record_time);
+            gint64 now = g_get_monotonic_time();
+            if (due - now >= G_TIME_SPAN_MILLISECOND) {
+                driver->source =
+                    g_timeout_add((due - now) / G_TIME_SPAN_MILLISECOND,
+                                  _fcitx_g_replay_driver_timeout, driver);
+                return;
+            }
+        }
+        driver->next++;
+        _fcitx_g_replay_driver_dispatch(driver, record);
+    }
+    if (!driver->connecting && !driver->in_flight) {
+        g_main_loop_quit(driver->loop);
+    }
+}
+
+static void _fcitx_g_replay_driver_availability_changed(
+    FcitxGWatcher *watcher, G_GNUC_UNUSED gboolean available,
+    gpointer user_data) {
+    FcitxGReplayDriver *driver = user_data;
+    if (driver->started || !fcitx_g_watcher_is_service_available(watcher)) {
+        return;
+    }
+    driver->started = TRUE;
+    g_clear_handle_id(&driver->timeout_source, g_source_remove);
+    driver->start_time = g_get_monotonic_time();
+    _fcitx_g_replay_driver_step(driver);
+}
+
+static gdouble _fcitx_g_replay_cpu_ms(const struct timeval *start,
+                                      const struct timeval *end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 +
+           (end->tv_usec - start->tv_usec) / 1000.0;
+}
+
+static GPid _fcitx_g_replay_spawn_daemon(const gchar *program,
+                                         const gchar *journal,
+                                         GError **error) {
+    g_autofree gchar *self = g_file_read_link("/proc/self/exe", NULL);
+    g_autoptr(GPtrArray) argv = g_ptr_array_new();
+    g_ptr_array_add(argv, self ? self : (gchar *)program);
+    g_ptr_array_add(argv, "--stand-in-daemon");
+    if (fast) {
+        g_ptr_array_add(argv, "--fast");
+    }
+    g_ptr_array_add(argv, (gchar *)journal);
+    g_ptr_array_add(argv, NULL);
+
+    GPid pid = 0;
+    g_spawn_async(NULL, (gchar **)argv->pdata, NULL,
+                  G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH, NULL, NULL,
+                  &pid, error);
+    return pid;
+}
+
+static int _fcitx_g_replay_run(GPtrArray *records, const gchar *program,
+                               const gchar *journal) {
+    FcitxGReplayDriver driver = {0};
+    driver.records = records;
+    for (guint i = 0; i < records->len; i++) {
+        FcitxGReplayRecord *record = g_ptr_array_index(records, i);
+        if (_fcitx_g_replay_is_trigger(record)) {
+            driver.first_record_time = record->time;
+            break;
+        }
+    }
+
+    g_autoptr(GTestDBus) bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    g_test_dbus_up(bus);
+
+    g_autoptr(GError) error = NULL;
+    GPid pid = _fcitx_g_replay_spawn_daemon(program, journal, &error);
+    if (!pid) {
+        g_printerr("Failed to start the stand-in daemon: %s\n",
+                   error->message);
+        g_test_dbus_stop(bus);
+        return 1;
+    }
+
+    driver.loop = g_main_loop_new(NULL, FALSE);
+    driver.clients = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                           g_object_unref);
+    driver.bring_up_latency = g_array_new(FALSE, FALSE, sizeof(gint64));
+    driver.key_latency = g_array_new(FALSE, FALSE, sizeof(gint64));
+    driver.watcher = fcitx_g_watcher_new();
+    g_signal_connect(driver.watcher, "availability-changed",
+                     G_CALLBACK(_fcitx_g_replay_driver_availability_changed),
+                     &driver);
+    driver.timeout_source =
+        g_timeout_add_seconds(FCITX_REPLAY_TIMEOUT_SECONDS,
+                              _fcitx_g_replay_driver_give_up, &driver);
+    fcitx_g_watcher_watch(driver.watcher);
+
+    struct rusage usage_start, usage_end;
+    getrusage(RUSAGE_SELF, &usage_start);
+    g_main_loop_run(driver.loop);
+    getrusage(RUSAGE_SELF, &usage_end);
+    gint64 wall_time = g_get_monotonic_time() - driver.start_time;
+
+    if (!driver.failed) {
+        g_print("replayed %u calls on %u input contexts, skipped %u\n",
+                driver.calls, driver.bring_up_latency->len, driver.skipped);
+        g_print("wall time (ms): %.3f\n",
+                (gdouble)wall_time / G_TIME_SPAN_MILLISECOND);
+        g_print("client cpu time (ms): user=%.3f system=%.3f\n",
+                _fcitx_g_replay_cpu_ms(&usage_start.ru_utime,
+                                       &usage_end.ru_utime),
+                _fcitx_g_replay_cpu_ms(&usage_start.ru_stime,
+                                       &usage_end.ru_stime));
+        _fcitx_g_bench_print_latency("bring-up", driver.bring_up_latency);
+        _fcitx_g_bench_print_latency("key", driver.key_latency);
+    }
+
+    g_clear_handle_id(&driver.source, g_source_remove);
+    g_clear_handle_id(&driver.timeout_source, g_source_remove);
+    g_hash_table_unref(driver.clients);
+    g_object_unref(driver.watcher);
+    while (g_main_context_iteration(NULL, FALSE)) {
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    g_spawn_close_pid(pid);
+    // The shared connection of the clients may still be alive, so do not
+    // wait for it with g_test_dbus_down().
+    g_test_dbus_stop(bus);
+
+    g_array_unref(driver.bring_up_latency);
+    g_array_unref(driver.key_latency);
+    g_main_loop_unref(driver.loop);
+    return driver.failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    g_autoptr(GOptionContext) context = g_option_context_new("JOURNAL");
+    g_option_context_set_summary(
+        context, "Replay input context traffic recorded with "
+                 "FCITX_GCLIENT_JOURNAL against a stand-in daemon.");
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_autoptr(GError) error = NULL;
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        return 1;
+    }
+    if (argc != 2) {
+        g_autofree gchar *help = g_option_context_get_help(context, TRUE, NULL);
+        g_printerr("%s", help);
+        return 1;
+    }
+
+    // Do not record the replay itself.
+    g_unsetenv("FCITX_GCLIENT_JOURNAL");
+    g_autoptr(GPtrArray) records =
+        _fcitx_g_replay_load_journal(argv[1], &error);
+    if (!records) {
+        g_printerr("Failed to read %s: %s\n", argv[1], error->message);
+        return 1;
+    }
+
+    if (stand_in_daemon) {
+        return _fcitx_g_replay_run_daemon(records);
+    }
+    return _fcitx_g_replay_run(records, argv[0], argv[1]);
+}
@@ -0,0 +1,317 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+
+#include "fcitxgstandinprivate.h"
+#include "fcitxgdbusprivate.h"
+
+typedef struct _FcitxGStandInSignal FcitxGStandInSignal;
+
+struct _FcitxGStandInSignal {
+    gchar *path;
+    gchar *member;
+    GVariant *payload;
+};
+
+struct _FcitxGStandInAnswer {
+    GDBusMethodInvocation *invocation;
+    GVariant *reply;
+    gchar *error_name;
+    gchar *error_message;
+    GPtrArray *signals;
+    gint64 delay;
+    gboolean drop;
+};
+
+struct _FcitxGStandIn {
+    GDBusConnection *connection;
+    FcitxGStandInAnswerFunc func;
+    gpointer user_data;
+    guint input_method_id;
+    /* Path to registration id of the input context objects. */
+    GHashTable *objects;
+    /* Answers waiting to be sent, the head one is being delayed. */
+    GQueue answers;
+    guint answer_source;
+    guint next_id;
+};
+
+static void _fcitx_g_stand_in_signal_free(gpointer data) {
+    FcitxGStandInSignal *signal = data;
+    g_free(signal->path);
+    g_free(signal->member);
+    g_variant_unref(signal->payload);
+    g_free(signal);
+}
+
+static void _fcitx_g_stand_in_answer_free(FcitxGStandInAnswer *answer) {
+    g_clear_object(&answer->invocation);
+    g_clear_pointer(&answer->reply, g_variant_unref);
+    g_free(answer->error_name);
+    g_free(answer->error_message);
+    g_ptr_array_unref(answer->signals);
+    g_free(answer);
+}
+
+void _fcitx_g_stand_in_answer_set_reply(FcitxGStandInAnswer *answer,
+                                        GVariant *value) {
+    g_clear_pointer(&answer->reply, g_variant_unref);
+    answer->reply = g_variant_ref_sink(value);
+}
+
+GVariant *_fcitx_g_stand_in_answer_get_reply(FcitxGStandInAnswer *answer) {
+    return answer->reply;
+}
+
+void _fcitx_g_stand_in_answer_set_error(FcitxGStandInAnswer *answer,
+                                        const gchar *name,
+                                        const gchar *message) {
+    g_free(answer->error_name);
+    g_free(answer->error_message);
+    answer->error_name = g_strdup(name && name[0]
+                                      ? name
+                                      : "org.freedesktop.DBus.Error.Failed");
+    answer->error_message = g_strdup(message ? message : "");
+}
+
+void _fcitx_g_stand_in_answer_add_signal(FcitxGStandInAnswer *answer,
+                                         const gchar *path,
+                                         const gchar *member,
+                                         GVariant *payload) {
+    FcitxGStandInSignal *signal = g_new0(FcitxGStandInSignal, 1);
+    signal->path = g_strdup(path);
+    signal->member = g_strdup(member);
+    signal->payload = g_variant_ref_sink(payload);
+    g_ptr_array_add(answer->signals, signal);
+}
+
+void _fcitx_g_stand_in_answer_set_delay(FcitxGStandInAnswer *answer,
+                                        gint64 delay) {
+    answer->delay = delay;
+}
+
+void _fcitx_g_stand_in_answer_drop(FcitxGStandInAnswer *answer) {
+    answer->drop = TRUE;
+}
+
+GDBusConnection *_fcitx_g_stand_in_get_connection(FcitxGStandIn *stand_in) {
+    return stand_in->connection;
+}
+
+void _fcitx_g_stand_in_emit(FcitxGStandIn *stand_in, const gchar *path,
+                            const gchar *member, GVariant *payload) {
+    g_dbus_connection_emit_signal(stand_in->connection, NULL, path,
+                                  FCITX_G_STAND_IN_INPUTCONTEXT_INTERFACE,
+                                  member, payload, NULL);
+}
+
+static void _fcitx_g_stand_in_send(FcitxGStandIn *stand_in,
+                                   FcitxGStandInAnswer *answer) {
+    for (guint i = 0; i < answer->signals->len; i++) {
+        FcitxGStandInSignal *signal = g_ptr_array_index(answer->signals, i);
+        _fcitx_g_stand_in_emit(stand_in, signal->path, signal->member,
+                               signal->payload);
+    }
+
+    // Returning the invocation consumes its reference.
+    GDBusMethodInvocation *invocation = g_steal_pointer(&answer->invocation);
+    if (answer->drop) {
+        g_object_unref(invocation);
+    } else if (answer->error_name) {
+        g_dbus_method_invocation_return_dbus_error(
+            invocation, answer->error_name, answer->error_message);
+    } else {
+        g_dbus_method_invocation_return_value(invocation, answer->reply);
+    }
+    _fcitx_g_stand_in_answer_free(answer);
+}
+
+static void _fcitx_g_stand_in_flush(FcitxGStandIn *stand_in);
+
+static gboolean _fcitx_g_stand_in_answer_timeout(gpointer user_data) {
+    FcitxGStandIn *stand_in = user_data;
+    stand_in->answer_source = 0;
+    _fcitx_g_stand_in_send(stand_in, g_queue_pop_head(&stand_in->answers));
+    _fcitx_g_stand_in_flush(stand_in);
+    return FALSE;
+}
+
+static void _fcitx_g_stand_in_flush(FcitxGStandIn *stand_in) {
+    FcitxGStandInAnswer *answer;
+    while (!stand_in->answer_source &&
+           (answer = g_queue_peek_head(&stand_in->answers))) {
+        if (answer->delay < G_TIME_SPAN_MILLISECOND) {
+            g_queue_pop_head(&stand_in->answers);
+            _fcitx_g_stand_in_send(stand_in, answer);
+            continue;
+        }
+        stand_in->answer_source =
+            g_timeout_add(answer->delay / G_TIME_SPAN_MILLISECOND,
+                          _fcitx_g_stand_in_answer_timeout, stand_in);
+    }
+}
+
+static void _fcitx_g_stand_in_method_call(
+    GDBusConnection *connection, const gchar *sender, const gchar *object_path,
+    const gchar *interface_name, const gchar *method_name,
+    GVariant *parameters, GDBusMethodInvocation *invocation,
+    gpointer user_data);
+
+static const GDBusInterfaceVTable _fcitx_g_stand_in_vtable = {
+    _fcitx_g_stand_in_method_call, NULL, NULL, {0}};
+
+static void _fcitx_g_stand_in_add_input_context(FcitxGStandIn *stand_in,
+                                                const gchar *path) {
+    if (g_hash_table_contains(stand_in->objects, path)) {
+        return;
+    }
+    g_autoptr(GError) error = NULL;
+    guint id = g_dbus_connection_register_object(
+        stand_in->connection, path,
+        (GDBusInterfaceInfo *)&fcitx_gdbus_input_context_interface,
+        &_fcitx_g_stand_in_vtable, stand_in, NULL, &error);
+    if (!id) {
+        g_warning("Failed to export %s: %s", path, error->message);
+        return;
+    }
+    g_hash_table_insert(stand_in->objects, g_strdup(path),
+                        GUINT_TO_POINTER(id));
+}
+
+static void _fcitx_g_stand_in_remove_input_context(FcitxGStandIn *stand_in,
+                                                   const gchar *path) {
+    guint id = GPOINTER_TO_UINT(g_hash_table_lookup(stand_in->objects, path));
+    if (id) {
+        g_dbus_connection_unregister_object(stand_in->connection, id);
+        g_hash_table_remove(stand_in->objects, path);
+    }
+}
+
+static GVariant *_fcitx_g_stand_in_default_reply(FcitxGStandIn *stand_in,
+                                                 const gchar *member) {
+    if (g_strcmp0(member, "Version") == 0) {
+        return g_variant_new("(u)", 1);
+    }
+    if (g_strcmp0(member, "CreateInputContext") == 0) {
+        static const guint8 uuid[16] = {0};
+        g_autofree gchar *path = g_strdup_printf(
+            "/org/freedesktop/portal/inputcontext/r%u", ++stand_in->next_id);
+        return g_variant_new("(o@ay)", path,
+                             g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE,
+                                                       uuid,
+                                                       G_N_ELEMENTS(uuid), 1));
+    }
+    if (g_strcmp0(member, "ProcessKeyEvent") == 0) {
+        return g_variant_new("(b)", FALSE);
+    }
+    if (g_strcmp0(member, "ProcessKeyEventBatch") == 0) {
+        return g_variant_new("(a(uv)b)", NULL, FALSE);
+    }
+    return g_variant_new("()");
+}
+
+static void _fcitx_g_stand_in_method_call(
+    G_GNUC_UNUSED GDBusConnection *connection,
+    G_GNUC_UNUSED const gchar *sender, const gchar *object_path,
+    const gchar *interface_name, const gchar *method_name,
+    GVariant *parameters, GDBusMethodInvocation *invocation,
+    gpointer user_data) {
+    FcitxGStandIn *stand_in = user_data;
+    const gchar *path =
+        g_strcmp0(interface_name, FCITX_G_STAND_IN_INPUTCONTEXT_INTERFACE) == 0
+            ? object_path
+            : "";
+    FcitxGStandInAnswer *answer = g_new0(FcitxGStandInAnswer, 1);
+    answer->invocation = invocation;
+    answer->signals = g_ptr_array_new_with_free_func(
+        _fcitx_g_stand_in_signal_free);
+    _fcitx_g_stand_in_answer_set_reply(
+        answer, _fcitx_g_stand_in_default_reply(stand_in, method_name));
+    stand_in->func(stand_in, path, method_name, parameters, answer,
+                   stand_in->user_data);
+
+    if (g_strcmp0(method_name, "CreateInputContext") == 0 &&
+        !answer->error_name &&
+        g_variant_is_of_type(answer->reply, G_VARIANT_TYPE("(oay)"))) {
+        const gchar *ic_path = NULL;
+        g_variant_get(answer->reply, "(&o@ay)", &ic_path, NULL);
+        _fcitx_g_stand_in_add_input_context(stand_in, ic_path);
+    } else if (g_strcmp0(method_name, "DestroyIC") == 0) {
+        _fcitx_g_stand_in_remove_input_context(stand_in, object_path);
+    }
+
+    g_queue_push_tail(&stand_in->answers, answer);
+    _fcitx_g_stand_in_flush(stand_in);
+}
+
+FcitxGStandIn *_fcitx_g_stand_in_new(GDBusConnection *connection,
+                                     FcitxGStandInAnswerFunc func,
+                                     gpointer user_data, GError **error) {
+    FcitxGStandIn *stand_in = g_new0(FcitxGStandIn, 1);
+    stand_in->connection = g_object_ref(connection);
+    stand_in->func = func;
+    stand_in->user_data = user_data;
+    stand_in->objects =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_queue_init(&stand_in->answers);
+    stand_in->input_method_id = g_dbus_connection_register_object(
+        connection, FCITX_G_STAND_IN_INPUTMETHOD_PATH,
+        (GDBusInterfaceInfo *)&fcitx_gdbus_input_method_interface,
+        &_fcitx_g_stand_in_vtable, stand_in, NULL, error);
+    if (!stand_in->input_method_id) {
+        _fcitx_g_stand_in_free(stand_in);
+        return NULL;
+    }
+    return stand_in;
+}
+
+void _fcitx_g_stand_in_free(FcitxGStandIn *stand_in) {
+    g_clear_handle_id(&stand_in->answer_source, g_source_remove);
+    FcitxGStandInAnswer *answer;
+    while ((answer = g_queue_pop_head(&stand_in->answers))) {
+        _fcitx_g_stand_in_answer_free(answer);
+    }
+
+    GHashTableIter iter;
+    gpointer id;
+    g_hash_table_iter_init(&iter, stand_in->objects);
+    while (g_hash_table_iter_next(&iter, NULL, &id)) {
+        g_dbus_connection_unregister_object(stand_in->connection,
+                                            GPOINTER_TO_UINT(id));
+    }
+    g_hash_table_unref(stand_in->objects);
+    if (stand_in->input_method_id) {
+        g_dbus_connection_unregister_object(stand_in->connection,
+                                            stand_in->input_method_id);
+    }
+    g_object_unref(stand_in->connection);
+    g_free(stand_in);
+}
+
+int _fcitx_g_stand_in_run(FcitxGStandInAnswerFunc func, gpointer user_data) {
+    g_autoptr(GError) error = NULL;
+    g_autoptr(GDBusConnection) connection =
+        g_bus_get_sync(G_BUS_TYPE_SESSION, NULL, &error);
+    if (!connection) {
+        g_printerr("Failed to connect to the bus: %s\n", error->message);
+        return 1;
+    }
+    FcitxGStandIn *stand_in =
+        _fcitx_g_stand_in_new(connection, func, user_data, &error);
+    if (!stand_in) {
+        g_printerr("Failed to export the input method: %s\n", error->message);
+        return 1;
+    }
+    g_bus_own_name_on_connection(connection, FCITX_G_STAND_IN_SERVICE_NAME,
+                                 G_BUS_NAME_OWNER_FLAGS_NONE, NULL, NULL,
+                                 NULL, NULL);
+
+    // Runs until the process is terminated, or the bus goes away.
+    GMainLoop *loop = g_main_loop_new(NULL, FALSE);
+    g_main_loop_run(loop);
+    g_main_loop_unref(loop);
+    _fcitx_g_stand_in_free(stand_in);
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef _FCITX_GCLIENT_FCITXGSTANDINPRIVATE_H_
+#define _FCITX_GCLIENT_FCITXGSTANDINPRIVATE_H_
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/*
+ * A stand-in for the fcitx daemon used by the replay and benchmark tools. It
+ * owns the fcitx service name, exports the input method and an input context
+ * object for every path it hands out, and answers the calls one by one in
+ * arrival order, like fcitx does.
+ *
+ * What a call is answered with is decided by a FcitxGStandInAnswerFunc. The
+ * answer comes prefilled with a default reply, e.g. an unhandled key or a new
+ * input context path, which the function may replace, turn into an error,
+ * delay or drop, and it may add signals to emit right before the reply.
+ */
+#define FCITX_G_STAND_IN_SERVICE_NAME "org.fcitx.Fcitx5"
+#define FCITX_G_STAND_IN_INPUTMETHOD_PATH "/org/freedesktop/portal/inputmethod"
+#define FCITX_G_STAND_IN_INPUTCONTEXT_INTERFACE "org.fcitx.Fcitx.InputContext1"
+
+typedef struct _FcitxGStandIn FcitxGStandIn;
+typedef struct _FcitxGStandInAnswer FcitxGStandInAnswer;
+
+/*
+ * @path is the input context path, or the empty string for calls on the
+ * input method. The reply of CreateInputContext decides which input context
+ * object is exported.
+ */
+typedef void (*FcitxGStandInAnswerFunc)(FcitxGStandIn *stand_in,
+                                        const gchar *path,
+                                        const gchar *member,
+                                        GVariant *parameters,
+                                        FcitxGStandInAnswer *answer,
+                                        gpointer user_data);
+
+FcitxGStandIn *_fcitx_g_stand_in_new(GDBusConnection *connection,
+                                     FcitxGStandInAnswerFunc func,
+                                     gpointer user_data, GError **error);
+void _fcitx_g_stand_in_free(FcitxGStandIn *stand_in);
+GDBusConnection *_fcitx_g_stand_in_get_connection(FcitxGStandIn *stand_in);
+
+/* Emit an input context signal right away. */
+void _fcitx_g_stand_in_emit(FcitxGStandIn *stand_in, const gchar *path,
+                            const gchar *member, GVariant *payload);
+
+/* Both take the floating reference of @value and @payload. */
+void _fcitx_g_stand_in_answer_set_reply(FcitxGStandInAnswer *answer,
+                                        GVariant *value);
+GVariant *_fcitx_g_stand_in_answer_get_reply(FcitxGStandInAnswer *answer);
+void _fcitx_g_stand_in_answer_set_error(FcitxGStandInAnswer *answer,
+                                        const gchar *name,
+                                        const gchar *message);
+void _fcitx_g_stand_in_answer_add_signal(FcitxGStandInAnswer *answer,
+                                         const gchar *path,
+                                         const gchar *member,
+                                         GVariant *payload);
+/* Hold the reply back for @delay microseconds after the previous one. */
+void _fcitx_g_stand_in_answer_set_delay(FcitxGStandInAnswer *answer,
+                                        gint64 delay);
+/* Never send the reply, its signals are still emitted. */
+void _fcitx_g_stand_in_answer_drop(FcitxGStandInAnswer *answer);
+
+/*
+ * Serve on the session bus until the process is terminated, or the bus goes
+ * away. Returns the exit status for main().
+ */
+int _fcitx_g_stand_in_run(FcitxGStandInAnswerFunc func, gpointer user_data);
+
+G_END_DECLS
+
+#endif // _FCITX_GCLIENT_FCITXGSTANDINPRIVATE_H_
@@ -5,11 +5,22 @@
  */
 
 #include "fcitxgwatcher.h"
+#include "fcitxgjournalprivate.h"
+#include "fcitxgwatcherprivate.h"
 
 #define FCITX_MAIN_SERVICE_NAME "org.fcitx.Fcitx5"
 #define FCITX_PORTAL_SERVICE_NAME "org.freedesktop.portal.Fcitx"
 
+/* Delay of the first retry when the service keeps flapping. */
+#define FCITX_RECONNECT_BASE_DELAY_MS 100
+#define FCITX_RECONNECT_MAX_BACKOFF 7
+/* Service reappearing within this interval is considered as flapping. */
+#define FCITX_RECONNECT_FLAP_INTERVAL (10 * G_TIME_SPAN_SECOND)
+/* Spacing between re-creating the input context of non-focused clients. */
+#define FCITX_RECONNECT_STAGGER_MS 20
+
 typedef struct _FcitxGWatcherPrivate FcitxGWatcherPrivate;
+typedef struct _FcitxGWatcherReconnect FcitxGWatcherReconnect;
 
 struct _FcitxGWatcher {
     GObject parent_instance;
@@ -29,9 +40,27 @@ struct _FcitxGWatcherPrivate {
     gchar *main_owner, *portal_owner;
     gboolean watch_portal;
     gboolean available;
+    gboolean use_shared_bus;
 
     GCancellable *cancellable;
     GDBusConnection *connection;
+
+    /* Clients waiting for re-creating input context, focused client first. */
+    GQueue reconnect_queue;
+    guint reconnect_source;
+    gpointer focus_client;
+    guint backoff;
+    gint64 last_available_time;
+    gint64 reconnect_not_before;
+
+    /* Input context proxies waiting for DestroyIC. */
+    GPtrArray *teardown_queue;
+    guint teardown_source;
+};
+
+struct _FcitxGWatcherReconnect {
+    gpointer client;
+    FcitxGWatcherReconnectFunc func;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE(FcitxGWatcher, fcitx_g_watcher, G_TYPE_OBJECT);
@@ -41,10 +70,21 @@ enum { AVAILABLITY_CHANGED_SIGNAL, LAST_SIGNAL };
 static guint signals[LAST_SIGNAL] = {0};
 
 static void _fcitx_g_watcher_clean_up(FcitxGWatcher *self);
+static void _fcitx_g_watcher_get_address_finished(GObject *source_object,
+                                                  GAsyncResult *res,
+                                                  gpointer user_data);
 static void _fcitx_g_watcher_get_bus_finished(GObject *source_object,
                                               GAsyncResult *res,
                                               gpointer user_data);
+static void _fcitx_g_watcher_new_connection_finished(GObject *source_object,
+                                                     GAsyncResult *res,
+                                                     gpointer user_data);
 static void _fcitx_g_watcher_update_availability(FcitxGWatcher *self);
+static void _fcitx_g_watcher_arm_reconnect(FcitxGWatcher *self,
+                                           gboolean urgent);
+static gboolean _fcitx_g_watcher_is_queued(FcitxGWatcher *self,
+                                           gpointer client);
+static void _fcitx_g_watcher_flush_teardown(FcitxGWatcher *self);
 
 static void fcitx_g_watcher_finalize(GObject *object);
 static void fcitx_g_watcher_dispose(GObject *object);
@@ -80,6 +120,7 @@ static void fcitx_g_watcher_init(FcitxGWatcher *self) {
     self->priv->main_owner = NULL;
     self->priv->portal_owner = NULL;
     self->priv->watched = FALSE;
+    self->priv->use_shared_bus = TRUE;
 }
 
 static void fcitx_g_watcher_finalize(GObject *object) {
@@ -94,6 +135,15 @@ static void fcitx_g_watcher_dispose(GObject *object) {
         fcitx_g_watcher_unwatch(self);
     }
 
+    g_clear_handle_id(&self->priv->reconnect_source, g_source_remove);
+    g_queue_foreach(&self->priv->reconnect_queue, (GFunc)g_free, NULL);
+    g_queue_clear(&self->priv->reconnect_queue);
+    self->priv->focus_client = NULL;
+
+    g_clear_handle_id(&self->priv->teardown_source, g_source_remove);
+    _fcitx_g_watcher_flush_teardown(self);
+    g_clear_pointer(&self->priv->teardown_queue, g_ptr_array_unref);
+
     if (G_OBJECT_CLASS(fcitx_g_watcher_parent_class)->dispose != NULL)
         G_OBJECT_CLASS(fcitx_g_watcher_parent_class)->dispose(object);
 }
@@ -129,16 +179,75 @@ static void _fcitx_g_watcher_vanish(G_GNUC_UNUSED GDBusConnection *conn,
     _fcitx_g_watcher_update_availability(self);
 }
 
+static void _fcitx_g_watcher_get_address_thread(
+    GTask *task, G_GNUC_UNUSED gpointer source_object,
+    G_GNUC_UNUSED gpointer task_data, GCancellable *cancellable) {
+    GError *error = NULL;
+    // Resolving the session bus address may spawn dbus-launch or read from
+    // X11 root window, which must not block the main thread.
+    gchar *address =
+        g_dbus_address_get_for_bus_sync(G_BUS_TYPE_SESSION, cancellable, &error);
+    if (address) {
+        g_task_return_pointer(task, address, g_free);
+    } else {
+        g_task_return_error(task, error);
+    }
+}
+
+static void _fcitx_g_watcher_get_bus_thread(GTask *task,
+                                            G_GNUC_UNUSED gpointer
+                                                source_object,
+                                            G_GNUC_UNUSED gpointer task_data,
+                                            GCancellable *cancellable) {
+    GError *error = NULL;
+    // g_bus_get() resolves the session bus address on the calling thread when
+    // the shared connection does not exist yet, so create it from here.
+    GDBusConnection *connection =
+        g_bus_get_sync(G_BUS_TYPE_SESSION, cancellable, &error);
+    if (connection) {
+        g_task_return_pointer(task, connection, g_object_unref);
+    } else {
+        g_task_return_error(task, error);
+    }
+}
+
 static void _fcitx_g_watcher_start_watch(FcitxGWatcher *self) {
     if (!self->priv->watched) {
         return;
     }
     g_clear_object(&self->priv->cancellable);
     self->priv->cancellable = g_cancellable_new();
-    gchar *address = g_dbus_address_get_for_bus_sync(
-        G_BUS_TYPE_SESSION, self->priv->cancellable, NULL);
+    GTask *task;
+    if (self->priv->use_shared_bus) {
+        task = g_task_new(self, self->priv->cancellable,
+                          _fcitx_g_watcher_get_bus_finished, NULL);
+        g_task_set_source_tag(task, _fcitx_g_watcher_start_watch);
+        g_task_run_in_thread(task, _fcitx_g_watcher_get_bus_thread);
+    } else {
+        task = g_task_new(self, self->priv->cancellable,
+                          _fcitx_g_watcher_get_address_finished, NULL);
+        g_task_set_source_tag(task, _fcitx_g_watcher_start_watch);
+        g_task_run_in_thread(task, _fcitx_g_watcher_get_address_thread);
+    }
+    g_object_unref(task);
+}
+
+static void _fcitx_g_watcher_get_address_finished(GObject *source_object,
+                                                  GAsyncResult *res,
+                                                  G_GNUC_UNUSED gpointer
+                                                      user_data) {
+    g_return_if_fail(FCITX_G_IS_WATCHER(source_object));
+
+    FcitxGWatcher *self = FCITX_G_WATCHER(source_object);
+    GError *error = NULL;
+    gchar *address = g_task_propagate_pointer(G_TASK(res), &error);
     if (!address) {
-        g_clear_object(&self->priv->cancellable);
+        // If cancelled, the cancellable is either already cleaned up or
+        // belongs to a newer attempt.
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_clear_object(&self->priv->cancellable);
+        }
+        g_error_free(error);
         return;
     }
     g_object_ref(self);
@@ -146,7 +255,8 @@ static void _fcitx_g_watcher_start_watch(FcitxGWatcher *self) {
         address,
         G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
             G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
-        NULL, self->priv->cancellable, _fcitx_g_watcher_get_bus_finished, self);
+        NULL, self->priv->cancellable,
+        _fcitx_g_watcher_new_connection_finished, self);
     g_free(address);
 }
 
@@ -180,6 +290,11 @@ _fcitx_g_watcher_connection_closed(GDBusConnection *connection G_GNUC_UNUSED,
     g_return_if_fail(FCITX_G_IS_WATCHER(user_data));
 
     FcitxGWatcher *self = FCITX_G_WATCHER(user_data);
+    if (self->priv->use_shared_bus) {
+        // The application closed the shared session bus, do not rely on it
+        // anymore and fallback to a private connection.
+        self->priv->use_shared_bus = FALSE;
+    }
     _fcitx_g_watcher_clean_up(self);
     if (self->priv->watched) {
         _fcitx_g_watcher_update_availability(self);
@@ -189,42 +304,78 @@ _fcitx_g_watcher_connection_closed(GDBusConnection *connection G_GNUC_UNUSED,
     }
 }
 
-static void
-_fcitx_g_watcher_get_bus_finished(G_GNUC_UNUSED GObject *source_object,
-                                  GAsyncResult *res, gpointer user_data) {
-    g_return_if_fail(user_data != NULL);
-    g_return_if_fail(FCITX_G_IS_WATCHER(user_data));
-
-    FcitxGWatcher *self = FCITX_G_WATCHER(user_data);
-    // Need to call finish because clean up, otherwise cancellable will set the
-    // return value.
-    GDBusConnection *connection =
-        g_dbus_connection_new_for_address_finish(res, NULL);
+static void _fcitx_g_watcher_connection_ready(FcitxGWatcher *self,
+                                              GDBusConnection *connection) {
     _fcitx_g_watcher_clean_up(self);
     if (!connection) {
-        g_object_unref(self);
+        return;
+    }
+    if (self->priv->use_shared_bus &&
+        g_dbus_connection_is_closed(connection)) {
+        // The shared connection may be closed by the application already.
+        g_object_unref(connection);
+        self->priv->use_shared_bus = FALSE;
+        _fcitx_g_watcher_start_watch(self);
         return;
     }
     self->priv->connection = connection;
-    g_dbus_connection_set_exit_on_close(self->priv->connection, FALSE);
+    if (!self->priv->use_shared_bus) {
+        g_dbus_connection_set_exit_on_close(self->priv->connection, FALSE);
+    }
     g_signal_connect(self->priv->connection, "closed",
                      (GCallback)_fcitx_g_watcher_connection_closed, self);
 
-    self->priv->watch_id =
-        g_bus_watch_name(G_BUS_TYPE_SESSION, FCITX_MAIN_SERVICE_NAME,
-                         G_BUS_NAME_WATCHER_FLAGS_NONE, _fcitx_g_watcher_appear,
-                         _fcitx_g_watcher_vanish, self, NULL);
+    self->priv->watch_id = g_bus_watch_name_on_connection(
+        self->priv->connection, FCITX_MAIN_SERVICE_NAME,
+        G_BUS_NAME_WATCHER_FLAGS_NONE, _fcitx_g_watcher_appear,
+        _fcitx_g_watcher_vanish, self, NULL);
 
     if (self->priv->watch_portal) {
-        self->priv->portal_watch_id = g_bus_watch_name(
-            G_BUS_TYPE_SESSION, FCITX_PORTAL_SERVICE_NAME,
+        self->priv->portal_watch_id = g_bus_watch_name_on_connection(
+            self->priv->connection, FCITX_PORTAL_SERVICE_NAME,
             G_BUS_NAME_WATCHER_FLAGS_NONE, _fcitx_g_watcher_appear,
             _fcitx_g_watcher_vanish, self, NULL);
     }
 
     _fcitx_g_watcher_update_availability(self);
+}
+
+static void _fcitx_g_watcher_get_bus_finished(GObject *source_object,
+                                              GAsyncResult *res,
+                                              G_GNUC_UNUSED gpointer
+                                                  user_data) {
+    g_return_if_fail(FCITX_G_IS_WATCHER(source_object));
+
+    FcitxGWatcher *self = FCITX_G_WATCHER(source_object);
+    GError *error = NULL;
+    GDBusConnection *connection =
+        g_task_propagate_pointer(G_TASK(res), &error);
+    if (!connection) {
+        // If cancelled, the cancellable is either already cleaned up or
+        // belongs to a newer attempt.
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_clear_object(&self->priv->cancellable);
+        }
+        g_error_free(error);
+        return;
+    }
+    _fcitx_g_watcher_connection_ready(self, connection);
+}
+
+static void _fcitx_g_watcher_new_connection_finished(
+    G_GNUC_UNUSED GObject *source_object, GAsyncResult *res,
+    gpointer user_data) {
+    g_return_if_fail(user_data != NULL);
+    g_return_if_fail(FCITX_G_IS_WATCHER(user_data));
 
-    /* unref for _fcitx_g_watcher_start_watch */
+    FcitxGWatcher *self = FCITX_G_WATCHER(user_data);
+    // Need to call finish because clean up, otherwise cancellable will set the
+    // return value.
+    GDBusConnection *connection =
+        g_dbus_connection_new_for_address_finish(res, NULL);
+    _fcitx_g_watcher_connection_ready(self, connection);
+
+    /* unref for _fcitx_g_watcher_get_address_finished */
     g_object_unref(self);
 }
 
@@ -310,12 +461,174 @@ void fcitx_g_watcher_set_watch_portal(FcitxGWatcher *self, gboolean watch) {
     self->priv->watch_portal = watch;
 }
 
-void _fcitx_g_watcher_update_availability(FcitxGWatcher *self) {
+/**
+ * fcitx_g_watcher_set_use_shared_bus:
+ * self: A #FcitxGWatcher
+ * use_shared_bus: whether to share the session bus connection of the
+ * application.
+ *
+ * By default the watcher uses the shared session bus from g_bus_get() for both
+ * name watching and input context traffic. If the application closes the
+ * shared connection, the watcher switches to a private connection. Should be
+ * called before fcitx_g_watcher_watch().
+ **/
+void fcitx_g_watcher_set_use_shared_bus(FcitxGWatcher *self,
+                                        gboolean use_shared_bus) {
+    self->priv->use_shared_bus = use_shared_bus;
+}
+
+static void _fcitx_g_watcher_update_availability(FcitxGWatcher *self) {
     gboolean available = self->priv->connection &&
                          (self->priv->main_owner || self->priv->portal_owner);
     if (available != self->priv->available) {
         self->priv->available = available;
+        if (available) {
+            gint64 now = g_get_monotonic_time();
+            if (self->priv->last_available_time &&
+                now - self->priv->last_available_time <
+                    FCITX_RECONNECT_FLAP_INTERVAL) {
+                if (self->priv->backoff < FCITX_RECONNECT_MAX_BACKOFF) {
+                    self->priv->backoff++;
+                }
+            } else {
+                self->priv->backoff = 0;
+            }
+            self->priv->last_available_time = now;
+            self->priv->reconnect_not_before = now;
+            if (self->priv->backoff) {
+                guint delay = FCITX_RECONNECT_BASE_DELAY_MS
+                              << (self->priv->backoff - 1);
+                delay += g_random_int_range(0, delay / 2 + 1);
+                self->priv->reconnect_not_before +=
+                    delay * G_TIME_SPAN_MILLISECOND;
+            }
+        } else {
+            g_clear_handle_id(&self->priv->reconnect_source, g_source_remove);
+        }
         g_signal_emit(self, signals[AVAILABLITY_CHANGED_SIGNAL], 0);
+        // Without a focused client waiting, the first one is staggered too,
+        // so that processes do not all reconnect at the same instant.
+        _fcitx_g_watcher_arm_reconnect(
+            self, _fcitx_g_watcher_is_queued(self, self->priv->focus_client));
+    }
+}
+
+static gint _fcitx_g_watcher_reconnect_compare(gconstpointer a,
+                                               gconstpointer b) {
+    const FcitxGWatcherReconnect *reconnect = a;
+    return reconnect->client == b ? 0 : 1;
+}
+
+static gboolean _fcitx_g_watcher_is_queued(FcitxGWatcher *self,
+                                           gpointer client) {
+    return client && g_queue_find_custom(&self->priv->reconnect_queue, client,
+                                         _fcitx_g_watcher_reconnect_compare);
+}
+
+static gboolean _fcitx_g_watcher_reconnect_timeout(gpointer user_data) {
+    FcitxGWatcher *self = user_data;
+    self->priv->reconnect_source = 0;
+
+    GList *link = NULL;
+    if (self->priv->focus_client) {
+        link = g_queue_find_custom(&self->priv->reconnect_queue,
+                                   self->priv->focus_client,
+                                   _fcitx_g_watcher_reconnect_compare);
+    }
+    if (!link) {
+        link = g_queue_peek_head_link(&self->priv->reconnect_queue);
+    }
+    if (link) {
+        FcitxGWatcherReconnect *reconnect = link->data;
+        g_queue_delete_link(&self->priv->reconnect_queue, link);
+        _fcitx_g_watcher_arm_reconnect(self, FALSE);
+        reconnect->func(reconnect->client);
+        g_free(reconnect);
+    }
+    return FALSE;
+}
+
+static void _fcitx_g_watcher_arm_reconnect(FcitxGWatcher *self,
+                                           gboolean urgent) {
+    if (!self->priv->available ||
+        g_queue_is_empty(&self->priv->reconnect_queue)) {
+        return;
+    }
+    if (self->priv->reconnect_source) {
+        if (!urgent) {
+            return;
+        }
+        g_source_remove(self->priv->reconnect_source);
+        self->priv->reconnect_source = 0;
+    }
+
+    gint64 delay =
+        (self->priv->reconnect_not_before - g_get_monotonic_time()) /
+        G_TIME_SPAN_MILLISECOND;
+    if (!urgent) {
+        delay = MAX(delay, FCITX_RECONNECT_STAGGER_MS +
+                               g_random_int_range(0, FCITX_RECONNECT_STAGGER_MS));
+    }
+    self->priv->reconnect_source = g_timeout_add(
+        MAX(delay, 0), _fcitx_g_watcher_reconnect_timeout, self);
+}
+
+/*
+ * _fcitx_g_watcher_set_focus_client:
+ * @self: A #FcitxGWatcher
+ * @client: the client
+ * @focus: whether client gains focus.
+ *
+ * Focused client will have its input context re-created before other clients.
+ */
+void _fcitx_g_watcher_set_focus_client(FcitxGWatcher *self, gpointer client,
+                                       gboolean focus) {
+    if (focus) {
+        self->priv->focus_client = client;
+    } else if (self->priv->focus_client == client) {
+        self->priv->focus_client = NULL;
+    }
+}
+
+/*
+ * _fcitx_g_watcher_schedule_reconnect:
+ * @self: A #FcitxGWatcher
+ * @client: the client
+ * @func: function to create the input context for client.
+ *
+ * Queue the client for re-creating input context. The focused client is served
+ * first as soon as the service is available, the others are staggered. When
+ * the service keeps flapping, the first attempt is delayed with a jittered
+ * exponential backoff.
+ */
+void _fcitx_g_watcher_schedule_reconnect(FcitxGWatcher *self, gpointer client,
+                                         FcitxGWatcherReconnectFunc func) {
+    if (!g_queue_find_custom(&self->priv->reconnect_queue, client,
+                             _fcitx_g_watcher_reconnect_compare)) {
+        FcitxGWatcherReconnect *reconnect = g_new(FcitxGWatcherReconnect, 1);
+        reconnect->client = client;
+        reconnect->func = func;
+        g_queue_push_tail(&self->priv->reconnect_queue, reconnect);
+    }
+    _fcitx_g_watcher_arm_reconnect(self, client == self->priv->focus_client);
+}
+
+/*
+ * _fcitx_g_watcher_cancel_reconnect:
+ * @self: A #FcitxGWatcher
+ * @client: the client
+ *
+ * Remove client from the reconnection queue.
+ */
+void _fcitx_g_watcher_cancel_reconnect(FcitxGWatcher *self, gpointer client) {
+    GList *link = g_queue_find_custom(&self->priv->reconnect_queue, client,
+                                      _fcitx_g_watcher_reconnect_compare);
+    if (link) {
+        g_free(link->data);
+        g_queue_delete_link(&self->priv->reconnect_queue, link);
+    }
+    if (g_queue_is_empty(&self->priv->reconnect_queue)) {
+        g_clear_handle_id(&self->priv->reconnect_source, g_source_remove);
     }
 }
 
@@ -335,3 +648,47 @@ const gchar *fcitx_g_watcher_get_service_name(FcitxGWatcher *self) {
     }
     return NULL;
 }
+
+static void _fcitx_g_watcher_flush_teardown(FcitxGWatcher *self) {
+    if (!self->priv->teardown_queue) {
+        return;
+    }
+    for (guint i = 0; i < self->priv->teardown_queue->len; i++) {
+        GDBusProxy *icproxy = g_ptr_array_index(self->priv->teardown_queue, i);
+        _fcitx_g_journal_record(FCITX_G_JOURNAL_CALL,
+                                g_dbus_proxy_get_object_path(icproxy),
+                                "DestroyIC", NULL);
+        g_dbus_proxy_call(icproxy, "DestroyIC", NULL, G_DBUS_CALL_FLAGS_NONE,
+                          -1, NULL, NULL, NULL);
+    }
+    g_ptr_array_set_size(self->priv->teardown_queue, 0);
+}
+
+static gboolean _fcitx_g_watcher_teardown_idle(gpointer user_data) {
+    FcitxGWatcher *self = user_data;
+    self->priv->teardown_source = 0;
+    _fcitx_g_watcher_flush_teardown(self);
+    return FALSE;
+}
+
+/*
+ * _fcitx_g_watcher_queue_destroy_ic:
+ * @self: A #FcitxGWatcher
+ * @icproxy: (transfer full): proxy of the input context to destroy.
+ *
+ * Destroying many input context at once, e.g. when a window is closed, only
+ * queues the proxies here. DestroyIC for all of them is sent from one idle
+ * callback and the proxies are released in one pass.
+ */
+void _fcitx_g_watcher_queue_destroy_ic(FcitxGWatcher *self,
+                                       GDBusProxy *icproxy) {
+    if (!self->priv->teardown_queue) {
+        self->priv->teardown_queue = g_ptr_array_new_with_free_func(
+            (GDestroyNotify)g_object_unref);
+    }
+    g_ptr_array_add(self->priv->teardown_queue, icproxy);
+    if (!self->priv->teardown_source) {
+        self->priv->teardown_source = g_idle_add_full(
+            G_PRIORITY_DEFAULT_IDLE, _fcitx_g_watcher_teardown_idle, self, NULL);
+    }
+}
@@ -25,6 +25,8 @@ void fcitx_g_watcher_watch(FcitxGWatcher *self);
 void fcitx_g_watcher_unwatch(FcitxGWatcher *self);
 
 void fcitx_g_watcher_set_watch_portal(FcitxGWatcher *self, gboolean watch);
+void fcitx_g_watcher_set_use_shared_bus(FcitxGWatcher *self,
+                                        gboolean use_shared_bus);
 gboolean fcitx_g_watcher_is_service_available(FcitxGWatcher *self);
 const gchar *fcitx_g_watcher_get_service_name(FcitxGWatcher *self);
 GDBusConnection *fcitx_g_watcher_get_connection(FcitxGWatcher *self);
@@ -0,0 +1,28 @@
+/*
+ * SPDX-FileCopyrightText: 2017~2017 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ */
+#ifndef _FCITX_GCLIENT_FCITXWATCHERPRIVATE_H_
+#define _FCITX_GCLIENT_FCITXWATCHERPRIVATE_H_
+
+#include "fcitxgwatcher.h"
+
+G_BEGIN_DECLS
+
+typedef void (*FcitxGWatcherReconnectFunc)(gpointer client);
+
+G_GNUC_INTERNAL void
+_fcitx_g_watcher_set_focus_client(FcitxGWatcher *self, gpointer client,
+                                  gboolean focus);
+G_GNUC_INTERNAL void
+_fcitx_g_watcher_schedule_reconnect(FcitxGWatcher *self, gpointer client,
+                                    FcitxGWatcherReconnectFunc func);
+G_GNUC_INTERNAL void _fcitx_g_watcher_cancel_reconnect(FcitxGWatcher *self,
+                                                       gpointer client);
+G_GNUC_INTERNAL void _fcitx_g_watcher_queue_destroy_ic(FcitxGWatcher *self,
+                                                       GDBusProxy *icproxy);
+
+G_END_DECLS
+
+#endif // _FCITX_GCLIENT_FCITXWATCHERPRIVATE_H_
@@ -18,6 +18,7 @@
 #include "fcitx-gclient/fcitxgwatcher.h"
 #include "fcitximcontext.h"
 #include "utils.h"
+#include "utf8.h"
 #include <gdk/gdk.h>
 #include <gdk/gdkkeysyms.h>
 #include <gdk/gdkx.h>
@@ -39,6 +40,11 @@ struct _FcitxIMContext {
 
     GdkWindow *client_window;
     gulong button_press_signal;
+    gulong style_changed_signal;
+    gulong toplevel_configure_signal;
+    gboolean root_origin_valid;
+    int root_origin_x;
+    int root_origin_y;
     bool has_rect;
     GdkRectangle area;
     FcitxGClient *client;
@@ -49,19 +55,40 @@ struct _FcitxIMContext {
     bool last_is_release;
     gboolean use_preedit;
     gboolean support_surrounding_text;
+    gboolean surrounding_dirty;
+    guint idle_id;
+    guint idle_work;
+    GString *pending_commit;
     gboolean is_inpreedit;
     gchar *preedit_string;
     gchar *commit_preedit_string;
     gchar *surrounding_text;
+    gsize surrounding_text_len;
+    fcitx::gtk::Utf8OffsetCache surrounding_offsets;
     int cursor_pos;
     guint64 capability_from_toolkit;
     guint64 last_updated_capability;
+    guint64 client_capability;
+    gboolean client_capability_valid;
+    /* What the server already knows, to skip calls that change nothing. */
+    gboolean server_needs_reset;
+    guint server_focus_serial;
+    /* Focus out dropped a preedit the server still has, so it has to be
+     * told about the focus change even if focus comes right back. */
+    gboolean focus_out_dropped_preedit;
+    gboolean server_has_rect;
+    GdkRectangle server_rect;
+    int server_rect_scale;
+    guint skipped_calls;
     PangoAttrList *attrlist;
+    GString *preedit_buffer;
+    GString *commit_preedit_buffer;
+    PangoColor highlight_fg;
+    PangoColor highlight_bg;
+    gboolean highlight_colors_valid;
     gint last_cursor_pos;
     gint last_anchor_pos;
     struct xkb_compose_state *xkbComposeState;
-
-    GQueue gdk_events;
 };
 
 struct _FcitxIMContextClass {
@@ -97,7 +124,10 @@ static void fcitx_im_context_commit_string(FcitxIMContext *context,
                                            const gchar *str);
 static void fcitx_im_context_commit_preedit(FcitxIMContext *context);
 static gboolean _set_cursor_location_internal(FcitxIMContext *fcitxcontext);
-static gboolean _defer_request_surrounding_text(FcitxIMContext *fcitxcontext);
+static void _fcitx_im_context_schedule_idle(FcitxIMContext *context,
+                                            guint work);
+static void _fcitx_im_context_run_idle_work(FcitxIMContext *context,
+                                            guint work);
 static void _slave_commit_cb(GtkIMContext *slave, gchar *string,
                              FcitxIMContext *context);
 static void _slave_preedit_changed_cb(GtkIMContext *slave,
@@ -130,18 +160,33 @@ static void _fcitx_im_context_notify_focus_out_cb(FcitxGClient *client,
 static void _fcitx_im_context_process_key_cb(GObject *source_object,
                                              GAsyncResult *res,
                                              gpointer user_data);
+static void _fcitx_im_context_style_changed_cb(FcitxIMContext *context);
+static gboolean _fcitx_im_context_toplevel_configure_cb(GtkWidget *widget,
+                                                        GdkEvent *event,
+                                                        gpointer user_data);
+static void _fcitx_im_context_client_changed_cb(FcitxIMContext *context);
 static void _fcitx_im_context_set_capability(FcitxIMContext *fcitxcontext,
                                              gboolean force);
-static void _fcitx_im_context_push_event(FcitxIMContext *fcitxcontext,
-                                         GdkEventKey *event);
+static guint _fcitx_im_context_push_event(FcitxIMContext *fcitxcontext,
+                                          GdkEventKey *event, gboolean pending);
+static GdkEventKey *_fcitx_im_context_take_pending_event(guint serial,
+                                                         gboolean replay);
+static void _fcitx_im_context_forget_cached_events(FcitxIMContext *context);
 
 static GdkEventKey *_create_gdk_event(FcitxIMContext *fcitxcontext,
                                       guint keyval, guint state,
                                       gboolean isRelease);
 
+static void _fill_key_event_string(GdkEventKey *event);
+
 static gboolean _key_is_modifier(guint keyval);
 
+static void _fcitx_im_context_deliver_event(GdkEventKey *event);
+
 static void _request_surrounding_text(FcitxIMContext **context);
+static void _request_surrounding_text_if_dirty(FcitxIMContext **context,
+                                               GdkEventKey *event);
+static GObject *_fcitx_im_context_surrounding_owner(FcitxIMContext *context);
 
 static gint _key_snooper_cb(GtkWidget *widget, GdkEventKey *event,
                             gpointer user_data);
@@ -157,8 +202,12 @@ static guint _signal_preedit_start_id = 0;
 static guint _signal_preedit_end_id = 0;
 static guint _signal_delete_surrounding_id = 0;
 static guint _signal_retrieve_surrounding_id = 0;
+static GQuark _surrounding_unsupported_quark = 0;
 static gboolean _use_preedit = TRUE;
 static gboolean _use_sync_mode = 0;
+static gsize _surrounding_text_window = SURROUNDING_TEXT_WINDOW;
+/* Bumped whenever any context sends focus in to the server. */
+static guint _focus_in_serial = 0;
 
 static GtkIMContext *_focus_im_context = NULL;
 static const gchar *_no_snooper_apps = NO_SNOOPER_APPS;
@@ -166,10 +215,46 @@ static const gchar *_no_preedit_apps = NO_PREEDIT_APPS;
 static const gchar *_sync_mode_apps = SYNC_MODE_APPS;
 static gboolean _use_key_snooper = _ENABLE_SNOOPER;
 static guint _key_snooper_id = 0;
+static gboolean _use_direct_dispatch = TRUE;
+/* Nesting depth of key processing in the snooper, filter_keypress, and our
+ * own direct deliveries. */
+static guint _key_dispatch_depth = 0;
+
+struct KeyDispatchGuard {
+    KeyDispatchGuard() { _key_dispatch_depth++; }
+    ~KeyDispatchGuard() { _key_dispatch_depth--; }
+};
+
 static FcitxGWatcher *_watcher = NULL;
 static struct xkb_context *xkbContext = NULL;
 static struct xkb_compose_table *xkbComposeTable = NULL;
 
+/* The fields of a key event needed to rebuild it for a forwarded key or an
+ * unhandled async key. */
+struct FcitxCachedKeyEvent {
+    guint serial;
+    FcitxIMContext *owner;
+    GdkWindow *window;
+    guint32 time;
+    guint keyval;
+    guint state;
+    guint16 hardware_keycode;
+    guint8 group;
+    bool is_release;
+    bool is_modifier;
+    bool pending;
+};
+
+/* Only the focused context sends keys, so recent key events are kept once per
+ * process. The record of serial s lives in slot s % MAX_CACHED_EVENTS, and the
+ * index maps a hash of (keyval, state, release) to the newest serial with it.
+ */
+static FcitxCachedKeyEvent _cached_events[MAX_CACHED_EVENTS];
+static guint _cached_events_index[CACHED_EVENTS_INDEX_SIZE];
+static guint _cached_events_serial = 0;
+/* Pending async keys whose record was reused before the reply arrived. */
+static GHashTable *_spilled_events = NULL;
+
 void fcitx_im_context_register_type(GTypeModule *type_module) {
     static const GTypeInfo fcitx_im_context_info = {
         sizeof(FcitxIMContextClass),
@@ -253,6 +338,9 @@ static void fcitx_im_context_class_init(FcitxIMContextClass *klass, gpointer) {
         g_signal_lookup("retrieve-surrounding", G_TYPE_FROM_CLASS(klass));
     g_assert(_signal_retrieve_surrounding_id != 0);
 
+    _surrounding_unsupported_quark =
+        g_quark_from_static_string("fcitx-surrounding-unsupported");
+
     _use_key_snooper =
         !get_boolean_env("IBUS_DISABLE_SNOOPER", !(_ENABLE_SNOOPER)) &&
         !get_boolean_env("FCITX_DISABLE_SNOOPER", !(_ENABLE_SNOOPER));
@@ -274,6 +362,8 @@ static void fcitx_im_context_class_init(FcitxIMContextClass *klass, gpointer) {
     }
     _use_preedit = !check_app_name(_no_preedit_apps);
 
+    _surrounding_text_window = get_surrounding_text_window();
+
     // Check sync mode
     if (g_getenv("FCITX_SYNC_MODE_APPS")) {
         _sync_mode_apps = g_getenv("FCITX_SYNC_MODE_APPS");
@@ -286,6 +376,9 @@ static void fcitx_im_context_class_init(FcitxIMContextClass *klass, gpointer) {
                          get_boolean_env("FCITX_ENABLE_SYNC_MODE", FALSE);
     }
 
+    _use_direct_dispatch =
+        !get_boolean_env("FCITX_DISABLE_DIRECT_DISPATCH", false);
+
     /* always install snooper */
     if (_key_snooper_id == 0)
         _key_snooper_id = gtk_key_snooper_install(_key_snooper_cb, NULL);
@@ -314,22 +407,8 @@ static void fcitx_im_context_init(FcitxIMContext *context, gpointer) {
     context->attrlist = NULL;
     context->last_updated_capability =
         (guint64)fcitx::FcitxCapabilityFlag_SurroundingText;
-    context->slave = gtk_im_context_simple_new();
-
-    g_signal_connect(context->slave, "commit", G_CALLBACK(_slave_commit_cb),
-                     context);
-    g_signal_connect(context->slave, "preedit-start",
-                     G_CALLBACK(_slave_preedit_start_cb), context);
-    g_signal_connect(context->slave, "preedit-end",
-                     G_CALLBACK(_slave_preedit_end_cb), context);
-    g_signal_connect(context->slave, "preedit-changed",
-                     G_CALLBACK(_slave_preedit_changed_cb), context);
-    g_signal_connect(context->slave, "retrieve-surrounding",
-                     G_CALLBACK(_slave_retrieve_surrounding_cb), context);
-    g_signal_connect(context->slave, "delete-surrounding",
-                     G_CALLBACK(_slave_delete_surrounding_cb), context);
-
     context->time = GDK_CURRENT_TIME;
+    context->surrounding_dirty = TRUE;
 
     static gsize has_info = 0;
     if (g_once_init_enter(&has_info)) {
@@ -362,6 +441,7 @@ static void fcitx_im_context_init(FcitxIMContext *context, gpointer) {
 
     context->client = fcitx_g_client_new_with_watcher(_watcher);
     fcitx_g_client_set_program(context->client, g_get_prgname());
+    fcitx_g_client_set_lazy_connect(context->client, TRUE);
     fcitx_g_client_set_display(context->client, "x11:");
     fcitx_g_client_set_use_batch_process_key_event(context->client, FALSE);
     g_signal_connect(context->client, "connected",
@@ -379,17 +459,14 @@ static void fcitx_im_context_init(FcitxIMContext *context, gpointer) {
     g_signal_connect(context->client, "notify-focus-out",
                      G_CALLBACK(_fcitx_im_context_notify_focus_out_cb),
                      context);
-
-    context->xkbComposeState =
-        xkbComposeTable
-            ? xkb_compose_state_new(xkbComposeTable, XKB_COMPOSE_STATE_NO_FLAGS)
-            : NULL;
-
-    g_queue_init(&context->gdk_events);
 }
 
 static void fcitx_im_context_finalize(GObject *obj) {
     FcitxIMContext *context = FCITX_IM_CONTEXT(obj);
+    if (context->skipped_calls) {
+        g_debug("FcitxIMContext %p skipped %u redundant calls to the server",
+                (void *)context, context->skipped_calls);
+    }
 
     fcitx_im_context_set_client_window(GTK_IM_CONTEXT(context), NULL);
 
@@ -400,6 +477,10 @@ static void fcitx_im_context_finalize(GObject *obj) {
 #endif
 
     g_clear_pointer(&context->xkbComposeState, xkb_compose_state_unref);
+    if (context->slave) {
+        g_signal_handlers_disconnect_by_data(context->slave, context);
+    }
+    g_clear_object(&context->slave);
     if (context->client) {
         g_signal_handlers_disconnect_by_data(context->client, context);
     }
@@ -407,15 +488,16 @@ static void fcitx_im_context_finalize(GObject *obj) {
 
     g_clear_pointer(&context->preedit_string, g_free);
     g_clear_pointer(&context->commit_preedit_string, g_free);
+    if (context->preedit_buffer) {
+        g_string_free(context->preedit_buffer, TRUE);
+        g_string_free(context->commit_preedit_buffer, TRUE);
+    }
+    if (context->pending_commit) {
+        g_string_free(context->pending_commit, TRUE);
+    }
     g_clear_pointer(&context->surrounding_text, g_free);
     g_clear_pointer(&context->attrlist, pango_attr_list_unref);
-    /* https://github.com/GNOME/glib/blob/main/glib/gqueue.c#L164
-     * Compatible with glib 2.5.58 < 2.60
-     * g_queue_clear_full(&context->gdk_events,
-     * (GDestroyNotify)gdk_event_free);*/
-    g_queue_foreach(&context->gdk_events, (GFunc)((void *)gdk_event_free),
-                    NULL);
-    g_queue_clear(&context->gdk_events);
+    _fcitx_im_context_forget_cached_events(context);
 
     G_OBJECT_CLASS(parent_class)->finalize(obj);
 }
@@ -446,12 +528,31 @@ static void fcitx_im_context_set_client_window(GtkIMContext *context,
     }
 
     g_clear_signal_handler(&fcitxcontext->button_press_signal, oldwidget);
+    g_clear_signal_handler(&fcitxcontext->style_changed_signal, oldwidget);
+    if (GTK_IS_WIDGET(oldwidget)) {
+        g_signal_handlers_disconnect_by_func(
+            oldwidget, (gpointer)_fcitx_im_context_client_changed_cb,
+            fcitxcontext);
+    }
+    fcitxcontext->highlight_colors_valid = FALSE;
+    fcitxcontext->client_capability_valid = FALSE;
+
+    GtkWidget *oldtoplevel = nullptr;
+    if (fcitxcontext->client_window) {
+        gdk_window_get_user_data(
+            gdk_window_get_toplevel(fcitxcontext->client_window),
+            (gpointer *)&oldtoplevel);
+    }
+    g_clear_signal_handler(&fcitxcontext->toplevel_configure_signal,
+                           oldtoplevel);
+    fcitxcontext->root_origin_valid = FALSE;
     g_clear_object(&fcitxcontext->client_window);
     if (!client_window) {
         return;
     }
 
     fcitxcontext->client_window = GDK_WINDOW(g_object_ref(client_window));
+    fcitxcontext->surrounding_dirty = TRUE;
 
     GtkWidget *widget = nullptr;
     gdk_window_get_user_data(fcitxcontext->client_window, (gpointer *)&widget);
@@ -460,28 +561,98 @@ static void fcitx_im_context_set_client_window(GtkIMContext *context,
         fcitxcontext->button_press_signal = g_signal_connect(
             widget, "button-press-event",
             G_CALLBACK(fcitx_im_context_button_press_event_cb), fcitxcontext);
+        fcitxcontext->style_changed_signal = g_signal_connect_swapped(
+            widget, "style-set",
+            G_CALLBACK(_fcitx_im_context_style_changed_cb), fcitxcontext);
+        g_signal_connect_swapped(
+            widget, "notify::visibility",
+            G_CALLBACK(_fcitx_im_context_client_changed_cb), fcitxcontext);
+    }
+
+    GtkWidget *toplevel = nullptr;
+    gdk_window_get_user_data(gdk_window_get_toplevel(client_window),
+                             (gpointer *)&toplevel);
+    if (GTK_IS_WIDGET(toplevel)) {
+        fcitxcontext->toplevel_configure_signal = g_signal_connect(
+            toplevel, "configure-event",
+            G_CALLBACK(_fcitx_im_context_toplevel_configure_cb), fcitxcontext);
     }
 }
 
+static GtkIMContext *_fcitx_im_context_get_slave(FcitxIMContext *context) {
+    if (G_LIKELY(context->slave)) {
+        return context->slave;
+    }
+
+    // Most contexts never fall back to the simple context, so only create it
+    // on first use and bring it up to date with what we know so far.
+    context->slave = gtk_im_context_simple_new();
+
+    g_signal_connect(context->slave, "commit", G_CALLBACK(_slave_commit_cb),
+                     context);
+    g_signal_connect(context->slave, "preedit-start",
+                     G_CALLBACK(_slave_preedit_start_cb), context);
+    g_signal_connect(context->slave, "preedit-end",
+                     G_CALLBACK(_slave_preedit_end_cb), context);
+    g_signal_connect(context->slave, "preedit-changed",
+                     G_CALLBACK(_slave_preedit_changed_cb), context);
+    g_signal_connect(context->slave, "retrieve-surrounding",
+                     G_CALLBACK(_slave_retrieve_surrounding_cb), context);
+    g_signal_connect(context->slave, "delete-surrounding",
+                     G_CALLBACK(_slave_delete_surrounding_cb), context);
+
+    gtk_im_context_set_use_preedit(context->slave, context->use_preedit);
+    if (context->has_rect) {
+        gtk_im_context_set_cursor_location(context->slave, &context->area);
+    }
+    if (context->has_focus) {
+        gtk_im_context_focus_in(context->slave);
+    }
+    return context->slave;
+}
+
+static struct xkb_compose_state *
+_fcitx_im_context_get_compose_state(FcitxIMContext *context) {
+    if (!context->xkbComposeState && xkbComposeTable) {
+        context->xkbComposeState =
+            xkb_compose_state_new(xkbComposeTable, XKB_COMPOSE_STATE_NO_FLAGS);
+    }
+    return context->xkbComposeState;
+}
+
+// Key releases and modifiers never change the text of the widget.
+static bool _key_may_edit_text(GdkEventKey *event) {
+    return event->type == GDK_KEY_PRESS && !event->is_modifier;
+}
+
 static gboolean
 fcitx_im_context_filter_keypress_fallback(FcitxIMContext *context,
                                           GdkEventKey *event) {
-    if (!context->xkbComposeState || event->type == GDK_KEY_RELEASE) {
-        return gtk_im_context_filter_keypress(context->slave, event);
+    // The widget is going to handle this key, which may edit the text.
+    if (_key_may_edit_text(event)) {
+        context->surrounding_dirty = TRUE;
+    }
+    struct xkb_compose_state *xkbComposeState = nullptr;
+    if (event->type != GDK_KEY_RELEASE) {
+        xkbComposeState = _fcitx_im_context_get_compose_state(context);
+    }
+    if (!xkbComposeState) {
+        return gtk_im_context_filter_keypress(
+            _fcitx_im_context_get_slave(context), event);
     }
-
-    struct xkb_compose_state *xkbComposeState = context->xkbComposeState;
 
     enum xkb_compose_feed_result result =
         xkb_compose_state_feed(xkbComposeState, event->keyval);
     if (result == XKB_COMPOSE_FEED_IGNORED) {
-        return gtk_im_context_filter_keypress(context->slave, event);
+        return gtk_im_context_filter_keypress(
+            _fcitx_im_context_get_slave(context), event);
     }
 
     enum xkb_compose_status status =
         xkb_compose_state_get_status(xkbComposeState);
     if (status == XKB_COMPOSE_NOTHING) {
-        return gtk_im_context_filter_keypress(context->slave, event);
+        return gtk_im_context_filter_keypress(
+            _fcitx_im_context_get_slave(context), event);
     } else if (status == XKB_COMPOSE_COMPOSED) {
         char buffer[] = {'\0', '\0', '\0', '\0', '\0', '\0', '\0'};
         int length =
@@ -502,6 +673,8 @@ fcitx_im_context_filter_keypress_fallback(FcitxIMContext *context,
 static gboolean fcitx_im_context_filter_keypress(GtkIMContext *context,
                                                  GdkEventKey *event) {
     FcitxIMContext *fcitxcontext = FCITX_IM_CONTEXT(context);
+    KeyDispatchGuard guard;
+    _fcitx_im_context_run_idle_work(fcitxcontext, IdleWorkCommit);
 
     /* check this first, since we use key snooper, most key will be handled. */
     if (fcitx_g_client_is_valid(fcitxcontext->client)) {
@@ -513,10 +686,8 @@ static gboolean fcitx_im_context_filter_keypress(GtkIMContext *context,
 
             /* set_cursor_location_internal() will get origin from X server,
              * it blocks UI. So delay it to idle callback. */
-            gdk_threads_add_idle_full(
-                G_PRIORITY_DEFAULT_IDLE,
-                (GSourceFunc)_set_cursor_location_internal,
-                g_object_ref(fcitxcontext), (GDestroyNotify)g_object_unref);
+            _fcitx_im_context_schedule_idle(fcitxcontext,
+                                            IdleWorkCursorLocation);
         }
     }
 
@@ -530,17 +701,22 @@ static gboolean fcitx_im_context_filter_keypress(GtkIMContext *context,
 
     if (fcitx_g_client_is_valid(fcitxcontext->client) &&
         fcitxcontext->has_focus) {
-        _request_surrounding_text(&fcitxcontext);
+        fcitxcontext->server_needs_reset = TRUE;
+        _fcitx_im_context_run_idle_work(fcitxcontext, IdleWorkCapability);
+        _request_surrounding_text_if_dirty(&fcitxcontext, event);
         if (G_UNLIKELY(!fcitxcontext))
             return FALSE;
 
         auto state = _update_auto_repeat_state(fcitxcontext, event);
 
-        _fcitx_im_context_push_event(fcitxcontext, event);
+        guint serial = _fcitx_im_context_push_event(fcitxcontext, event,
+                                                    !_use_sync_mode);
         if (_use_sync_mode) {
             gboolean ret = fcitx_g_client_process_key_sync(
                 fcitxcontext->client, event->keyval, event->hardware_keycode,
                 state, (event->type != GDK_KEY_PRESS), event->time);
+            // Text committed with the reply goes before the key itself.
+            _fcitx_im_context_run_idle_work(fcitxcontext, IdleWorkCommit);
             if (ret) {
                 event->state |= (guint32)HandledMask;
                 return TRUE;
@@ -553,8 +729,7 @@ static gboolean fcitx_im_context_filter_keypress(GtkIMContext *context,
             fcitx_g_client_process_key(
                 fcitxcontext->client, event->keyval, event->hardware_keycode,
                 state, (event->type != GDK_KEY_PRESS), event->time, -1, NULL,
-                _fcitx_im_context_process_key_cb,
-                gdk_event_copy((GdkEvent *)event));
+                _fcitx_im_context_process_key_cb, GUINT_TO_POINTER(serial));
             event->state |= (guint32)HandledMask;
             return TRUE;
         }
@@ -567,115 +742,135 @@ static gboolean fcitx_im_context_filter_keypress(GtkIMContext *context,
 static void _fcitx_im_context_process_key_cb(GObject *source_object,
                                              GAsyncResult *res,
                                              gpointer user_data) {
-    GdkEventKey *event = (GdkEventKey *)user_data;
     gboolean ret =
         fcitx_g_client_process_key_finish(FCITX_G_CLIENT(source_object), res);
-    if (!ret) {
+    GdkEventKey *event =
+        _fcitx_im_context_take_pending_event(GPOINTER_TO_UINT(user_data), !ret);
+    if (event) {
         event->state |= (guint32)IgnoredMask;
-        gdk_event_put((GdkEvent *)event);
+        _fcitx_im_context_deliver_event(event);
+        gdk_event_free((GdkEvent *)event);
     }
-    gdk_event_free((GdkEvent *)event);
+}
+
+/*
+ * Highlighted preedit text uses the selection colors of the client widget.
+ * They are looked up once, and again after the style of the widget changed.
+ */
+static void _fcitx_im_context_get_highlight_colors(FcitxIMContext *context,
+                                                   PangoColor *fg,
+                                                   PangoColor *bg) {
+    if (!context->highlight_colors_valid) {
+        context->highlight_colors_valid = TRUE;
+        gboolean hasColor = false;
+        GtkWidget *widget = nullptr;
+        if (context->client_window) {
+            gdk_window_get_user_data(context->client_window,
+                                     (gpointer *)&widget);
+        }
+        if (GTK_IS_WIDGET(widget)) {
+            hasColor = true;
+            GtkStyle *style = gtk_widget_get_style(widget);
+            const GdkColor &text = style->text[GTK_STATE_SELECTED];
+            const GdkColor &base = style->base[GTK_STATE_SELECTED];
+            context->highlight_fg = {text.red, text.green, text.blue};
+            context->highlight_bg = {base.red, base.green, base.blue};
+        }
+
+        if (!hasColor) {
+            context->highlight_fg = {0xffff, 0xffff, 0xffff};
+            context->highlight_bg = {0x43ff, 0xacff, 0xe8ff};
+        }
+    }
+    *fg = context->highlight_fg;
+    *bg = context->highlight_bg;
+}
+
+static void _fcitx_im_context_style_changed_cb(FcitxIMContext *context) {
+    context->highlight_colors_valid = FALSE;
+}
+
+static gboolean _fcitx_im_context_toplevel_configure_cb(GtkWidget *,
+                                                        GdkEvent *,
+                                                        gpointer user_data) {
+    FcitxIMContext *context = FCITX_IM_CONTEXT(user_data);
+    context->root_origin_valid = FALSE;
+    return FALSE;
 }
 
 static void _fcitx_im_context_update_preedit(FcitxIMContext *context,
                                              GPtrArray *array, int cursor_pos) {
     context->attrlist = pango_attr_list_new();
 
-    GString *gstr = g_string_new(NULL);
-    GString *commit_gstr = g_string_new(NULL);
+    // The buffers are kept for the next update.
+    if (!context->preedit_buffer) {
+        context->preedit_buffer = g_string_new(NULL);
+        context->commit_preedit_buffer = g_string_new(NULL);
+    }
+    GString *gstr = context->preedit_buffer;
+    GString *commit_gstr = context->commit_preedit_buffer;
+    g_string_truncate(gstr, 0);
+    g_string_truncate(commit_gstr, 0);
+
+    auto insert_attr = [context](PangoAttribute *pango_attr, guint start,
+                                 guint end) {
+        pango_attr->start_index = start;
+        pango_attr->end_index = end;
+        pango_attr_list_insert(context->attrlist, pango_attr);
+    };
 
     if (array) {
         for (unsigned int i = 0; i < array->len; i++) {
-            size_t bytelen = strlen(gstr->str);
             FcitxGPreeditItem *preedit =
                 (FcitxGPreeditItem *)g_ptr_array_index(array, i);
             const gchar *s = preedit->string;
             gint type = preedit->type;
 
-            PangoAttribute *pango_attr = NULL;
+            guint start = gstr->len;
+            g_string_append(gstr, s);
+            guint end = gstr->len;
+
             if ((type & (guint32)fcitx::FcitxTextFormatFlag_Underline)) {
-                pango_attr = pango_attr_underline_new(PANGO_UNDERLINE_SINGLE);
-                pango_attr->start_index = bytelen;
-                pango_attr->end_index = bytelen + strlen(s);
-                pango_attr_list_insert(context->attrlist, pango_attr);
+                insert_attr(pango_attr_underline_new(PANGO_UNDERLINE_SINGLE),
+                            start, end);
             }
             if ((type & (guint32)fcitx::FcitxTextFormatFlag_Strike)) {
-                pango_attr = pango_attr_strikethrough_new(true);
-                pango_attr->start_index = bytelen;
-                pango_attr->end_index = bytelen + strlen(s);
-                pango_attr_list_insert(context->attrlist, pango_attr);
+                insert_attr(pango_attr_strikethrough_new(true), start, end);
             }
             if ((type & (guint32)fcitx::FcitxTextFormatFlag_Bold)) {
-                pango_attr = pango_attr_weight_new(PANGO_WEIGHT_BOLD);
-                pango_attr->start_index = bytelen;
-                pango_attr->end_index = bytelen + strlen(s);
-                pango_attr_list_insert(context->attrlist, pango_attr);
+                insert_attr(pango_attr_weight_new(PANGO_WEIGHT_BOLD), start,
+                            end);
             }
             if ((type & (guint32)fcitx::FcitxTextFormatFlag_Italic)) {
-                pango_attr = pango_attr_style_new(PANGO_STYLE_ITALIC);
-                pango_attr->start_index = bytelen;
-                pango_attr->end_index = bytelen + strlen(s);
-                pango_attr_list_insert(context->attrlist, pango_attr);
+                insert_attr(pango_attr_style_new(PANGO_STYLE_ITALIC), start,
+                            end);
             }
 
             if (type & (guint32)fcitx::FcitxTextFormatFlag_HighLight) {
-                gboolean hasColor = false;
-                GdkColor fg;
-                GdkColor bg;
-                memset(&fg, 0, sizeof(GdkColor));
-                memset(&bg, 0, sizeof(GdkColor));
-
-                if (context->client_window) {
-                    GtkWidget *widget;
-                    gdk_window_get_user_data(context->client_window,
-                                             (gpointer *)&widget);
-                    if (GTK_IS_WIDGET(widget)) {
-                        hasColor = true;
-                        GtkStyle *style = gtk_widget_get_style(widget);
-                        fg = style->text[GTK_STATE_SELECTED];
-                        bg = style->base[GTK_STATE_SELECTED];
-                    }
-                }
-
-                if (!hasColor) {
-                    fg.red = 0xffff;
-                    fg.green = 0xffff;
-                    fg.blue = 0xffff;
-                    bg.red = 0x43ff;
-                    bg.green = 0xacff;
-                    bg.blue = 0xe8ff;
-                }
-
-                pango_attr =
-                    pango_attr_foreground_new(fg.red, fg.green, fg.blue);
-                pango_attr->start_index = bytelen;
-                pango_attr->end_index = bytelen + strlen(s);
-                pango_attr_list_insert(context->attrlist, pango_attr);
-                pango_attr =
-                    pango_attr_background_new(bg.red, bg.green, bg.blue);
-                pango_attr->start_index = bytelen;
-                pango_attr->end_index = bytelen + strlen(s);
-                pango_attr_list_insert(context->attrlist, pango_attr);
+                PangoColor fg, bg;
+                _fcitx_im_context_get_highlight_colors(context, &fg, &bg);
+                insert_attr(
+                    pango_attr_foreground_new(fg.red, fg.green, fg.blue), start,
+                    end);
+                insert_attr(
+                    pango_attr_background_new(bg.red, bg.green, bg.blue), start,
+                    end);
             }
-            gstr = g_string_append(gstr, s);
             if ((type & (guint32)fcitx::FcitxTextFormatFlag_DontCommit) == 0) {
-                commit_gstr = g_string_append(commit_gstr, s);
+                g_string_append_len(commit_gstr, s, end - start);
             }
         }
     }
 
-    gchar *str = g_string_free(gstr, FALSE);
+    context->cursor_pos =
+        g_utf8_pointer_to_offset(gstr->str, gstr->str + cursor_pos);
 
-    context->preedit_string = str;
-    context->commit_preedit_string = g_string_free(commit_gstr, FALSE);
-    context->cursor_pos = g_utf8_pointer_to_offset(str, str + cursor_pos);
-
-    if (context->preedit_string != NULL && context->preedit_string[0] == 0) {
-        g_clear_pointer(&context->preedit_string, g_free);
+    if (gstr->len) {
+        context->preedit_string = g_strndup(gstr->str, gstr->len);
     }
-    if (context->commit_preedit_string != NULL &&
-        context->commit_preedit_string[0] == 0) {
-        g_clear_pointer(&context->commit_preedit_string, g_free);
+    if (commit_gstr->len) {
+        context->commit_preedit_string =
+            g_strndup(commit_gstr->str, commit_gstr->len);
     }
 }
 
@@ -684,6 +879,8 @@ static void _fcitx_im_context_update_formatted_preedit_cb(FcitxGClient *,
                                                           int cursor_pos,
                                                           void *user_data) {
     FcitxIMContext *context = FCITX_IM_CONTEXT(user_data);
+    _fcitx_im_context_run_idle_work(context, IdleWorkCommit);
+    context->server_needs_reset = TRUE;
 
     gboolean visible = false;
 
@@ -745,6 +942,7 @@ static void fcitx_im_context_focus_in(GtkIMContext *context) {
         return;
     }
 
+    _fcitx_im_context_run_idle_work(fcitxcontext, IdleWorkCommit);
     _fcitx_im_context_set_capability(fcitxcontext, FALSE);
 
     fcitxcontext->has_focus = true;
@@ -761,24 +959,43 @@ static void fcitx_im_context_focus_in(GtkIMContext *context) {
     }
 #endif
 
-    if (fcitx_g_client_is_valid(fcitxcontext->client)) {
+    // The input context is created on first focus in if it does not exist.
+    if ((fcitxcontext->idle_work & IdleWorkFocusOut) &&
+        fcitxcontext->server_focus_serial == _focus_in_serial &&
+        !fcitxcontext->focus_out_dropped_preedit) {
+        // Focus is back before the server was told it was lost.
+        fcitxcontext->idle_work &= ~IdleWorkFocusOut;
+        fcitxcontext->skipped_calls += 2;
+    } else {
+        _fcitx_im_context_run_idle_work(fcitxcontext, IdleWorkFocusOut);
+        // The input context is created on first focus in if it does not
+        // exist.
         fcitx_g_client_focus_in(fcitxcontext->client);
+        fcitxcontext->server_needs_reset = TRUE;
+        fcitxcontext->server_focus_serial = ++_focus_in_serial;
     }
+    fcitxcontext->focus_out_dropped_preedit = FALSE;
 
-    gtk_im_context_focus_in(fcitxcontext->slave);
+    if (fcitxcontext->slave) {
+        gtk_im_context_focus_in(fcitxcontext->slave);
+    }
 
+    /* Embedded toplevels move along with their embedder without being
+     * configured, refresh the origin at least on every focus in. */
+    fcitxcontext->root_origin_valid = FALSE;
     /* set_cursor_location_internal() will get origin from X server,
      * it blocks UI. So delay it to idle callback. */
-    gdk_threads_add_idle_full(
-        G_PRIORITY_DEFAULT_IDLE, (GSourceFunc)_set_cursor_location_internal,
-        g_object_ref(fcitxcontext), (GDestroyNotify)g_object_unref);
+    _fcitx_im_context_schedule_idle(fcitxcontext, IdleWorkCursorLocation);
+
+    fcitxcontext->surrounding_dirty = TRUE;
+    if (auto *owner = _fcitx_im_context_surrounding_owner(fcitxcontext)) {
+        g_object_set_qdata(owner, _surrounding_unsupported_quark, NULL);
+    }
 
     /* _request_surrounding_text may trigger freeze in Libreoffice. After
      * focus in, the request is not as urgent as key event. Delay it to main
      * idle callback. */
-    gdk_threads_add_idle_full(
-        G_PRIORITY_DEFAULT_IDLE, (GSourceFunc)_defer_request_surrounding_text,
-        g_object_ref(fcitxcontext), (GDestroyNotify)g_object_unref);
+    _fcitx_im_context_schedule_idle(fcitxcontext, IdleWorkSurroundingText);
 
     g_object_add_weak_pointer((GObject *)context,
                               (gpointer *)&_focus_im_context);
@@ -792,12 +1009,12 @@ static void fcitx_im_context_commit_string(FcitxIMContext *context,
     g_signal_emit(context, _signal_commit_id, 0, str);
 
     // Better request surrounding after commit.
-    gdk_threads_add_idle_full(
-        G_PRIORITY_DEFAULT_IDLE, (GSourceFunc)_defer_request_surrounding_text,
-        g_object_ref(context), (GDestroyNotify)g_object_unref);
+    context->surrounding_dirty = TRUE;
+    _fcitx_im_context_schedule_idle(context, IdleWorkSurroundingText);
 }
 
 static void fcitx_im_context_commit_preedit(FcitxIMContext *context) {
+    _fcitx_im_context_run_idle_work(context, IdleWorkCommit);
     if (!context->has_focus) {
         return;
     }
@@ -821,17 +1038,21 @@ static void fcitx_im_context_focus_out(GtkIMContext *context) {
                                  (gpointer *)&_focus_im_context);
     _focus_im_context = NULL;
 
+    fcitxcontext->focus_out_dropped_preedit =
+        fcitxcontext->preedit_string || fcitxcontext->commit_preedit_string;
     fcitx_im_context_commit_preedit(fcitxcontext);
 
     fcitxcontext->has_focus = false;
     fcitxcontext->last_key_code = 0;
     fcitxcontext->last_is_release = false;
 
-    if (fcitx_g_client_is_valid(fcitxcontext->client)) {
-        fcitx_g_client_focus_out(fcitxcontext->client);
-    }
+    /* Sent from the idle callback, so that focus coming right back, like
+     * with popovers, sends nothing at all. */
+    _fcitx_im_context_schedule_idle(fcitxcontext, IdleWorkFocusOut);
 
-    gtk_im_context_focus_out(fcitxcontext->slave);
+    if (fcitxcontext->slave) {
+        gtk_im_context_focus_out(fcitxcontext->slave);
+    }
 
     return;
 }
@@ -849,15 +1070,54 @@ static void fcitx_im_context_set_cursor_location(GtkIMContext *context,
     }
     fcitxcontext->has_rect = TRUE;
     fcitxcontext->area = *area;
+    // Widgets move the cursor location along with the text cursor.
+    fcitxcontext->surrounding_dirty = TRUE;
 
     if (fcitx_g_client_is_valid(fcitxcontext->client)) {
         _set_cursor_location_internal(fcitxcontext);
     }
-    gtk_im_context_set_cursor_location(fcitxcontext->slave, area);
+    if (fcitxcontext->slave) {
+        gtk_im_context_set_cursor_location(fcitxcontext->slave, area);
+    }
 
     return;
 }
 
+/*
+ * Translate coordinates of the client window to the root window. Windows
+ * inside the toplevel are walked with the positions GDK already knows, while
+ * the origin of the toplevel, which takes a round trip to the X server, is
+ * cached until the toplevel is configured again.
+ */
+static void _fcitx_im_context_get_root_coords(FcitxIMContext *fcitxcontext,
+                                              int *x, int *y) {
+    GdkWindow *window = fcitxcontext->client_window;
+    GdkWindow *toplevel = gdk_window_get_toplevel(window);
+
+    while (window != toplevel) {
+        gint wx, wy;
+        gdk_window_get_position(window, &wx, &wy);
+        *x += wx;
+        *y += wy;
+        window = gdk_window_get_parent(window);
+    }
+
+    if (!fcitxcontext->root_origin_valid) {
+        int rootx, rooty;
+#if GTK_CHECK_VERSION(2, 18, 0)
+        gdk_window_get_root_coords(toplevel, 0, 0, &rootx, &rooty);
+#else
+        gdk_window_get_origin(toplevel, &rootx, &rooty);
+#endif
+        fcitxcontext->root_origin_x = rootx;
+        fcitxcontext->root_origin_y = rooty;
+        fcitxcontext->root_origin_valid = TRUE;
+    }
+
+    *x += fcitxcontext->root_origin_x;
+    *y += fcitxcontext->root_origin_y;
+}
+
 static gboolean _set_cursor_location_internal(FcitxIMContext *fcitxcontext) {
     GdkRectangle area;
 
@@ -875,17 +1135,7 @@ static gboolean _set_cursor_location_internal(FcitxIMContext *fcitxcontext) {
             area.x = 0;
         }
 
-#if GTK_CHECK_VERSION(2, 18, 0)
-        gdk_window_get_root_coords(fcitxcontext->client_window, area.x, area.y,
-                                   &area.x, &area.y);
-#else
-        {
-            int rootx, rooty;
-            gdk_window_get_origin(fcitxcontext->client_window, &rootx, &rooty);
-            area.x += rootx;
-            area.y += rooty;
-        }
-#endif
+        _fcitx_im_context_get_root_coords(fcitxcontext, &area.x, &area.y);
     }
     int scale = 1;
     area.x *= scale;
@@ -893,6 +1143,19 @@ static gboolean _set_cursor_location_internal(FcitxIMContext *fcitxcontext) {
     area.width *= scale;
     area.height *= scale;
 
+    if (fcitxcontext->server_has_rect &&
+        fcitxcontext->server_rect_scale == scale &&
+        fcitxcontext->server_rect.x == area.x &&
+        fcitxcontext->server_rect.y == area.y &&
+        fcitxcontext->server_rect.width == area.width &&
+        fcitxcontext->server_rect.height == area.height) {
+        fcitxcontext->skipped_calls++;
+        return FALSE;
+    }
+    fcitxcontext->server_has_rect = TRUE;
+    fcitxcontext->server_rect = area;
+    fcitxcontext->server_rect_scale = scale;
+
     // We don't really need this check, but we can keep certain level of
     // compatibility for fcitx 4.
     fcitx_g_client_set_cursor_rect(fcitxcontext->client, area.x, area.y,
@@ -900,9 +1163,63 @@ static gboolean _set_cursor_location_internal(FcitxIMContext *fcitxcontext) {
     return FALSE;
 }
 
-static gboolean _defer_request_surrounding_text(FcitxIMContext *fcitxcontext) {
-    _request_surrounding_text(&fcitxcontext);
-    return FALSE;
+static gboolean _fcitx_im_context_idle_cb(FcitxIMContext *context) {
+    context->idle_id = 0;
+    _fcitx_im_context_run_idle_work(context, context->idle_work);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Queue work for the idle callback of the context. Each context has at most
+ * one idle source, which does all work queued until it runs once.
+ */
+static void _fcitx_im_context_schedule_idle(FcitxIMContext *context,
+                                            guint work) {
+    context->idle_work |= work;
+    // Commits must reach the widget before it is painted again.
+    gint priority = (context->idle_work & IdleWorkCommit)
+                        ? G_PRIORITY_HIGH_IDLE
+                        : G_PRIORITY_DEFAULT_IDLE;
+    if (context->idle_id) {
+        if (priority == G_PRIORITY_HIGH_IDLE) {
+            g_source_set_priority(
+                g_main_context_find_source_by_id(NULL, context->idle_id),
+                priority);
+        }
+        return;
+    }
+    context->idle_id = gdk_threads_add_idle_full(
+        priority, (GSourceFunc)_fcitx_im_context_idle_cb, g_object_ref(context),
+        (GDestroyNotify)g_object_unref);
+}
+
+// Do the given work now if it is queued, instead of waiting for the idle.
+static void _fcitx_im_context_run_idle_work(FcitxIMContext *context,
+                                            guint work) {
+    work &= context->idle_work;
+    context->idle_work &= ~work;
+
+    if (work & IdleWorkCommit) {
+        // Emitting commit may run anything, so take the text first.
+        gchar *str = g_string_free(context->pending_commit, FALSE);
+        context->pending_commit = nullptr;
+        fcitx_im_context_commit_string(context, str);
+        g_free(str);
+    }
+    if (work & IdleWorkFocusOut) {
+        fcitx_g_client_focus_out(context->client);
+    }
+    if (work & IdleWorkCapability) {
+        _fcitx_im_context_set_capability(context, FALSE);
+    }
+    if (work & IdleWorkCursorLocation) {
+        _set_cursor_location_internal(context);
+    }
+    if (work & IdleWorkSurroundingText) {
+        _request_surrounding_text_if_dirty(&context, NULL);
+    }
+    /* The source is left to run even if nothing is queued anymore. It may
+     * hold the last reference to the context, which callers still use. */
 }
 
 ///
@@ -911,9 +1228,11 @@ static void fcitx_im_context_set_use_preedit(GtkIMContext *context,
     FcitxIMContext *fcitxcontext = FCITX_IM_CONTEXT(context);
 
     fcitxcontext->use_preedit = _use_preedit && use_preedit;
-    _fcitx_im_context_set_capability(fcitxcontext, FALSE);
+    _fcitx_im_context_schedule_idle(fcitxcontext, IdleWorkCapability);
 
-    gtk_im_context_set_use_preedit(fcitxcontext->slave, use_preedit);
+    if (fcitxcontext->slave) {
+        gtk_im_context_set_use_preedit(fcitxcontext->slave, use_preedit);
+    }
 }
 
 static guint get_selection_anchor_point(FcitxIMContext *fcitxcontext,
@@ -973,6 +1292,46 @@ static guint get_selection_anchor_point(FcitxIMContext *fcitxcontext,
     return anchor;
 }
 
+static void _fcitx_im_context_update_surrounding(FcitxIMContext *fcitxcontext,
+                                                 const gchar *text, gsize len,
+                                                 gsize cursor_index) {
+    // Only the text around the cursor is of interest, and widgets like
+    // GtkTextView may pass a whole paragraph of any size.
+    gsize begin, end;
+    surrounding_text_window(text, len, cursor_index, _surrounding_text_window,
+                            &begin, &end);
+    const gchar *window = text + begin;
+    gsize window_len = end - begin;
+
+    gchar *p = nullptr;
+    if (!fcitxcontext->surrounding_text ||
+        fcitxcontext->surrounding_text_len != window_len ||
+        memcmp(fcitxcontext->surrounding_text, window, window_len) != 0) {
+        // It is sent over D-Bus, which only accepts valid UTF-8.
+        if (!utf8_validate(window, window_len)) {
+            return;
+        }
+        p = g_strndup(window, window_len);
+        g_free(fcitxcontext->surrounding_text);
+        fcitxcontext->surrounding_text = p;
+        fcitxcontext->surrounding_text_len = window_len;
+        fcitxcontext->surrounding_offsets.reset(p, window_len);
+    }
+
+    gint cursor_pos = fcitxcontext->surrounding_offsets.charOffset(
+        fcitxcontext->surrounding_text, cursor_index - begin);
+    gint anchor_pos = get_selection_anchor_point(
+        fcitxcontext, cursor_pos, fcitxcontext->surrounding_offsets.length());
+
+    if (p || fcitxcontext->last_cursor_pos != cursor_pos ||
+        fcitxcontext->last_anchor_pos != anchor_pos) {
+        fcitxcontext->last_cursor_pos = cursor_pos;
+        fcitxcontext->last_anchor_pos = anchor_pos;
+        fcitx_g_client_set_surrounding_text(fcitxcontext->client, p,
+                                            cursor_pos, anchor_pos);
+    }
+}
+
 static void fcitx_im_context_set_surrounding(GtkIMContext *context,
                                              const gchar *text, gint l,
                                              gint cursor_index) {
@@ -992,32 +1351,48 @@ static void fcitx_im_context_set_surrounding(GtkIMContext *context,
     if (fcitx_g_client_is_valid(fcitxcontext->client) &&
         !(fcitxcontext->last_updated_capability &
           (guint64)fcitx::FcitxCapabilityFlag_Password)) {
-        gint cursor_pos;
-        guint utf8_len;
-        gchar *p;
-
-        p = g_strndup(text, len);
-        cursor_pos = g_utf8_strlen(p, cursor_index);
-        utf8_len = g_utf8_strlen(p, len);
-
-        gint anchor_pos =
-            get_selection_anchor_point(fcitxcontext, cursor_pos, utf8_len);
-        if (g_strcmp0(fcitxcontext->surrounding_text, p) == 0) {
-            g_clear_pointer(&p, g_free);
-        } else {
-            g_free(fcitxcontext->surrounding_text);
-            fcitxcontext->surrounding_text = p;
-        }
+        _fcitx_im_context_update_surrounding(fcitxcontext, text, len,
+                                             cursor_index);
+    }
+    if (fcitxcontext->slave) {
+        gtk_im_context_set_surrounding(fcitxcontext->slave, text, l,
+                                       cursor_index);
+    }
+}
+
+/*
+ * Capability flags derived from the client window and its widget. They are
+ * cached until the client window changes, or its widget changes its
+ * visibility.
+ */
+static guint64
+_fcitx_im_context_client_capability(FcitxIMContext *fcitxcontext) {
+    if (fcitxcontext->client_capability_valid) {
+        return fcitxcontext->client_capability;
+    }
 
-        if (p || fcitxcontext->last_cursor_pos != cursor_pos ||
-            fcitxcontext->last_anchor_pos != anchor_pos) {
-            fcitxcontext->last_cursor_pos = cursor_pos;
-            fcitxcontext->last_anchor_pos = anchor_pos;
-            fcitx_g_client_set_surrounding_text(fcitxcontext->client, p,
-                                                cursor_pos, anchor_pos);
+    guint64 flags = 0;
+    GtkWidget *widget = nullptr;
+    if (fcitxcontext->client_window != NULL) {
+        // always run this code against all gtk version
+        // seems visibility != PASSWORD hint
+        gdk_window_get_user_data(fcitxcontext->client_window,
+                                 (gpointer *)&widget);
+        if (GTK_IS_ENTRY(widget) &&
+            !gtk_entry_get_visibility(GTK_ENTRY(widget))) {
+            flags |= (guint64)fcitx::FcitxCapabilityFlag_Password;
         }
     }
-    gtk_im_context_set_surrounding(fcitxcontext->slave, text, l, cursor_index);
+
+    fcitxcontext->client_capability = flags;
+    // Without a widget, nothing tells when the flags change.
+    fcitxcontext->client_capability_valid = GTK_IS_WIDGET(widget);
+    return flags;
+}
+
+static void _fcitx_im_context_client_changed_cb(FcitxIMContext *context) {
+    context->client_capability_valid = FALSE;
+    _fcitx_im_context_schedule_idle(context, IdleWorkCapability);
 }
 
 void _fcitx_im_context_set_capability(FcitxIMContext *fcitxcontext,
@@ -1037,37 +1412,148 @@ void _fcitx_im_context_set_capability(FcitxIMContext *fcitxcontext,
         flags |= (guint64)fcitx::FcitxCapabilityFlag_ReportKeyRepeat;
         flags |= (guint64)fcitx::FcitxCapabilityFlag_ClientUnfocusCommit;
 
-        // always run this code against all gtk version
-        // seems visibility != PASSWORD hint
-        if (fcitxcontext->client_window != NULL) {
-            GtkWidget *widget;
-            gdk_window_get_user_data(fcitxcontext->client_window,
-                                     (gpointer *)&widget);
-            if (GTK_IS_ENTRY(widget) &&
-                !gtk_entry_get_visibility(GTK_ENTRY(widget))) {
-                flags |= (guint64)fcitx::FcitxCapabilityFlag_Password;
-            }
-        }
+        flags |= _fcitx_im_context_client_capability(fcitxcontext);
 
         gboolean update = FALSE;
         if (G_UNLIKELY(fcitxcontext->last_updated_capability != flags)) {
             fcitxcontext->last_updated_capability = flags;
             update = TRUE;
         }
-        if (G_UNLIKELY(update || force))
+        if (G_UNLIKELY(update || force)) {
             fcitx_g_client_set_capability(
                 fcitxcontext->client, fcitxcontext->last_updated_capability);
+        } else {
+            fcitxcontext->skipped_calls++;
+        }
     }
 }
 
-static void _fcitx_im_context_push_event(FcitxIMContext *fcitxcontext,
-                                         GdkEventKey *event) {
-    // Keep a copy of latest event.
-    g_queue_push_head(&fcitxcontext->gdk_events,
-                      gdk_event_copy((GdkEvent *)event));
-    while (g_queue_get_length(&fcitxcontext->gdk_events) > MAX_CACHED_EVENTS) {
-        gdk_event_free(static_cast<GdkEvent *>(
-            g_queue_pop_tail(&fcitxcontext->gdk_events)));
+static inline guint _cached_event_hash(guint keyval, guint state,
+                                       gboolean isRelease) {
+    guint hash = (keyval * 31u + state) * 2u + (isRelease ? 1u : 0u);
+    return (hash ^ (hash >> 16)) % CACHED_EVENTS_INDEX_SIZE;
+}
+
+static GdkEventKey *
+_cached_event_to_gdk_event(const FcitxCachedKeyEvent *record) {
+    GdkEventKey *event = (GdkEventKey *)gdk_event_new(
+        record->is_release ? GDK_KEY_RELEASE : GDK_KEY_PRESS);
+    if (record->window) {
+        event->window = (GdkWindow *)g_object_ref(record->window);
+    }
+    event->send_event = FALSE;
+    event->time = record->time;
+    event->state = record->state;
+    event->keyval = record->keyval;
+    event->hardware_keycode = record->hardware_keycode;
+    event->group = record->group;
+    event->is_modifier = record->is_modifier;
+    _fill_key_event_string(event);
+    return event;
+}
+
+static void _cached_event_release(FcitxCachedKeyEvent *record) {
+    if (record->pending) {
+        // The reply is still to come, keep what it needs to replay the key.
+        if (!_spilled_events) {
+            _spilled_events = g_hash_table_new_full(
+                g_direct_hash, g_direct_equal, nullptr,
+                (GDestroyNotify)((void *)gdk_event_free));
+        }
+        g_hash_table_insert(_spilled_events, GUINT_TO_POINTER(record->serial),
+                            _cached_event_to_gdk_event(record));
+    }
+    g_clear_object(&record->window);
+    record->serial = 0;
+    record->owner = nullptr;
+    record->pending = false;
+}
+
+static guint _fcitx_im_context_push_event(FcitxIMContext *fcitxcontext,
+                                          GdkEventKey *event,
+                                          gboolean pending) {
+    if (G_UNLIKELY(++_cached_events_serial == 0)) {
+        ++_cached_events_serial;
+    }
+    guint serial = _cached_events_serial;
+    FcitxCachedKeyEvent *record = &_cached_events[serial % MAX_CACHED_EVENTS];
+    _cached_event_release(record);
+
+    record->serial = serial;
+    record->owner = fcitxcontext;
+    record->window =
+        event->window ? (GdkWindow *)g_object_ref(event->window) : nullptr;
+    record->time = event->time;
+    record->keyval = event->keyval;
+    record->state = event->state;
+    record->hardware_keycode = event->hardware_keycode;
+    record->group = event->group;
+    record->is_release = event->type == GDK_KEY_RELEASE;
+    record->is_modifier = event->is_modifier;
+    record->pending = pending;
+
+    _cached_events_index[_cached_event_hash(record->keyval, record->state,
+                                            record->is_release)] = serial;
+    return serial;
+}
+
+static const FcitxCachedKeyEvent *
+_fcitx_im_context_find_cached_event(FcitxIMContext *fcitxcontext, guint keyval,
+                                    guint state, gboolean isRelease) {
+    auto matches = [=](const FcitxCachedKeyEvent *record, guint serial) {
+        return serial != 0 && record->serial == serial &&
+               record->owner == fcitxcontext && record->keyval == keyval &&
+               record->state == state &&
+               record->is_release == static_cast<bool>(isRelease);
+    };
+    guint serial =
+        _cached_events_index[_cached_event_hash(keyval, state, isRelease)];
+    const FcitxCachedKeyEvent *record =
+        &_cached_events[serial % MAX_CACHED_EVENTS];
+    if (matches(record, serial)) {
+        return record;
+    }
+    // The slot was taken by another key with the same hash.
+    for (guint i = 0; i < MAX_CACHED_EVENTS; i++) {
+        serial = _cached_events_serial - i;
+        record = &_cached_events[serial % MAX_CACHED_EVENTS];
+        if (matches(record, serial)) {
+            return record;
+        }
+    }
+    return nullptr;
+}
+
+static GdkEventKey *_fcitx_im_context_take_pending_event(guint serial,
+                                                         gboolean replay) {
+    FcitxCachedKeyEvent *record = &_cached_events[serial % MAX_CACHED_EVENTS];
+    if (record->serial == serial && record->pending) {
+        record->pending = false;
+        return replay ? _cached_event_to_gdk_event(record) : nullptr;
+    }
+
+    gpointer event = nullptr;
+    if (_spilled_events &&
+        g_hash_table_steal_extended(_spilled_events, GUINT_TO_POINTER(serial),
+                                    nullptr, &event)) {
+        if (replay) {
+            return static_cast<GdkEventKey *>(event);
+        }
+        gdk_event_free(static_cast<GdkEvent *>(event));
+    }
+    return nullptr;
+}
+
+static void _fcitx_im_context_forget_cached_events(FcitxIMContext *context) {
+    for (auto &record : _cached_events) {
+        if (record.owner != context) {
+            continue;
+        }
+        // A pending record may still be replayed once its reply arrives.
+        record.owner = nullptr;
+        if (!record.pending) {
+            _cached_event_release(&record);
+        }
     }
 }
 
@@ -1076,16 +1562,26 @@ static void fcitx_im_context_reset(GtkIMContext *context) {
     FcitxIMContext *fcitxcontext = FCITX_IM_CONTEXT(context);
 
     fcitx_im_context_commit_preedit(fcitxcontext);
+    fcitxcontext->surrounding_dirty = TRUE;
 
     if (fcitx_g_client_is_valid(fcitxcontext->client)) {
-        fcitx_g_client_reset(fcitxcontext->client);
+        // Nothing was typed since the last reset, so there is nothing to
+        // reset. This is the common case for clicks in a widget.
+        if (fcitxcontext->server_needs_reset) {
+            fcitxcontext->server_needs_reset = FALSE;
+            fcitx_g_client_reset(fcitxcontext->client);
+        } else {
+            fcitxcontext->skipped_calls++;
+        }
     }
 
     if (fcitxcontext->xkbComposeState) {
         xkb_compose_state_reset(fcitxcontext->xkbComposeState);
     }
 
-    gtk_im_context_reset(fcitxcontext->slave);
+    if (fcitxcontext->slave) {
+        gtk_im_context_reset(fcitxcontext->slave);
+    }
 }
 
 static void fcitx_im_context_get_preedit_string(GtkIMContext *context,
@@ -1102,26 +1598,33 @@ static void fcitx_im_context_get_preedit_string(GtkIMContext *context,
         }
         if (attrs) {
             if (fcitxcontext->attrlist == NULL) {
-                *attrs = pango_attr_list_new();
-
-                if (str) {
-                    PangoAttribute *pango_attr;
-                    pango_attr =
-                        pango_attr_underline_new(PANGO_UNDERLINE_SINGLE);
-                    pango_attr->start_index = 0;
-                    pango_attr->end_index = strlen(*str);
-                    pango_attr_list_insert(*attrs, pango_attr);
-                }
-            } else {
-                *attrs = pango_attr_list_ref(fcitxcontext->attrlist);
+                // Kept until the preedit changes, like the formatted one.
+                fcitxcontext->attrlist = pango_attr_list_new();
+                PangoAttribute *pango_attr =
+                    pango_attr_underline_new(PANGO_UNDERLINE_SINGLE);
+                pango_attr->start_index = 0;
+                const gchar *preedit = fcitxcontext->preedit_string;
+                pango_attr->end_index = preedit ? strlen(preedit) : 0;
+                pango_attr_list_insert(fcitxcontext->attrlist, pango_attr);
             }
+            *attrs = pango_attr_list_ref(fcitxcontext->attrlist);
         }
         if (cursor_pos)
             *cursor_pos = fcitxcontext->cursor_pos;
 
-    } else {
+    } else if (fcitxcontext->slave) {
         gtk_im_context_get_preedit_string(fcitxcontext->slave, str, attrs,
                                           cursor_pos);
+    } else {
+        if (str) {
+            *str = g_strdup("");
+        }
+        if (attrs) {
+            *attrs = pango_attr_list_new();
+        }
+        if (cursor_pos) {
+            *cursor_pos = 0;
+        }
     }
     return;
 }
@@ -1178,27 +1681,94 @@ static gboolean _slave_delete_surrounding_cb(GtkIMContext *,
     return return_value;
 }
 
+/*
+ * Engines may commit several pieces in a row. They are emitted as a single
+ * commit from the idle callback, or right before anything that has to come
+ * after them.
+ */
 void _fcitx_im_context_commit_string_cb(FcitxGClient *, char *str,
                                         void *user_data) {
     FcitxIMContext *context = FCITX_IM_CONTEXT(user_data);
-    fcitx_im_context_commit_string(context, str);
+    if (context->pending_commit) {
+        g_string_append(context->pending_commit, str);
+    } else {
+        context->pending_commit = g_string_new(str);
+    }
+    _fcitx_im_context_schedule_idle(context, IdleWorkCommit);
 }
 
 void _fcitx_im_context_forward_key_cb(FcitxGClient *, guint keyval, guint state,
                                       gboolean isRelease, void *user_data) {
     FcitxIMContext *context = FCITX_IM_CONTEXT(user_data);
+    _fcitx_im_context_run_idle_work(context, IdleWorkCommit);
     GdkEventKey *event = _create_gdk_event(context, keyval, state, isRelease);
     event->state |= (guint32)IgnoredMask;
-    gdk_event_put((GdkEvent *)event);
+    _fcitx_im_context_deliver_event(event);
     gdk_event_free((GdkEvent *)event);
 }
 
+/*
+ * Deliver a key marked with IgnoredMask to its widget. Outside of any key
+ * processing it is dispatched right away, instead of taking another trip
+ * through the GDK event queue. Inside of it, GTK is in the middle of
+ * delivering a key, so fall back to queueing it.
+ */
+static void _fcitx_im_context_deliver_event(GdkEventKey *event) {
+    if (_use_direct_dispatch && _key_dispatch_depth == 0 && event->window) {
+        KeyDispatchGuard guard;
+        gtk_main_do_event((GdkEvent *)event);
+        return;
+    }
+    gdk_event_put((GdkEvent *)event);
+}
+
 static void _fcitx_im_context_delete_surrounding_text_cb(
     FcitxGClient *, gint offset_from_cursor, guint nchars, void *user_data) {
     FcitxIMContext *context = FCITX_IM_CONTEXT(user_data);
+    _fcitx_im_context_run_idle_work(context, IdleWorkCommit);
     gboolean return_value;
     g_signal_emit(context, _signal_delete_surrounding_id, 0, offset_from_cursor,
                   nchars, &return_value);
+    context->surrounding_dirty = TRUE;
+}
+
+static void _keymap_keys_changed_cb(GdkKeymap *, gpointer user_data) {
+    g_hash_table_remove_all(static_cast<GHashTable *>(user_data));
+}
+
+/*
+ * Looking up a keyval in the keymap walks the whole keymap, so remember the
+ * keycode per keymap until its layout changes.
+ */
+static guint16 _keymap_lookup_keycode(GdkKeymap *keymap, guint keyval) {
+    static GQuark quark = g_quark_from_static_string("fcitx-keycode-cache");
+    auto *cache =
+        static_cast<GHashTable *>(g_object_get_qdata(G_OBJECT(keymap), quark));
+    if (!cache) {
+        cache = g_hash_table_new(g_direct_hash, g_direct_equal);
+        g_object_set_qdata_full(G_OBJECT(keymap), quark, cache,
+                                (GDestroyNotify)g_hash_table_unref);
+        g_signal_connect(keymap, "keys-changed",
+                         G_CALLBACK(_keymap_keys_changed_cb), cache);
+    }
+
+    gpointer value;
+    if (g_hash_table_lookup_extended(cache, GUINT_TO_POINTER(keyval), NULL,
+                                     &value)) {
+        return GPOINTER_TO_UINT(value);
+    }
+
+    guint16 keycode = 0;
+    GdkKeymapKey *keys;
+    gint n_keys = 0;
+    if (gdk_keymap_get_entries_for_keyval(keymap, keyval, &keys, &n_keys)) {
+        if (n_keys)
+            keycode = keys[0].keycode;
+        g_free(keys);
+    }
+    g_hash_table_insert(cache, GUINT_TO_POINTER(keyval),
+                        GUINT_TO_POINTER(keycode));
+    return keycode;
 }
 
 /* Copy from gdk */
@@ -1206,32 +1776,13 @@ static GdkEventKey *_create_gdk_event(FcitxIMContext *fcitxcontext,
                                       guint keyval, guint state,
                                       gboolean isRelease) {
     if (fcitxcontext) {
-        struct FindKey {
-            guint keyval;
-            guint state;
-            gboolean isRelease;
-        } data = {keyval, state, isRelease};
         // Unset auto repeat state.
-        data.state &= (~(1u << 31));
-        auto *result = g_queue_find_custom(
-            &fcitxcontext->gdk_events, &data,
-            (GCompareFunc)(+[](GdkEventKey *event, FindKey *data) {
-                if (event->keyval == data->keyval &&
-                    event->state == data->state &&
-                    data->isRelease == (event->type == GDK_KEY_RELEASE)) {
-                    return 0;
-                }
-                return 1;
-            }));
-        if (result) {
-            return reinterpret_cast<GdkEventKey *>(
-                gdk_event_copy(static_cast<const GdkEvent *>(result->data)));
+        if (const auto *record = _fcitx_im_context_find_cached_event(
+                fcitxcontext, keyval, state & (~(1u << 31)), isRelease)) {
+            return _cached_event_to_gdk_event(record);
         }
     }
 
-    gunichar c = 0;
-    gchar buf[8];
-
     GdkEventKey *event = (GdkEventKey *)gdk_event_new(
         isRelease ? GDK_KEY_RELEASE : GDK_KEY_PRESS);
 
@@ -1273,22 +1824,23 @@ static GdkEventKey *_create_gdk_event(FcitxIMContext *fcitxcontext,
 #else
         GdkDisplay *display = gdk_window_get_display(event->window);
 #endif
-        GdkKeymap *keymap = gdk_keymap_get_for_display(display);
-        GdkKeymapKey *keys;
-        gint n_keys = 0;
-
-        if (gdk_keymap_get_entries_for_keyval(keymap, keyval, &keys, &n_keys)) {
-            if (n_keys)
-                event->hardware_keycode = keys[0].keycode;
-            g_free(keys);
-        }
+        event->hardware_keycode =
+            _keymap_lookup_keycode(gdk_keymap_get_for_display(display), keyval);
     }
 
     event->group = 0;
     event->is_modifier = _key_is_modifier(keyval);
+    _fill_key_event_string(event);
+
+    return event;
+}
 
-    if (keyval != GDK_VoidSymbol)
-        c = gdk_keyval_to_unicode(keyval);
+static void _fill_key_event_string(GdkEventKey *event) {
+    gunichar c = 0;
+    gchar buf[8];
+
+    if (event->keyval != GDK_VoidSymbol)
+        c = gdk_keyval_to_unicode(event->keyval);
 
     if (c) {
         gsize bytes_written;
@@ -1306,8 +1858,7 @@ static GdkEventKey *_create_gdk_event(FcitxIMContext *fcitxcontext,
                 event->string = (gchar *)g_memdup("\0\0", 2);
 #endif
                 event->length = 1;
-                buf[0] = '\0';
-                goto out;
+                return;
             } else if (c >= '3' && c <= '7')
                 c -= ('3' - '\033');
             else if (c == '8')
@@ -1319,14 +1870,22 @@ static GdkEventKey *_create_gdk_event(FcitxIMContext *fcitxcontext,
         len = g_unichar_to_utf8(c, buf);
         buf[len] = '\0';
 
-        event->string =
-            g_locale_from_utf8(buf, len, NULL, &bytes_written, NULL);
-        if (event->string)
-            event->length = bytes_written;
-    } else if (keyval == GDK_Escape) {
+        // The charset of the locale does not change under a running
+        // application, and it is UTF-8 almost everywhere.
+        static const gboolean utf8_locale = g_get_charset(NULL);
+        if (utf8_locale) {
+            event->string = g_strndup(buf, len);
+            event->length = len;
+        } else {
+            event->string =
+                g_locale_from_utf8(buf, len, NULL, &bytes_written, NULL);
+            if (event->string)
+                event->length = bytes_written;
+        }
+    } else if (event->keyval == GDK_Escape) {
         event->length = 1;
         event->string = g_strdup("\033");
-    } else if (keyval == GDK_Return || keyval == GDK_KP_Enter) {
+    } else if (event->keyval == GDK_Return || event->keyval == GDK_KP_Enter) {
         event->length = 1;
         event->string = g_strdup("\r");
     }
@@ -1335,8 +1894,6 @@ static GdkEventKey *_create_gdk_event(FcitxIMContext *fcitxcontext,
         event->length = 0;
         event->string = g_strdup("");
     }
-out:
-    return event;
 }
 
 static gboolean _key_is_modifier(guint keyval) {
@@ -1419,14 +1976,30 @@ void _fcitx_im_context_connect_cb(FcitxGClient *im, void *user_data) {
     }
 
     _fcitx_im_context_set_capability(context, TRUE);
+    // A new input context on the server side knows no surrounding text yet.
+    context->surrounding_dirty = TRUE;
+    context->server_needs_reset = TRUE;
+    context->server_has_rect = FALSE;
     if (context->has_focus && _focus_im_context == (GtkIMContext *)context &&
-        fcitx_g_client_is_valid(context->client))
+        fcitx_g_client_is_valid(context->client)) {
         fcitx_g_client_focus_in(context->client);
+        context->server_focus_serial = ++_focus_in_serial;
+    }
     /* set_cursor_location_internal() will get origin from X server,
      * it blocks UI. So delay it to idle callback. */
-    gdk_threads_add_idle_full(
-        G_PRIORITY_DEFAULT_IDLE, (GSourceFunc)_set_cursor_location_internal,
-        g_object_ref(context), (GDestroyNotify)g_object_unref);
+    _fcitx_im_context_schedule_idle(context, IdleWorkCursorLocation);
+}
+
+static GObject *_fcitx_im_context_surrounding_owner(FcitxIMContext *context) {
+    if (!context->client_window) {
+        return nullptr;
+    }
+    GtkWidget *widget = nullptr;
+    gdk_window_get_user_data(context->client_window, (gpointer *)&widget);
+    if (GTK_IS_WIDGET(widget)) {
+        return G_OBJECT(widget);
+    }
+    return G_OBJECT(context->client_window);
 }
 
 static void _request_surrounding_text(FcitxIMContext **context) {
@@ -1444,6 +2017,11 @@ static void _request_surrounding_text(FcitxIMContext **context) {
                                          (gpointer *)context);
         else
             return;
+        (*context)->surrounding_dirty = FALSE;
+        if (auto *owner = _fcitx_im_context_surrounding_owner(*context)) {
+            g_object_set_qdata(owner, _surrounding_unsupported_quark,
+                               return_value ? NULL : GINT_TO_POINTER(TRUE));
+        }
         if (return_value) {
             (*context)->support_surrounding_text = TRUE;
             _fcitx_im_context_set_capability(*context, FALSE);
@@ -1454,7 +2032,32 @@ static void _request_surrounding_text(FcitxIMContext **context) {
     }
 }
 
+/*
+ * Only ask the widget for the surrounding text when it may have changed since
+ * the last time, and not for widgets that turned out not to provide it.
+ */
+static void _request_surrounding_text_if_dirty(FcitxIMContext **context,
+                                               GdkEventKey *event) {
+    if (event && !_key_may_edit_text(event)) {
+        return;
+    }
+    if (!(*context)->surrounding_dirty) {
+        return;
+    }
+    auto *owner = _fcitx_im_context_surrounding_owner(*context);
+    if (owner && g_object_get_qdata(owner, _surrounding_unsupported_quark)) {
+        (*context)->surrounding_dirty = FALSE;
+        if ((*context)->support_surrounding_text) {
+            (*context)->support_surrounding_text = FALSE;
+            _fcitx_im_context_set_capability(*context, FALSE);
+        }
+        return;
+    }
+    _request_surrounding_text(context);
+}
+
 static gint _key_snooper_cb(GtkWidget *, GdkEventKey *event, gpointer) {
+    KeyDispatchGuard guard;
     gboolean retval = FALSE;
 
     FcitxIMContext *fcitxcontext = (FcitxIMContext *)_focus_im_context;
@@ -1465,6 +2068,8 @@ static gint _key_snooper_cb(GtkWidget *, GdkEventKey *event, gpointer) {
     if (fcitxcontext == NULL || !fcitxcontext->has_focus)
         return FALSE;
 
+    _fcitx_im_context_run_idle_work(fcitxcontext, IdleWorkCommit);
+
     if (G_UNLIKELY(event->state & (guint32)HandledMask))
         return TRUE;
 
@@ -1476,23 +2081,26 @@ static gint _key_snooper_cb(GtkWidget *, GdkEventKey *event, gpointer) {
             break;
         }
 
-        _request_surrounding_text(&fcitxcontext);
+        fcitxcontext->server_needs_reset = TRUE;
+        _fcitx_im_context_run_idle_work(fcitxcontext, IdleWorkCapability);
+        _request_surrounding_text_if_dirty(&fcitxcontext, event);
         if (G_UNLIKELY(!fcitxcontext))
             return FALSE;
 
         auto state = _update_auto_repeat_state(fcitxcontext, event);
 
-        _fcitx_im_context_push_event(fcitxcontext, event);
+        guint serial = _fcitx_im_context_push_event(fcitxcontext, event,
+                                                    !_use_sync_mode);
         if (_use_sync_mode) {
             retval = fcitx_g_client_process_key_sync(
                 fcitxcontext->client, event->keyval, event->hardware_keycode,
                 state, (event->type == GDK_KEY_RELEASE), event->time);
+            _fcitx_im_context_run_idle_work(fcitxcontext, IdleWorkCommit);
         } else {
             fcitx_g_client_process_key(
                 fcitxcontext->client, event->keyval, event->hardware_keycode,
                 state, (event->type == GDK_KEY_RELEASE), event->time, -1, NULL,
-                _fcitx_im_context_process_key_cb,
-                gdk_event_copy((GdkEvent *)event));
+                _fcitx_im_context_process_key_cb, GUINT_TO_POINTER(serial));
             retval = TRUE;
         }
     } while (0);
@@ -0,0 +1,593 @@
+/*
+ * SPDX-FileCopyrightText: 2026~2026 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+
+/*
+ * fcitx5-gtk3-immodule-bench and fcitx5-gtk4-immodule-bench type into text
+ * widgets through the im module of the build tree, against fcitx5-gtk-mockd
+ * on a private bus, under the Broadway backend so that neither a display nor
+ * a GPU is needed. For each widget they report the latency from the key press
+ * to the commit, to the preedit change and to the next frame painted after
+ * it, and for how long the main loop was stalled.
+ *
+ * The driver starts broadwayd and the daemon, then runs itself once for every
+ * mode, since the im module reads its mode from the environment once: sync,
+ * async and, for GTK3, async through the key snooper. Arguments after "--"
+ * are passed on to fcitx5-gtk-mockd, e.g. to add latency.
+ *
+ * GTK3 key events are put into the event queue of the display, so they take
+ * the same path as real ones, including the key snooper. GTK4 has no API to
+ * make a key event, so the keys are fed with gtk_im_context_filter_key() into
+ * an input context of the benchmark attached to the widget instead, which
+ * leaves out the event dispatch of GTK before it.
+ */
+
+#include "fcitx-gclient/fcitxgbenchprivate.h"
+#include <errno.h>
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if GTK_CHECK_VERSION(4, 0, 0)
+#define FCITX_IM_BENCH_GTK "gtk4"
+#define FCITX_IM_BENCH_BROADWAYD "gtk4-broadwayd"
+#else
+#define FCITX_IM_BENCH_GTK "gtk3"
+#define FCITX_IM_BENCH_BROADWAYD "broadwayd"
+#endif
+
+/* What the daemon commits, so it is not mistaken for a key typed directly. */
+#define FCITX_IM_BENCH_COMMIT "fcitx"
+/* Time to wait for the response to a key press and for the next frame. */
+#define FCITX_IM_BENCH_KEY_TIMEOUT_MS 1000
+/* A main loop iteration taking longer than this counts as a stall. */
+#define FCITX_IM_BENCH_STALL_US (4 * G_TIME_SPAN_MILLISECOND)
+/* Warm up key presses to wait for the input context to be connected. */
+#define FCITX_IM_BENCH_WARM_UP_KEYS 50
+
+typedef struct _FcitxIMBenchMode FcitxIMBenchMode;
+typedef struct _FcitxIMBench FcitxIMBench;
+
+struct _FcitxIMBenchMode {
+    const gchar *name;
+    gboolean sync;
+    gboolean snooper;
+};
+
+struct _FcitxIMBench {
+    GtkWidget *window;
+    GtkWidget *widget;
+#if GTK_CHECK_VERSION(4, 0, 0)
+    GtkIMContext *context;
+#endif
+
+    gint64 key_time;
+    gint64 commit_time;
+    gint64 preedit_time;
+    gint64 paint_time;
+
+    guint probe_source;
+    gint64 last_probe;
+    gint64 stall_total;
+    gint64 stall_max;
+};
+
+static const FcitxIMBenchMode modes[] = {
+    {"sync", TRUE, FALSE},
+    {"async", FALSE, FALSE},
+#if !GTK_CHECK_VERSION(4, 0, 0)
+    {"snooper", FALSE, TRUE},
+#endif
+};
+
+/* Every other key press shows a preedit, the ones in between commit. */
+static const gchar script[] = "preedit a; candidates a A\n"
+                              "commit " FCITX_IM_BENCH_COMMIT
+                              "; preedit; candidates\n";
+
+static gint keys = 200;
+static gint display_number = 42;
+static gchar *mode_name = NULL;
+
+static GOptionEntry entries[] = {
+    {"keys", 'k', 0, G_OPTION_ARG_INT, &keys,
+     "Number of key presses to type into each widget", "N"},
+    {"display", 'd', 0, G_OPTION_ARG_INT, &display_number,
+     "Broadway display number to use", "N"},
+    {"mode", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_STRING, &mode_name, NULL,
+     NULL},
+    {NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}};
+
+static gboolean _fcitx_im_bench_probe(gpointer user_data) {
+    FcitxIMBench *bench = static_cast<FcitxIMBench *>(user_data);
+    gint64 now = g_get_monotonic_time();
+    gint64 stall = now - bench->last_probe;
+    if (stall > FCITX_IM_BENCH_STALL_US) {
+        bench->stall_total += stall;
+        bench->stall_max = MAX(bench->stall_max, stall);
+    }
+    bench->last_probe = now;
+    return TRUE;
+}
+
+static void _fcitx_im_bench_committed(FcitxIMBench *bench, const gchar *text) {
+    if (bench->key_time && !bench->commit_time &&
+        g_strcmp0(text, FCITX_IM_BENCH_COMMIT) == 0) {
+        bench->commit_time = g_get_monotonic_time();
+    }
+}
+
+static void _fcitx_im_bench_preedit_changed(FcitxIMBench *bench,
+                                            const gchar *preedit) {
+    if (bench->key_time && !bench->preedit_time && preedit && preedit[0]) {
+        bench->preedit_time = g_get_monotonic_time();
+    }
+}
+
+static void _fcitx_im_bench_after_paint(GdkFrameClock *, gpointer user_data) {
+    FcitxIMBench *bench = static_cast<FcitxIMBench *>(user_data);
+    if (bench->preedit_time && !bench->paint_time) {
+        bench->paint_time = g_get_monotonic_time();
+    }
+}
+
+#if GTK_CHECK_VERSION(4, 0, 0)
+static void _fcitx_im_bench_context_commit(GtkIMContext *, gchar *text,
+                                           gpointer user_data) {
+    FcitxIMBench *bench = static_cast<FcitxIMBench *>(user_data);
+    _fcitx_im_bench_committed(bench, text);
+    // Do what the widget would do with its own input context.
+    if (GTK_IS_TEXT_VIEW(bench->widget)) {
+        gtk_text_buffer_insert_at_cursor(
+            gtk_text_view_get_buffer(GTK_TEXT_VIEW(bench->widget)), text, -1);
+    } else {
+        int position = gtk_editable_get_position(GTK_EDITABLE(bench->widget));
+        gtk_editable_insert_text(GTK_EDITABLE(bench->widget), text, -1,
+                                 &position);
+    }
+}
+
+static void _fcitx_im_bench_context_preedit_changed(GtkIMContext *context,
+                                                    gpointer user_data) {
+    FcitxIMBench *bench = static_cast<FcitxIMBench *>(user_data);
+    gchar *preedit = NULL;
+    gtk_im_context_get_preedit_string(context, &preedit, NULL, NULL);
+    _fcitx_im_bench_preedit_changed(bench, preedit);
+    g_free(preedit);
+    gtk_widget_queue_draw(bench->widget);
+}
+#else
+static void _fcitx_im_bench_entry_insert_text(GtkEditable *, gchar *text,
+                                              gint length, gpointer,
+                                              gpointer user_data) {
+    g_autofree gchar *inserted =
+        length < 0 ? g_strdup(text) : g_strndup(text, length);
+    _fcitx_im_bench_committed(static_cast<FcitxIMBench *>(user_data),
+                              inserted);
+}
+
+static void _fcitx_im_bench_buffer_insert_text(GtkTextBuffer *, GtkTextIter *,
+                                               gchar *text, gint length,
+                                               gpointer user_data) {
+    g_autofree gchar *inserted =
+        length < 0 ? g_strdup(text) : g_strndup(text, length);
+    _fcitx_im_bench_committed(static_cast<FcitxIMBench *>(user_data),
+                              inserted);
+}
+
+static void _fcitx_im_bench_widget_preedit_changed(GtkWidget *,
+                                                   gchar *preedit,
+                                                   gpointer user_data) {
+    _fcitx_im_bench_preedit_changed(static_cast<FcitxIMBench *>(user_data),
+                                    preedit);
+}
+#endif
+
+static void _fcitx_im_bench_iterate_until(const gint64 *time,
+                                          gint64 deadline) {
+    // The probe wakes up the main loop at least every millisecond.
+    while (!*time && g_get_monotonic_time() < deadline) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+}
+
+static void _fcitx_im_bench_send_key(FcitxIMBench *bench, guint keyval,
+                                     gboolean press) {
+    GdkDisplay *display = gtk_widget_get_display(bench->window);
+    GdkDevice *keyboard =
+        gdk_seat_get_keyboard(gdk_display_get_default_seat(display));
+    guint32 time = g_get_monotonic_time() / G_TIME_SPAN_MILLISECOND;
+    guint keycode = 0;
+    gint group = 0;
+    GdkKeymapKey *mapped = NULL;
+    gint n_mapped = 0;
+#if GTK_CHECK_VERSION(4, 0, 0)
+    if (gdk_display_map_keyval(display, keyval, &mapped, &n_mapped) &&
+        n_mapped) {
+        keycode = mapped[0].keycode;
+        group = mapped[0].group;
+    }
+    g_free(mapped);
+    gtk_im_context_filter_key(
+        bench->context, press,
+        gtk_native_get_surface(GTK_NATIVE(bench->window)), keyboard, time,
+        keycode, static_cast<GdkModifierType>(0), group);
+#else
+    if (gdk_keymap_get_entries_for_keyval(gdk_keymap_get_for_display(display),
+                                          keyval, &mapped, &n_mapped) &&
+        n_mapped) {
+        keycode = mapped[0].keycode;
+        group = mapped[0].group;
+    }
+    g_free(mapped);
+    GdkEvent *event = gdk_event_new(press ? GDK_KEY_PRESS : GDK_KEY_RELEASE);
+    event->key.window =
+        GDK_WINDOW(g_object_ref(gtk_widget_get_window(bench->window)));
+    event->key.time = time;
+    event->key.keyval = keyval;
+    event->key.hardware_keycode = keycode;
+    event->key.group = group;
+    event->key.string = g_strdup("");
+    gdk_event_set_device(event, keyboard);
+    gdk_display_put_event(display, event);
+    gdk_event_free(event);
+#endif
+}
+
+/* Press and release a key, returns whether the daemon answered it. */
+static gboolean _fcitx_im_bench_type(FcitxIMBench *bench, GArray *commit,
+                                     GArray *preedit, GArray *visible) {
+    bench->commit_time = bench->preedit_time = bench->paint_time = 0;
+    bench->key_time = g_get_monotonic_time();
+    gint64 deadline = bench->key_time + FCITX_IM_BENCH_KEY_TIMEOUT_MS *
+                                            G_TIME_SPAN_MILLISECOND;
+    _fcitx_im_bench_send_key(bench, GDK_KEY_a, TRUE);
+    while ((!bench->commit_time && !bench->preedit_time) &&
+           g_get_monotonic_time() < deadline) {
+        g_main_context_iteration(NULL, TRUE);
+    }
+
+    gboolean answered = bench->commit_time || bench->preedit_time;
+    if (bench->commit_time) {
+        gint64 latency = bench->commit_time - bench->key_time;
+        if (commit) {
+            g_array_append_val(commit, latency);
+        }
+    } else if (bench->preedit_time) {
+        _fcitx_im_bench_iterate_until(&bench->paint_time, deadline);
+        gint64 latency = bench->preedit_time - bench->key_time;
+        if (preedit) {
+            g_array_append_val(preedit, latency);
+        }
+        latency = bench->paint_time - bench->key_time;
+        if (visible && bench->paint_time) {
+            g_array_append_val(visible, latency);
+        }
+    }
+    bench->key_time = 0;
+    _fcitx_im_bench_send_key(bench, GDK_KEY_a, FALSE);
+    return answered;
+}
+
+static void _fcitx_im_bench_print(const gchar *widget, const gchar *what,
+                                  GArray *samples) {
+    g_autofree gchar *name = g_strdup_printf(
+        "%s %s %s %s", FCITX_IM_BENCH_GTK, mode_name, widget, what);
+    _fcitx_g_bench_print_latency(name, samples);
+}
+
+static gboolean _fcitx_im_bench_widget(FcitxIMBench *bench, GtkWidget *widget,
+                                       const gchar *name) {
+    bench->widget = widget;
+    gtk_widget_grab_focus(widget);
+#if GTK_CHECK_VERSION(4, 0, 0)
+    gtk_im_context_set_client_widget(bench->context, widget);
+    gtk_im_context_focus_in(bench->context);
+#endif
+
+    // The probe also keeps the waits for a key from blocking past their
+    // deadline.
+    bench->last_probe = g_get_monotonic_time();
+    bench->probe_source = g_timeout_add(1, _fcitx_im_bench_probe, bench);
+
+    // Until the input context is connected, keys go to the fallback. Stop
+    // warming up on a commit, so the script of the daemon starts over.
+    gboolean connected = FALSE;
+    for (gint i = 0; i < FCITX_IM_BENCH_WARM_UP_KEYS && !connected; i++) {
+        gboolean answered = _fcitx_im_bench_type(bench, NULL, NULL, NULL);
+        connected = answered && bench->commit_time;
+    }
+    if (!connected) {
+        g_clear_handle_id(&bench->probe_source, g_source_remove);
+        g_printerr("%s %s %s: the input context did not connect\n",
+                   FCITX_IM_BENCH_GTK, mode_name, name);
+        return FALSE;
+    }
+
+    g_autoptr(GArray) commit = g_array_new(FALSE, FALSE, sizeof(gint64));
+    g_autoptr(GArray) preedit = g_array_new(FALSE, FALSE, sizeof(gint64));
+    g_autoptr(GArray) visible = g_array_new(FALSE, FALSE, sizeof(gint64));
+    guint unanswered = 0;
+    bench->stall_total = bench->stall_max = 0;
+    gint64 start = g_get_monotonic_time();
+    for (gint i = 0; i < keys; i++) {
+        if (!_fcitx_im_bench_type(bench, commit, preedit, visible)) {
+            unanswered++;
+        }
+    }
+    gint64 wall_time = g_get_monotonic_time() - start;
+    g_clear_handle_id(&bench->probe_source, g_source_remove);
+
+#if GTK_CHECK_VERSION(4, 0, 0)
+    gtk_im_context_focus_out(bench->context);
+#endif
+    _fcitx_im_bench_print(name, "commit", commit);
+    _fcitx_im_bench_print(name, "preedit", preedit);
+    _fcitx_im_bench_print(name, "preedit visible", visible);
+    g_print("%s %s %s main loop stall (ms): total=%.3f max=%.3f "
+            "wall time=%.3f unanswered keys=%u\n",
+            FCITX_IM_BENCH_GTK, mode_name, name,
+            _fcitx_g_bench_ms(bench->stall_total),
+            _fcitx_g_bench_ms(bench->stall_max), _fcitx_g_bench_ms(wall_time),
+            unanswered);
+    return TRUE;
+}
+
+static gboolean _fcitx_im_bench_init_gtk() {
+    // broadwayd may still be starting up.
+    const gint tries = 100;
+#if GTK_CHECK_VERSION(4, 0, 0)
+    gboolean ready = gtk_init_check();
+    for (gint i = 0; !ready && i < tries; i++) {
+        g_usleep(50 * G_TIME_SPAN_MILLISECOND);
+        GdkDisplay *display = gdk_display_open(NULL);
+        if (display) {
+            gdk_display_manager_set_default_display(gdk_display_manager_get(),
+                                                    display);
+            ready = TRUE;
+        }
+    }
+#else
+    gboolean ready = gtk_init_check(NULL, NULL);
+    for (gint i = 0; !ready && i < tries; i++) {
+        g_usleep(50 * G_TIME_SPAN_MILLISECOND);
+        ready = gtk_init_check(NULL, NULL);
+    }
+#endif
+    return ready;
+}
+
+static GtkWidget *_fcitx_im_bench_add(GtkWidget *box, GtkWidget *widget) {
+#if GTK_CHECK_VERSION(4, 0, 0)
+    // Keep the input contexts of the widgets out of the way of the one of
+    // the benchmark.
+    g_object_set(widget, "im-module", "gtk-im-context-simple", NULL);
+    gtk_box_append(GTK_BOX(box), widget);
+#else
+    gtk_box_pack_start(GTK_BOX(box), widget, FALSE, FALSE, 0);
+#endif
+    return widget;
+}
+
+static int _fcitx_im_bench_run_mode() {
+    if (!_fcitx_im_bench_init_gtk()) {
+        g_printerr("Failed to connect to broadwayd\n");
+        return 1;
+    }
+
+    FcitxIMBench bench = {};
+#if GTK_CHECK_VERSION(4, 0, 0)
+    bench.window = gtk_window_new();
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    gtk_window_set_child(GTK_WINDOW(bench.window), box);
+#else
+    bench.window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
+    GtkWidget *box = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+    gtk_container_add(GTK_CONTAINER(bench.window), box);
+#endif
+    gtk_window_set_default_size(GTK_WINDOW(bench.window), 640, 480);
+    GtkWidget *entry = _fcitx_im_bench_add(box, gtk_entry_new());
+    GtkWidget *text_view = _fcitx_im_bench_add(box, gtk_text_view_new());
+    gtk_widget_set_vexpand(text_view, TRUE);
+#if GTK_CHECK_VERSION(4, 0, 0)
+    GtkWidget *text = _fcitx_im_bench_add(box, gtk_text_new());
+    bench.context = gtk_im_multicontext_new();
+    g_signal_connect(bench.context, "commit",
+                     G_CALLBACK(_fcitx_im_bench_context_commit), &bench);
+    g_signal_connect(bench.context, "preedit-changed",
+                     G_CALLBACK(_fcitx_im_bench_context_preedit_changed),
+                     &bench);
+    gtk_window_present(GTK_WINDOW(bench.window));
+#else
+    g_signal_connect(entry, "insert-text",
+                     G_CALLBACK(_fcitx_im_bench_entry_insert_text), &bench);
+    g_signal_connect(entry, "preedit-changed",
+                     G_CALLBACK(_fcitx_im_bench_widget_preedit_changed),
+                     &bench);
+    g_signal_connect(gtk_text_view_get_buffer(GTK_TEXT_VIEW(text_view)),
+                     "insert-text",
+                     G_CALLBACK(_fcitx_im_bench_buffer_insert_text), &bench);
+    g_signal_connect(text_view, "preedit-changed",
+                     G_CALLBACK(_fcitx_im_bench_widget_preedit_changed),
+                     &bench);
+    gtk_widget_show_all(bench.window);
+    // Nothing gives the window focus without a browser connected.
+    GdkEvent *focus = gdk_event_new(GDK_FOCUS_CHANGE);
+    focus->focus_change.window =
+        GDK_WINDOW(g_object_ref(gtk_widget_get_window(bench.window)));
+    focus->focus_change.in = TRUE;
+    gtk_widget_send_focus_change(bench.window, focus);
+    gdk_event_free(focus);
+#endif
+    g_signal_connect(gtk_widget_get_frame_clock(bench.window), "after-paint",
+                     G_CALLBACK(_fcitx_im_bench_after_paint), &bench);
+
+    gboolean ok = _fcitx_im_bench_widget(&bench, entry, "GtkEntry") &&
+                  _fcitx_im_bench_widget(&bench, text_view, "GtkTextView");
+#if GTK_CHECK_VERSION(4, 0, 0)
+    ok = ok && _fcitx_im_bench_widget(&bench, text, "GtkText");
+    g_object_unref(bench.context);
+    gtk_window_destroy(GTK_WINDOW(bench.window));
+#else
+    gtk_widget_destroy(bench.window);
+#endif
+    while (g_main_context_iteration(NULL, FALSE)) {
+    }
+    return ok ? 0 : 1;
+}
+
+/* Make the im module of the build tree the only one GTK can load. */
+static gboolean _fcitx_im_bench_setup_module(const gchar *dir,
+                                             GError **error) {
+#if GTK_CHECK_VERSION(4, 0, 0)
+    g_autofree gchar *modules = g_build_filename(dir, "immodules", NULL);
+    g_autofree gchar *base = g_path_get_basename(FCITX_IM_MODULE_PATH);
+    g_autofree gchar *link = g_build_filename(modules, base, NULL);
+    if (g_mkdir(modules, 0700) != 0 ||
+        symlink(FCITX_IM_MODULE_PATH, link) != 0) {
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+                    "Failed to link the im module into %s", modules);
+        return FALSE;
+    }
+    g_setenv("GTK_PATH", dir, TRUE);
+    return TRUE;
+#else
+    g_autofree gchar *cache = g_build_filename(dir, "immodules.cache", NULL);
+    g_autofree gchar *contents = g_strdup_printf(
+        "\"%s\"\n"
+        "\"fcitx\" \"Fcitx5\" \"fcitx5\" \"\" \"*\"\n",
+        FCITX_IM_MODULE_PATH);
+    if (!g_file_set_contents(cache, contents, -1, error)) {
+        return FALSE;
+    }
+    g_setenv("GTK_IM_MODULE_FILE", cache, TRUE);
+    return TRUE;
+#endif
+}
+
+static void _fcitx_im_bench_cleanup(const gchar *dir) {
+    GDir *handle = g_dir_open(dir, 0, NULL);
+    const gchar *name;
+    while (handle && (name = g_dir_read_name(handle))) {
+        g_autofree gchar *path = g_build_filename(dir, name, NULL);
+        if (g_file_test(path, G_FILE_TEST_IS_DIR) &&
+            !g_file_test(path, G_FILE_TEST_IS_SYMLINK)) {
+            _fcitx_im_bench_cleanup(path);
+        } else {
+            g_remove(path);
+        }
+    }
+    if (handle) {
+        g_dir_close(handle);
+    }
+    g_rmdir(dir);
+}
+
+static int _fcitx_im_bench_drive(const gchar *program, gchar **daemon_args) {
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *dir =
+        g_dir_make_tmp("fcitx5-" FCITX_IM_BENCH_GTK "-bench-XXXXXX", &error);
+    if (!dir) {
+        g_printerr("Failed to create a directory: %s\n", error->message);
+        return 1;
+    }
+    g_autofree gchar *script_file = g_build_filename(dir, "script", NULL);
+    if (!g_file_set_contents(script_file, script, -1, &error) ||
+        !_fcitx_im_bench_setup_module(dir, &error)) {
+        g_printerr("%s\n", error->message);
+        _fcitx_im_bench_cleanup(dir);
+        return 1;
+    }
+
+    g_autofree gchar *display = g_strdup_printf(":%d", display_number);
+    const gchar *broadwayd_argv[] = {FCITX_IM_BENCH_BROADWAYD, display, NULL};
+    GPid broadwayd = 0;
+    if (!g_spawn_async(NULL, const_cast<gchar **>(broadwayd_argv), NULL,
+                       static_cast<GSpawnFlags>(G_SPAWN_DO_NOT_REAP_CHILD |
+                                                G_SPAWN_SEARCH_PATH),
+                       NULL, NULL, &broadwayd, &error)) {
+        g_printerr("Failed to start %s: %s\n", FCITX_IM_BENCH_BROADWAYD,
+                   error->message);
+        _fcitx_im_bench_cleanup(dir);
+        return 1;
+    }
+
+    g_autoptr(GPtrArray) mockd_args = g_ptr_array_new();
+    g_ptr_array_add(mockd_args, const_cast<gchar *>("--script"));
+    g_ptr_array_add(mockd_args, script_file);
+    for (guint i = 0; daemon_args[i]; i++) {
+        g_ptr_array_add(mockd_args, daemon_args[i]);
+    }
+    g_ptr_array_add(mockd_args, NULL);
+    FcitxGBenchBus bus = {};
+    gboolean ok = _fcitx_g_bench_bus_start(
+        &bus, reinterpret_cast<const gchar *const *>(mockd_args->pdata),
+        &error);
+    if (!ok) {
+        g_printerr("Failed to start the daemon: %s\n", error->message);
+    }
+
+    g_setenv("GDK_BACKEND", "broadway", TRUE);
+    g_setenv("BROADWAY_DISPLAY", display, TRUE);
+    g_setenv("GTK_IM_MODULE", "fcitx", TRUE);
+    g_autofree gchar *keys_arg = g_strdup_printf("%d", keys);
+    for (guint i = 0; ok && i < G_N_ELEMENTS(modes); i++) {
+        g_setenv("FCITX_ENABLE_SYNC_MODE", modes[i].sync ? "1" : "0", TRUE);
+        g_setenv("FCITX_DISABLE_SNOOPER", modes[i].snooper ? "0" : "1", TRUE);
+        const gchar *argv[] = {program, "--mode", modes[i].name,
+                               "--keys", keys_arg, NULL};
+        gint status = 0;
+        ok = g_spawn_sync(NULL, const_cast<gchar **>(argv), NULL,
+                          G_SPAWN_DEFAULT, NULL, NULL, NULL, NULL, &status,
+                          &error) &&
+             g_spawn_check_wait_status(status, &error);
+        if (!ok) {
+            g_printerr("Failed to run the %s mode: %s\n", modes[i].name,
+                       error->message);
+        }
+    }
+
+    _fcitx_g_bench_bus_stop(&bus);
+    kill(broadwayd, SIGTERM);
+    waitpid(broadwayd, NULL, 0);
+    g_spawn_close_pid(broadwayd);
+    _fcitx_im_bench_cleanup(dir);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    g_autoptr(GOptionContext) context =
+        g_option_context_new("[-- MOCKD-ARGUMENTS...]");
+    g_option_context_set_summary(
+        context, "Benchmark the " FCITX_IM_BENCH_GTK
+                 " im module on the Broadway backend against "
+                 "fcitx5-gtk-mockd.");
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_autoptr(GError) error = NULL;
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        return 1;
+    }
+    if (keys < 1) {
+        g_printerr("Invalid count\n");
+        return 1;
+    }
+    if (mode_name) {
+        return _fcitx_im_bench_run_mode();
+    }
+
+    // GOption keeps "--" when the arguments after it look like options.
+    gchar **daemon_args = argv + 1;
+    if (g_strcmp0(daemon_args[0], "--") == 0) {
+        daemon_args++;
+    }
+    // Do not record the benchmark.
+    g_unsetenv("FCITX_GCLIENT_JOURNAL");
+    g_autofree gchar *self = g_file_read_link("/proc/self/exe", NULL);
+    return _fcitx_im_bench_drive(self ? self : argv[0], daemon_args);
+}
@@ -0,0 +1,196 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#include "utf8.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <glib.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#define FCITX_UTF8_SSE2
+#if defined(__GNUC__)
+#define FCITX_UTF8_AVX2
+#endif
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define FCITX_UTF8_NEON
+#endif
+
+namespace fcitx::gtk {
+
+namespace {
+
+/*
+ * A character starts at every byte that is not a continuation byte, and
+ * continuation bytes are exactly the ones below -64 when read as signed.
+ *
+ * The vector versions count into 8 bit lanes, which are summed up after at
+ * most 255 blocks, before any lane can overflow.
+ */
+constexpr size_t MaxBlocks = 255;
+
+size_t countCharsScalar(const uint8_t *p, size_t len) {
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++) {
+        count += (p[i] & 0xC0) != 0x80;
+    }
+    return count;
+}
+
+size_t asciiPrefixScalar(const uint8_t *p, size_t len) {
+    size_t i = 0;
+    while (i < len && p[i] < 0x80) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef FCITX_UTF8_SSE2
+size_t countCharsSSE2(const uint8_t *p, size_t len) {
+    const __m128i threshold = _mm_set1_epi8(-65);
+    size_t count = 0;
+    size_t i = 0;
+    while (len - i >= 16) {
+        size_t blocks = std::min((len - i) / 16, MaxBlocks);
+        __m128i acc = _mm_setzero_si128();
+        for (size_t block = 0; block < blocks; block++, i += 16) {
+            __m128i v =
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpgt_epi8(v, threshold));
+        }
+        __m128i sum = _mm_sad_epu8(acc, _mm_setzero_si128());
+        count += _mm_cvtsi128_si32(sum) +
+                 _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+    }
+    return count + countCharsScalar(p + i, len - i);
+}
+
+size_t asciiPrefixSSE2(const uint8_t *p, size_t len) {
+    size_t i = 0;
+    for (; len - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        if (_mm_movemask_epi8(v)) {
+            break;
+        }
+    }
+    return i + asciiPrefixScalar(p + i, len - i);
+}
+#endif
+
+#ifdef FCITX_UTF8_AVX2
+__attribute__((target("avx2"))) size_t countCharsAVX2(const uint8_t *p,
+                                                      size_t len) {
+    const __m256i threshold = _mm256_set1_epi8(-65);
+    size_t count = 0;
+    size_t i = 0;
+    while (len - i >= 32) {
+        size_t blocks = std::min((len - i) / 32, MaxBlocks);
+        __m256i acc = _mm256_setzero_si256();
+        for (size_t block = 0; block < blocks; block++, i += 32) {
+            __m256i v =
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpgt_epi8(v, threshold));
+        }
+        __m256i sum = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+        __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum),
+                                     _mm256_extracti128_si256(sum, 1));
+        count += _mm_cvtsi128_si32(half) +
+                 _mm_cvtsi128_si32(_mm_srli_si128(half, 8));
+    }
+    return count + countCharsSSE2(p + i, len - i);
+}
+
+__attribute__((target("avx2"))) size_t asciiPrefixAVX2(const uint8_t *p,
+                                                       size_t len) {
+    size_t i = 0;
+    for (; len - i >= 32; i += 32) {
+        __m256i v =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+        if (_mm256_movemask_epi8(v)) {
+            break;
+        }
+    }
+    return i + asciiPrefixSSE2(p + i, len - i);
+}
+#endif
+
+#ifdef FCITX_UTF8_NEON
+size_t countCharsNEON(const uint8_t *p, size_t len) {
+    const int8x16_t threshold = vdupq_n_s8(-65);
+    size_t count = 0;
+    size_t i = 0;
+    while (len - i >= 16) {
+        size_t blocks = std::min((len - i) / 16, MaxBlocks);
+        uint8x16_t acc = vdupq_n_u8(0);
+        for (size_t block = 0; block < blocks; block++, i += 16) {
+            int8x16_t v = vreinterpretq_s8_u8(vld1q_u8(p + i));
+            acc = vsubq_u8(acc, vcgtq_s8(v, threshold));
+        }
+        uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(acc)));
+        count += vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+    }
+    return count + countCharsScalar(p + i, len - i);
+}
+
+size_t asciiPrefixNEON(const uint8_t *p, size_t len) {
+    size_t i = 0;
+    for (; len - i >= 16; i += 16) {
+        uint8x16_t v = vld1q_u8(p + i);
+        uint8x8_t folded = vorr_u8(vget_low_u8(v), vget_high_u8(v));
+        if (vget_lane_u64(vreinterpret_u64_u8(folded), 0) &
+            UINT64_C(0x8080808080808080)) {
+            break;
+        }
+    }
+    return i + asciiPrefixScalar(p + i, len - i);
+}
+#endif
+
+struct Kernels {
+    size_t (*countChars)(const uint8_t *p, size_t len);
+    size_t (*asciiPrefix)(const uint8_t *p, size_t len);
+};
+
+Kernels selectKernels() {
+#if defined(FCITX_UTF8_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return {countCharsAVX2, asciiPrefixAVX2};
+    }
+#endif
+#if defined(FCITX_UTF8_SSE2)
+    return {countCharsSSE2, asciiPrefixSSE2};
+#elif defined(FCITX_UTF8_NEON)
+    return {countCharsNEON, asciiPrefixNEON};
+#else
+    return {countCharsScalar, asciiPrefixScalar};
+#endif
+}
+
+const Kernels &kernels() {
+    static const Kernels selected = selectKernels();
+    return selected;
+}
+
+} // namespace
+
+size_t utf8_count_chars(const char *text, size_t len) {
+    return kernels().countChars(reinterpret_cast<const uint8_t *>(text), len);
+}
+
+bool utf8_validate(const char *text, size_t len) {
+    // Most text is ASCII, which is valid unless it contains a nul byte.
+    size_t ascii =
+        kernels().asciiPrefix(reinterpret_cast<const uint8_t *>(text), len);
+    if (memchr(text, '\0', ascii)) {
+        return false;
+    }
+    return ascii == len || g_utf8_validate(text + ascii, len - ascii, nullptr);
+}
+
+} // namespace fcitx::gtk
@@ -0,0 +1,69 @@
+/*
+ * SPDX-FileCopyrightText: 2021~2021 CSSlayer <wengxt@gmail.com>
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ */
+#ifndef _GTK3_UTF8_H_
+#define _GTK3_UTF8_H_
+
+#include <cstddef>
+
+namespace fcitx::gtk {
+
+// Number of characters in len bytes of valid UTF-8 text.
+size_t utf8_count_chars(const char *text, size_t len);
+
+// Whether len bytes of text are valid UTF-8 without any nul byte.
+bool utf8_validate(const char *text, size_t len);
+
+/*
+ * Converts byte offsets into character offsets of one text, counting only
+ * from the closest offset it already knows. Subsequent lookups near each other,
+ * like the cursor moving around, do not scan the whole text.
+ *
+ * reset() must be called whenever the text changes. A zero initialized cache
+ * is valid for an empty text.
+ */
+class Utf8OffsetCache {
+public:
+    void reset(const char *text, size_t len) {
+        len_ = len;
+        chars_ = utf8_count_chars(text, len);
+        byte_ = 0;
+        offset_ = 0;
+    }
+
+    size_t length() const { return chars_; }
+
+    // offset must be within the text and at a character boundary.
+    size_t charOffset(const char *text, size_t offset) {
+        size_t result;
+        if (offset >= byte_) {
+            if (len_ - offset < offset - byte_) {
+                result =
+                    chars_ - utf8_count_chars(text + offset, len_ - offset);
+            } else {
+                result =
+                    offset_ + utf8_count_chars(text + byte_, offset - byte_);
+            }
+        } else if (offset < byte_ - offset) {
+            result = utf8_count_chars(text, offset);
+        } else {
+            result = offset_ - utf8_count_chars(text + offset, byte_ - offset);
+        }
+        byte_ = offset;
+        offset_ = result;
+        return result;
+    }
+
+private:
+    size_t len_;
+    size_t chars_;
+    size_t byte_;
+    size_t offset_;
+};
+
+} // namespace fcitx::gtk
+
+#endif // _GTK3_UTF8_H_
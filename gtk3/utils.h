@@ -81,6 +81,50 @@ static inline bool get_boolean_env(const char *name, bool defval) {
 
 constexpr int MAX_CACHED_HANDLED_EVENT = 40;
 
+// Work a context postpones to its idle callback.
+enum IdleWork : guint {
+    IdleWorkCursorLocation = (1 << 0),
+    IdleWorkSurroundingText = (1 << 1),
+    IdleWorkCapability = (1 << 2),
+    IdleWorkFocusOut = (1 << 3),
+    IdleWorkCommit = (1 << 4),
+};
+
+// Bytes of surrounding text sent on each side of the cursor by default.
+constexpr gsize SURROUNDING_TEXT_WINDOW = 2048;
+
+static inline gsize get_surrounding_text_window() {
+    const char *value = getenv("FCITX_SURROUNDING_TEXT_WINDOW");
+    if (value) {
+        char *end = nullptr;
+        guint64 size = g_ascii_strtoull(value, &end, 10);
+        if (end != value && *end == '\0' && size > 0) {
+            return size;
+        }
+    }
+    return SURROUNDING_TEXT_WINDOW;
+}
+
+/*
+ * Narrow [begin, end) of text to at most window bytes on each side of cursor,
+ * without cutting an UTF-8 character in half.
+ */
+static inline void surrounding_text_window(const gchar *text, gsize len,
+                                           gsize cursor, gsize window,
+                                           gsize *begin, gsize *end) {
+    auto is_continuation = [text](gsize i) {
+        return (static_cast<guchar>(text[i]) & 0xC0) == 0x80;
+    };
+    *begin = cursor > window ? cursor - window : 0;
+    *end = len - cursor > window ? cursor + window : len;
+    while (*begin < cursor && is_continuation(*begin)) {
+        (*begin)++;
+    }
+    while (*end > cursor && *end < len && is_continuation(*end)) {
+        (*end)--;
+    }
+}
+
 constexpr uint64_t purpose_related_capability =
     fcitx::FcitxCapabilityFlag_Alpha | fcitx::FcitxCapabilityFlag_Digit |
     fcitx::FcitxCapabilityFlag_Number | fcitx::FcitxCapabilityFlag_Dialable |
@@ -100,6 +144,7 @@ constexpr uint64_t hints_related_capability =
 constexpr uint32_t HandledMask = (1 << 24);
 constexpr uint32_t IgnoredMask = (1 << 25);
 constexpr unsigned int MAX_CACHED_EVENTS = 30;
+constexpr unsigned int CACHED_EVENTS_INDEX_SIZE = 64;
 
 } // namespace fcitx::gtk
 
@@ -22,6 +22,7 @@
 #include <gdk/gdkevents.h>
 #include <gdk/gdkkeysyms.h>
 #include <gtk/gtk.h>
+#include <new>
 #include <stdlib.h>
 #include <string.h>
 #include <xkbcommon/xkbcommon-compose.h>
@@ -37,19 +38,46 @@
 using namespace fcitx::gtk;
 
 struct KeyPressCallbackData {
-    KeyPressCallbackData(FcitxIMContext *context, GdkEvent *event)
-        : context_(FCITX_IM_CONTEXT(g_object_ref(context))),
-          event_(gdk_event_ref(event)) {}
-
-    ~KeyPressCallbackData() {
-        gdk_event_unref(event_);
-        g_object_unref(context_);
-    }
-
     FcitxIMContext *context_;
     GdkEvent *event_;
+    KeyPressCallbackData *next_;
 };
 
+constexpr unsigned int MAX_POOLED_CALLBACK_DATA = 16;
+// How long later keys are held while waiting for the verdict of a key.
+constexpr guint ASYNC_KEY_BUDGET_MSEC = 500;
+
+// Released callback data is kept for reuse, so async keys do not allocate.
+static KeyPressCallbackData *_callback_data_pool = nullptr;
+static unsigned int _callback_data_pool_size = 0;
+
+static KeyPressCallbackData *
+key_press_callback_data_new(FcitxIMContext *context, GdkEvent *event) {
+    KeyPressCallbackData *data = _callback_data_pool;
+    if (data) {
+        _callback_data_pool = data->next_;
+        _callback_data_pool_size--;
+    } else {
+        data = new KeyPressCallbackData;
+    }
+    data->context_ = FCITX_IM_CONTEXT(g_object_ref(context));
+    data->event_ = gdk_event_ref(event);
+    data->next_ = nullptr;
+    return data;
+}
+
+static void key_press_callback_data_free(KeyPressCallbackData *data) {
+    g_clear_pointer(&data->event_, gdk_event_unref);
+    g_clear_object(&data->context_);
+    if (_callback_data_pool_size >= MAX_POOLED_CALLBACK_DATA) {
+        delete data;
+        return;
+    }
+    data->next_ = _callback_data_pool;
+    _callback_data_pool = data;
+    _callback_data_pool_size++;
+}
+
 extern "C" {
 
 /* functions prototype */
@@ -79,8 +107,12 @@ static void fcitx_im_context_get_preedit_string(GtkIMContext *context,
 static void fcitx_im_context_commit_string(FcitxIMContext *context,
                                            const char *str);
 static void fcitx_im_context_commit_preedit(FcitxIMContext *context);
+static void _fcitx_im_context_flush_preedit(FcitxIMContext *context);
 static gboolean _set_cursor_location_internal(FcitxIMContext *fcitxcontext);
-static gboolean _defer_request_surrounding_text(FcitxIMContext *fcitxcontext);
+static void _fcitx_im_context_schedule_idle(FcitxIMContext *context,
+                                            guint work);
+static void _fcitx_im_context_run_idle_work(FcitxIMContext *context,
+                                            guint work);
 static void _slave_commit_cb(GtkIMContext *slave, char *string,
                              FcitxIMContext *context);
 static void _slave_preedit_changed_cb(GtkIMContext *slave,
@@ -113,6 +145,11 @@ static void _fcitx_im_context_notify_focus_out_cb(FcitxGClient *client,
 static void _fcitx_im_context_process_key_cb(GObject *source_object,
                                              GAsyncResult *res,
                                              gpointer user_data);
+static void _fcitx_im_context_style_changed_cb(FcitxIMContext *context);
+static void _fcitx_im_context_client_changed_cb(FcitxIMContext *context);
+static void
+_fcitx_im_context_watch_client_surface(FcitxIMContext *fcitxcontext,
+                                       GdkSurface *surface);
 static void _fcitx_im_context_set_capability(FcitxIMContext *fcitxcontext,
                                              gboolean force);
 
@@ -124,6 +161,11 @@ static void _fcitx_im_context_input_purpose_changed_cb(GObject *gobject,
                                                        gpointer user_data);
 
 static void _request_surrounding_text(FcitxIMContext **context);
+static void _request_surrounding_text_if_dirty(FcitxIMContext **context,
+                                               GdkEvent *event);
+static GObject *_fcitx_im_context_surrounding_owner(FcitxIMContext *context);
+static void _fcitx_im_context_release_held_keys(FcitxIMContext *fcitxcontext,
+                                                gboolean all);
 
 guint _update_auto_repeat_state(FcitxIMContext *context, GdkEvent *event);
 
@@ -136,8 +178,12 @@ static guint _signal_preedit_start_id = 0;
 static guint _signal_preedit_end_id = 0;
 static guint _signal_delete_surrounding_id = 0;
 static guint _signal_retrieve_surrounding_id = 0;
+static GQuark _surrounding_unsupported_quark = 0;
 static gboolean _use_preedit = TRUE;
-static gboolean _use_sync_mode = TRUE;
+static gboolean _use_sync_mode = FALSE;
+static gsize _surrounding_text_window = SURROUNDING_TEXT_WINDOW;
+/* Bumped whenever any context sends focus in to the server. */
+static guint _focus_in_serial = 0;
 
 static GtkIMContext *_focus_im_context = NULL;
 static const char *_no_preedit_apps = NO_PREEDIT_APPS;
@@ -231,12 +277,17 @@ static void fcitx_im_context_class_init(FcitxIMContextClass *klass, gpointer) {
         g_signal_lookup("retrieve-surrounding", G_TYPE_FROM_CLASS(klass));
     g_assert(_signal_retrieve_surrounding_id != 0);
 
+    _surrounding_unsupported_quark =
+        g_quark_from_static_string("fcitx-surrounding-unsupported");
+
     // Check preedit blacklist
     if (g_getenv("FCITX_NO_PREEDIT_APPS")) {
         _no_preedit_apps = g_getenv("FCITX_NO_PREEDIT_APPS");
     }
     _use_preedit = !check_app_name(_no_preedit_apps);
 
+    _surrounding_text_window = get_surrounding_text_window();
+
     // Check sync mode
     if (g_getenv("FCITX_SYNC_MODE_APPS")) {
         _sync_mode_apps = g_getenv("FCITX_SYNC_MODE_APPS");
@@ -253,6 +304,9 @@ static void fcitx_im_context_class_init(FcitxIMContextClass *klass, gpointer) {
 static void fcitx_im_context_class_fini(FcitxIMContextClass *, gpointer) {}
 
 static void fcitx_im_context_init(FcitxIMContext *context, gpointer) {
+    new (&context->key_events) fcitx::gtk::KeyEventTable();
+    new (&context->held_keys) fcitx::gtk::HeldKeyQueue();
+    new (&context->ignored_keys) fcitx::gtk::HeldKeyQueue();
     context->client = NULL;
     context->has_rect = FALSE;
     context->area.x = -1;
@@ -274,21 +328,6 @@ static void fcitx_im_context_init(FcitxIMContext *context, gpointer) {
         context->is_wayland = TRUE;
     }
 #endif
-    context->slave = gtk_im_context_simple_new();
-
-    g_signal_connect(context->slave, "commit", G_CALLBACK(_slave_commit_cb),
-                     context);
-    g_signal_connect(context->slave, "preedit-start",
-                     G_CALLBACK(_slave_preedit_start_cb), context);
-    g_signal_connect(context->slave, "preedit-end",
-                     G_CALLBACK(_slave_preedit_end_cb), context);
-    g_signal_connect(context->slave, "preedit-changed",
-                     G_CALLBACK(_slave_preedit_changed_cb), context);
-    g_signal_connect(context->slave, "retrieve-surrounding",
-                     G_CALLBACK(_slave_retrieve_surrounding_cb), context);
-    g_signal_connect(context->slave, "delete-surrounding",
-                     G_CALLBACK(_slave_delete_surrounding_cb), context);
-
     g_signal_connect(context, "notify::input-hints",
                      G_CALLBACK(_fcitx_im_context_input_hints_changed_cb),
                      NULL);
@@ -297,13 +336,7 @@ static void fcitx_im_context_init(FcitxIMContext *context, gpointer) {
                      NULL);
 
     context->time = GDK_CURRENT_TIME;
-    context->pending_events =
-        g_hash_table_new_full(g_direct_hash, g_direct_equal,
-                              (GDestroyNotify)gdk_event_unref, nullptr);
-    context->handled_events =
-        g_hash_table_new_full(g_direct_hash, g_direct_equal,
-                              (GDestroyNotify)gdk_event_unref, nullptr);
-    context->handled_events_list = g_queue_new();
+    context->surrounding_dirty = TRUE;
 
     static gsize has_info = 0;
     if (g_once_init_enter(&has_info)) {
@@ -337,6 +370,7 @@ static void fcitx_im_context_init(FcitxIMContext *context, gpointer) {
 
     context->client = fcitx_g_client_new_with_watcher(_watcher);
     fcitx_g_client_set_program(context->client, g_get_prgname());
+    fcitx_g_client_set_lazy_connect(context->client, TRUE);
     if (context->is_wayland) {
         fcitx_g_client_set_display(context->client, "wayland:");
     } else {
@@ -361,19 +395,23 @@ static void fcitx_im_context_init(FcitxIMContext *context, gpointer) {
     g_signal_connect(context->client, "notify-focus-out",
                      G_CALLBACK(_fcitx_im_context_notify_focus_out_cb),
                      context);
-
-    context->xkbComposeState =
-        xkbComposeTable
-            ? xkb_compose_state_new(xkbComposeTable, XKB_COMPOSE_STATE_NO_FLAGS)
-            : NULL;
 }
 
 static void fcitx_im_context_finalize(GObject *obj) {
     FcitxIMContext *context = FCITX_IM_CONTEXT(obj);
-
-    g_clear_pointer(&context->handled_events_list, g_queue_free);
-    g_clear_pointer(&context->pending_events, g_hash_table_unref);
-    g_clear_pointer(&context->handled_events, g_hash_table_unref);
+    if (context->skipped_calls) {
+        g_debug("FcitxIMContext %p skipped %u redundant calls to the server",
+                (void *)context, context->skipped_calls);
+    }
+
+    g_clear_handle_id(&context->inflight_timeout, g_source_remove);
+    g_clear_pointer(&context->inflight_key, gdk_event_unref);
+    context->held_keys.clear();
+    context->ignored_keys.clear();
+    context->key_events.clear();
+    // Drop the pending preedit without telling anyone.
+    context->preedit_pending = FALSE;
+    _fcitx_im_context_flush_preedit(context);
     fcitx_im_context_set_client_widget(GTK_IM_CONTEXT(context), NULL);
 
 #ifndef g_signal_handlers_disconnect_by_data
@@ -383,6 +421,10 @@ static void fcitx_im_context_finalize(GObject *obj) {
 #endif
 
     g_clear_pointer(&context->xkbComposeState, xkb_compose_state_unref);
+    if (context->slave) {
+        g_signal_handlers_disconnect_by_data(context->slave, context);
+    }
+    g_clear_object(&context->slave);
     if (context->client) {
         g_signal_handlers_disconnect_by_data(context->client, context);
     }
@@ -390,12 +432,23 @@ static void fcitx_im_context_finalize(GObject *obj) {
 
     g_clear_pointer(&context->preedit_string, g_free);
     g_clear_pointer(&context->commit_preedit_string, g_free);
+    if (context->preedit_buffer) {
+        g_string_free(context->preedit_buffer, TRUE);
+        g_string_free(context->commit_preedit_buffer, TRUE);
+    }
+    if (context->pending_commit) {
+        g_string_free(context->pending_commit, TRUE);
+    }
     g_clear_pointer(&context->surrounding_text, g_free);
     g_clear_pointer(&context->attrlist, pango_attr_list_unref);
 
     delete context->candidate_window;
     context->candidate_window = nullptr;
 
+    context->ignored_keys.~HeldKeyQueue();
+    context->held_keys.~HeldKeyQueue();
+    context->key_events.~KeyEventTable();
+
     G_OBJECT_CLASS(parent_class)->finalize(obj);
 }
 
@@ -406,14 +459,42 @@ static void fcitx_im_context_set_client_widget(GtkIMContext *context,
     if (client_widget == fcitxcontext->client_widget) {
         return;
     }
+    // The frame clock belongs to the old client.
+    _fcitx_im_context_flush_preedit(fcitxcontext);
 
+    if (fcitxcontext->theme_settings) {
+        g_clear_signal_handler(&fcitxcontext->theme_changed_signal,
+                               fcitxcontext->theme_settings);
+        fcitxcontext->theme_settings = nullptr;
+    }
+    fcitxcontext->highlight_colors_valid = FALSE;
+    if (fcitxcontext->client_widget) {
+        g_signal_handlers_disconnect_by_func(
+            fcitxcontext->client_widget,
+            (gpointer)_fcitx_im_context_client_changed_cb, fcitxcontext);
+    }
+    _fcitx_im_context_watch_client_surface(fcitxcontext, nullptr);
+    fcitxcontext->client_capability_valid = FALSE;
     g_clear_object(&fcitxcontext->client_widget);
     if (!client_widget)
         return;
 
     fcitxcontext->client_widget = GTK_WIDGET(g_object_ref(client_widget));
+    fcitxcontext->surrounding_dirty = TRUE;
 
-    _fcitx_im_context_set_capability(fcitxcontext, FALSE);
+    // GTK 4 has no signal for style changes of a widget, so watch the theme.
+    fcitxcontext->theme_settings = gtk_widget_get_settings(client_widget);
+    fcitxcontext->theme_changed_signal = g_signal_connect_swapped(
+        fcitxcontext->theme_settings, "notify",
+        G_CALLBACK(_fcitx_im_context_style_changed_cb), fcitxcontext);
+
+    for (const char *signal : {"map", "unmap", "notify::visibility"}) {
+        g_signal_connect_swapped(
+            client_widget, signal,
+            G_CALLBACK(_fcitx_im_context_client_changed_cb), fcitxcontext);
+    }
+
+    _fcitx_im_context_schedule_idle(fcitxcontext, IdleWorkCapability);
 
     if (!fcitxcontext->candidate_window) {
         fcitxcontext->candidate_window =
@@ -423,26 +504,81 @@ static void fcitx_im_context_set_client_widget(GtkIMContext *context,
     fcitxcontext->candidate_window->setCursorRect(fcitxcontext->area);
 }
 
+static GtkIMContext *_fcitx_im_context_get_slave(FcitxIMContext *context) {
+    if (G_LIKELY(context->slave)) {
+        return context->slave;
+    }
+
+    // Most contexts never fall back to the simple context, so only create it
+    // on first use and bring it up to date with what we know so far.
+    context->slave = gtk_im_context_simple_new();
+
+    g_signal_connect(context->slave, "commit", G_CALLBACK(_slave_commit_cb),
+                     context);
+    g_signal_connect(context->slave, "preedit-start",
+                     G_CALLBACK(_slave_preedit_start_cb), context);
+    g_signal_connect(context->slave, "preedit-end",
+                     G_CALLBACK(_slave_preedit_end_cb), context);
+    g_signal_connect(context->slave, "preedit-changed",
+                     G_CALLBACK(_slave_preedit_changed_cb), context);
+    g_signal_connect(context->slave, "retrieve-surrounding",
+                     G_CALLBACK(_slave_retrieve_surrounding_cb), context);
+    g_signal_connect(context->slave, "delete-surrounding",
+                     G_CALLBACK(_slave_delete_surrounding_cb), context);
+
+    gtk_im_context_set_use_preedit(context->slave, context->use_preedit);
+    if (context->has_rect) {
+        gtk_im_context_set_cursor_location(context->slave, &context->area);
+    }
+    if (context->has_focus) {
+        gtk_im_context_focus_in(context->slave);
+    }
+    return context->slave;
+}
+
+static struct xkb_compose_state *
+_fcitx_im_context_get_compose_state(FcitxIMContext *context) {
+    if (!context->xkbComposeState && xkbComposeTable) {
+        context->xkbComposeState =
+            xkb_compose_state_new(xkbComposeTable, XKB_COMPOSE_STATE_NO_FLAGS);
+    }
+    return context->xkbComposeState;
+}
+
+// Key releases and modifiers never change the text of the widget.
+static bool _key_may_edit_text(GdkEvent *event) {
+    return gdk_event_get_event_type(event) == GDK_KEY_PRESS &&
+           !gdk_key_event_is_modifier(event);
+}
+
 static gboolean
 fcitx_im_context_filter_keypress_fallback(FcitxIMContext *context,
                                           GdkEvent *event) {
-    if (!context->xkbComposeState ||
-        gdk_event_get_event_type(event) == GDK_KEY_RELEASE) {
-        return gtk_im_context_filter_keypress(context->slave, event);
+    // The widget is going to handle this key, which may edit the text.
+    if (_key_may_edit_text(event)) {
+        context->surrounding_dirty = TRUE;
+    }
+    struct xkb_compose_state *xkbComposeState = nullptr;
+    if (gdk_event_get_event_type(event) != GDK_KEY_RELEASE) {
+        xkbComposeState = _fcitx_im_context_get_compose_state(context);
+    }
+    if (!xkbComposeState) {
+        return gtk_im_context_filter_keypress(
+            _fcitx_im_context_get_slave(context), event);
     }
-
-    struct xkb_compose_state *xkbComposeState = context->xkbComposeState;
 
     enum xkb_compose_feed_result result = xkb_compose_state_feed(
         xkbComposeState, gdk_key_event_get_keyval(event));
     if (result == XKB_COMPOSE_FEED_IGNORED) {
-        return gtk_im_context_filter_keypress(context->slave, event);
+        return gtk_im_context_filter_keypress(
+            _fcitx_im_context_get_slave(context), event);
     }
 
     enum xkb_compose_status status =
         xkb_compose_state_get_status(xkbComposeState);
     if (status == XKB_COMPOSE_NOTHING) {
-        return gtk_im_context_filter_keypress(context->slave, event);
+        return gtk_im_context_filter_keypress(
+            _fcitx_im_context_get_slave(context), event);
     } else if (status == XKB_COMPOSE_COMPOSED) {
         char buffer[] = {'\0', '\0', '\0', '\0', '\0', '\0', '\0'};
         int length =
@@ -461,63 +597,184 @@ fcitx_im_context_filter_keypress_fallback(FcitxIMContext *context,
 
 void fcitx_im_context_mark_event_handled(FcitxIMContext *fcitxcontext,
                                          GdkEvent *event) {
-    g_hash_table_add(fcitxcontext->handled_events,
-                     gdk_event_ref(GDK_EVENT(event)));
-    g_hash_table_remove(fcitxcontext->pending_events, event);
-    g_queue_push_tail(fcitxcontext->handled_events_list, event);
+    fcitxcontext->key_events.markHandled(event);
+}
+
+static gboolean _fcitx_im_context_key_budget_expired(gpointer user_data) {
+    FcitxIMContext *fcitxcontext = FCITX_IM_CONTEXT(user_data);
+    fcitxcontext->inflight_timeout = 0;
+    // The verdict is late, stop holding later keys for it. It is still
+    // applied once it arrives, so an unhandled key is replayed after the
+    // keys released here: the order is only kept within the budget.
+    g_clear_pointer(&fcitxcontext->inflight_key, gdk_event_unref);
+    _fcitx_im_context_release_held_keys(fcitxcontext, FALSE);
+    return FALSE;
+}
+
+static gboolean _fcitx_im_context_send_key_async(FcitxIMContext *fcitxcontext,
+                                                 GdkEvent *event,
+                                                 guint32 state) {
+    if (!fcitxcontext->key_events.addPending(event)) {
+        return FALSE;
+    }
+
+    g_clear_pointer(&fcitxcontext->inflight_key, gdk_event_unref);
+    fcitxcontext->inflight_key = gdk_event_ref(event);
+    g_clear_handle_id(&fcitxcontext->inflight_timeout, g_source_remove);
+    fcitxcontext->inflight_timeout = g_timeout_add(
+        ASYNC_KEY_BUDGET_MSEC, _fcitx_im_context_key_budget_expired,
+        fcitxcontext);
+
+    fcitx_g_client_process_key(
+        fcitxcontext->client, gdk_key_event_get_keyval(event),
+        gdk_key_event_get_keycode(event), state,
+        (gdk_event_get_event_type(event) != GDK_KEY_PRESS),
+        gdk_event_get_time(event), -1, NULL, _fcitx_im_context_process_key_cb,
+        key_press_callback_data_new(fcitxcontext, event));
+    return TRUE;
+}
+
+/*
+ * The widget already got TRUE for a held key that nobody handled, so it is
+ * replayed. Once the context lost focus the replay would reach another
+ * widget, so the key goes through the fallback path right away instead.
+ */
+static void _fcitx_im_context_replay_held_key(FcitxIMContext *fcitxcontext,
+                                              GdkEvent *event,
+                                              guint32 state) {
+    if (fcitxcontext->has_focus &&
+        fcitxcontext->ignored_keys.push(event, state)) {
+        gdk_display_put_event(gdk_event_get_display(event), event);
+    } else {
+        fcitx_im_context_filter_keypress_fallback(fcitxcontext, event);
+    }
+}
+
+static gboolean _fcitx_im_context_send_held_key_sync(
+    FcitxIMContext *fcitxcontext, GdkEvent *event, guint32 state) {
+    gboolean ret = fcitx_g_client_process_key_sync(
+        fcitxcontext->client, gdk_key_event_get_keyval(event),
+        gdk_key_event_get_keycode(event), state,
+        (gdk_event_get_event_type(event) != GDK_KEY_PRESS),
+        gdk_event_get_time(event));
+    _fcitx_im_context_run_idle_work(fcitxcontext, IdleWorkCommit);
+    return ret;
+}
+
+static void _fcitx_im_context_release_held_keys(FcitxIMContext *fcitxcontext,
+                                                gboolean all) {
+    while ((all || !fcitxcontext->inflight_key) &&
+           !fcitxcontext->held_keys.empty()) {
+        guint32 state;
+        GdkEvent *event = fcitxcontext->held_keys.pop(&state);
+        if (!fcitx_g_client_is_valid(fcitxcontext->client)) {
+            // Nobody to send it to anymore, deliver it as a normal key.
+            _fcitx_im_context_replay_held_key(fcitxcontext, event, state);
+        } else if (!_fcitx_im_context_send_key_async(fcitxcontext, event,
+                                                     state) &&
+                   !_fcitx_im_context_send_held_key_sync(fcitxcontext, event,
+                                                         state)) {
+            _fcitx_im_context_replay_held_key(fcitxcontext, event, state);
+        }
+        gdk_event_unref(event);
+    }
+}
+
+/*
+ * Process all held keys synchronously, so that their result reaches the
+ * widget before the focus change does.
+ */
+static void _fcitx_im_context_flush_held_keys(FcitxIMContext *fcitxcontext) {
+    while (!fcitxcontext->held_keys.empty()) {
+        guint32 state;
+        GdkEvent *event = fcitxcontext->held_keys.pop(&state);
+        if (!fcitx_g_client_is_valid(fcitxcontext->client) ||
+            !_fcitx_im_context_send_held_key_sync(fcitxcontext, event,
+                                                  state)) {
+            fcitx_im_context_filter_keypress_fallback(fcitxcontext, event);
+        }
+        gdk_event_unref(event);
+    }
+}
 
-    while (g_hash_table_size(fcitxcontext->handled_events) >
-           MAX_CACHED_HANDLED_EVENT) {
-        g_hash_table_remove(
-            fcitxcontext->handled_events,
-            g_queue_pop_head(fcitxcontext->handled_events_list));
+/*
+ * The verdict of the key is final: it is either handled, or it was replayed
+ * and came back to filter_keypress. Send the keys held behind it.
+ */
+static void _fcitx_im_context_key_done(FcitxIMContext *fcitxcontext,
+                                       GdkEvent *event) {
+    if (fcitxcontext->inflight_key != event) {
+        return;
     }
+    g_clear_handle_id(&fcitxcontext->inflight_timeout, g_source_remove);
+    g_clear_pointer(&fcitxcontext->inflight_key, gdk_event_unref);
+    _fcitx_im_context_release_held_keys(fcitxcontext, FALSE);
 }
 
 ///
 static gboolean fcitx_im_context_filter_keypress(GtkIMContext *context,
                                                  GdkEvent *event) {
     FcitxIMContext *fcitxcontext = FCITX_IM_CONTEXT(context);
-    if (g_hash_table_contains(fcitxcontext->handled_events, event)) {
+    _fcitx_im_context_run_idle_work(fcitxcontext, IdleWorkCommit);
+    if (fcitxcontext->ignored_keys.front() == event) {
+        guint32 state;
+        gdk_event_unref(fcitxcontext->ignored_keys.pop(&state));
+        return fcitx_im_context_filter_keypress_fallback(fcitxcontext, event);
+    }
+    auto eventState = fcitxcontext->key_events.state(event);
+    if (eventState == KeyEventState::Handled) {
         return TRUE;
     }
 
-    if (g_hash_table_contains(fcitxcontext->pending_events, event)) {
+    if (eventState == KeyEventState::Pending) {
         fcitx_im_context_mark_event_handled(fcitxcontext, event);
-        return gtk_im_context_filter_keypress(fcitxcontext->slave, event);
+        if (_key_may_edit_text(event)) {
+            fcitxcontext->surrounding_dirty = TRUE;
+        }
+        gboolean ret = gtk_im_context_filter_keypress(
+            _fcitx_im_context_get_slave(fcitxcontext), event);
+        _fcitx_im_context_key_done(fcitxcontext, event);
+        return ret;
     }
 
     if (fcitx_g_client_is_valid(fcitxcontext->client) &&
         fcitxcontext->has_focus) {
-        _request_surrounding_text(&fcitxcontext);
+        fcitxcontext->server_needs_reset = TRUE;
+        _fcitx_im_context_run_idle_work(fcitxcontext, IdleWorkCapability);
+        _request_surrounding_text_if_dirty(&fcitxcontext, event);
         if (G_UNLIKELY(!fcitxcontext))
             return FALSE;
 
         auto state = _update_auto_repeat_state(fcitxcontext, event);
 
-        if (_use_sync_mode) {
-            gboolean ret = fcitx_g_client_process_key_sync(
-                fcitxcontext->client, gdk_key_event_get_keyval(event),
-                gdk_key_event_get_keycode(event), state,
-                (gdk_event_get_event_type(event) != GDK_KEY_PRESS),
-                gdk_event_get_time(event));
-            if (ret) {
+        if (!_use_sync_mode) {
+            /* Only one key waits for its verdict at a time. Later keys are
+             * held until it is handled or its replay came back, so that keys
+             * reach the widget in order. */
+            if (fcitxcontext->inflight_key) {
+                if (fcitxcontext->held_keys.push(event, state)) {
+                    return TRUE;
+                }
+                _fcitx_im_context_release_held_keys(fcitxcontext, TRUE);
+            }
+            if (_fcitx_im_context_send_key_async(fcitxcontext, event, state)) {
                 return TRUE;
-            } else {
-                return fcitx_im_context_filter_keypress_fallback(fcitxcontext,
-                                                                 event);
             }
-        } else {
-            g_hash_table_add(fcitxcontext->pending_events,
-                             gdk_event_ref(GDK_EVENT(event)));
-            fcitx_g_client_process_key(
-                fcitxcontext->client, gdk_key_event_get_keyval(event),
-                gdk_key_event_get_keycode(event), state,
-                (gdk_event_get_event_type(event) != GDK_KEY_PRESS),
-                gdk_event_get_time(event), -1, NULL,
-                _fcitx_im_context_process_key_cb,
-                new KeyPressCallbackData(fcitxcontext, event));
+        }
+
+        // Too many keys waiting for a reply also falls back to sync mode.
+        gboolean ret = fcitx_g_client_process_key_sync(
+            fcitxcontext->client, gdk_key_event_get_keyval(event),
+            gdk_key_event_get_keycode(event), state,
+            (gdk_event_get_event_type(event) != GDK_KEY_PRESS),
+            gdk_event_get_time(event));
+        // Text committed with the reply goes before the key itself.
+        _fcitx_im_context_run_idle_work(fcitxcontext, IdleWorkCommit);
+        if (ret) {
             return TRUE;
+        } else {
+            return fcitx_im_context_filter_keypress_fallback(fcitxcontext,
+                                                             event);
         }
     } else {
         return fcitx_im_context_filter_keypress_fallback(fcitxcontext, event);
@@ -531,129 +788,145 @@ static void _fcitx_im_context_process_key_cb(GObject *source_object,
     KeyPressCallbackData *data = (KeyPressCallbackData *)user_data;
     gboolean ret =
         fcitx_g_client_process_key_finish(FCITX_G_CLIENT(source_object), res);
-    if (!ret) {
+    if (!ret && data->context_->has_focus) {
+        // The key stays in flight until the replay reaches filter_keypress.
+        // If its budget already expired, the keys held behind it were sent
+        // on and may reach the widget before this replay.
         gdk_display_put_event(gdk_event_get_display(data->event_),
                               data->event_);
+    } else if (!ret) {
+        // The replay would reach the widget that has focus now.
+        fcitx_im_context_mark_event_handled(data->context_, data->event_);
+        fcitx_im_context_filter_keypress_fallback(data->context_,
+                                                  data->event_);
+        _fcitx_im_context_key_done(data->context_, data->event_);
     } else {
         fcitx_im_context_mark_event_handled(data->context_, data->event_);
+        _fcitx_im_context_key_done(data->context_, data->event_);
+    }
+    key_press_callback_data_free(data);
+}
+
+/*
+ * Highlighted preedit text uses the selection colors of the client widget.
+ * They are looked up once, and again after the style of the widget changed.
+ */
+static void _fcitx_im_context_get_highlight_colors(FcitxIMContext *context,
+                                                   PangoColor *fg,
+                                                   PangoColor *bg) {
+    if (!context->highlight_colors_valid) {
+        context->highlight_colors_valid = TRUE;
+        gboolean hasColor = false;
+        if (context->client_widget) {
+            GtkStyleContext *styleContext =
+                gtk_widget_get_style_context(context->client_widget);
+            GdkRGBA fg_rgba, bg_rgba;
+            hasColor =
+                gtk_style_context_lookup_color(
+                    styleContext, "theme_selected_bg_color", &bg_rgba) &&
+                gtk_style_context_lookup_color(
+                    styleContext, "theme_selected_fg_color", &fg_rgba) &&
+                fg_rgba.red == bg_rgba.red && fg_rgba.green == bg_rgba.green &&
+                fg_rgba.blue == bg_rgba.blue;
+            if (hasColor) {
+                auto to_pango = [](const GdkRGBA &rgba) {
+                    PangoColor color;
+                    color.red = CLAMP((gint)(rgba.red * 65535), 0, 65535);
+                    color.green = CLAMP((gint)(rgba.green * 65535), 0, 65535);
+                    color.blue = CLAMP((gint)(rgba.blue * 65535), 0, 65535);
+                    return color;
+                };
+                context->highlight_fg = to_pango(fg_rgba);
+                context->highlight_bg = to_pango(bg_rgba);
+            }
+        }
+
+        if (!hasColor) {
+            context->highlight_fg = {0xffff, 0xffff, 0xffff};
+            context->highlight_bg = {0x43ff, 0xacff, 0xe8ff};
+        }
     }
-    delete data;
+    *fg = context->highlight_fg;
+    *bg = context->highlight_bg;
+}
+
+static void _fcitx_im_context_style_changed_cb(FcitxIMContext *context) {
+    context->highlight_colors_valid = FALSE;
 }
 
 static void _fcitx_im_context_update_preedit(FcitxIMContext *context,
                                              GPtrArray *array, int cursor_pos) {
     context->attrlist = pango_attr_list_new();
 
-    GString *gstr = g_string_new(NULL);
-    GString *commit_gstr = g_string_new(NULL);
+    // The buffers are kept for the next update.
+    if (!context->preedit_buffer) {
+        context->preedit_buffer = g_string_new(NULL);
+        context->commit_preedit_buffer = g_string_new(NULL);
+    }
+    GString *gstr = context->preedit_buffer;
+    GString *commit_gstr = context->commit_preedit_buffer;
+    g_string_truncate(gstr, 0);
+    g_string_truncate(commit_gstr, 0);
+
+    auto insert_attr = [context](PangoAttribute *pango_attr, guint start,
+                                 guint end) {
+        pango_attr->start_index = start;
+        pango_attr->end_index = end;
+        pango_attr_list_insert(context->attrlist, pango_attr);
+    };
 
     if (array) {
         for (unsigned int i = 0; i < array->len; i++) {
-            size_t bytelen = strlen(gstr->str);
             FcitxGPreeditItem *preedit =
                 (FcitxGPreeditItem *)g_ptr_array_index(array, i);
             const char *s = preedit->string;
             int type = preedit->type;
 
-            PangoAttribute *pango_attr = NULL;
+            guint start = gstr->len;
+            g_string_append(gstr, s);
+            guint end = gstr->len;
+
             if ((type & (guint32)fcitx::FcitxTextFormatFlag_Underline)) {
-                pango_attr = pango_attr_underline_new(PANGO_UNDERLINE_SINGLE);
-                pango_attr->start_index = bytelen;
-                pango_attr->end_index = bytelen + strlen(s);
-                pango_attr_list_insert(context->attrlist, pango_attr);
+                insert_attr(pango_attr_underline_new(PANGO_UNDERLINE_SINGLE),
+                            start, end);
             }
             if ((type & (guint32)fcitx::FcitxTextFormatFlag_Strike)) {
-                pango_attr = pango_attr_strikethrough_new(true);
-                pango_attr->start_index = bytelen;
-                pango_attr->end_index = bytelen + strlen(s);
-                pango_attr_list_insert(context->attrlist, pango_attr);
+                insert_attr(pango_attr_strikethrough_new(true), start, end);
             }
             if ((type & (guint32)fcitx::FcitxTextFormatFlag_Bold)) {
-                pango_attr = pango_attr_weight_new(PANGO_WEIGHT_BOLD);
-                pango_attr->start_index = bytelen;
-                pango_attr->end_index = bytelen + strlen(s);
-                pango_attr_list_insert(context->attrlist, pango_attr);
+                insert_attr(pango_attr_weight_new(PANGO_WEIGHT_BOLD), start,
+                            end);
             }
             if ((type & (guint32)fcitx::FcitxTextFormatFlag_Italic)) {
-                pango_attr = pango_attr_style_new(PANGO_STYLE_ITALIC);
-                pango_attr->start_index = bytelen;
-                pango_attr->end_index = bytelen + strlen(s);
-                pango_attr_list_insert(context->attrlist, pango_attr);
+                insert_attr(pango_attr_style_new(PANGO_STYLE_ITALIC), start,
+                            end);
             }
 
             if (type & (guint32)fcitx::FcitxTextFormatFlag_HighLight) {
-                gboolean hasColor = false;
-                guint fg_red = 0, fg_green = 0, fg_blue = 0, bg_red = 0,
-                      bg_green = 0, bg_blue = 0;
-
-                if (context->client_widget) {
-                    hasColor = true;
-                    GtkStyleContext *styleContext =
-                        gtk_widget_get_style_context(context->client_widget);
-                    GdkRGBA fg_rgba, bg_rgba;
-                    hasColor =
-                        gtk_style_context_lookup_color(
-                            styleContext, "theme_selected_bg_color",
-                            &bg_rgba) &&
-                        gtk_style_context_lookup_color(
-                            styleContext, "theme_selected_fg_color", &fg_rgba);
-
-                    if (!(fg_rgba.red == bg_rgba.red &&
-                          fg_rgba.green == bg_rgba.green &&
-                          fg_rgba.blue == bg_rgba.blue)) {
-                        hasColor = false;
-                    }
-                    if (hasColor) {
-                        fg_red = CLAMP((gint)(fg_rgba.red * 65535), 0, 65535);
-                        fg_green =
-                            CLAMP((gint)(fg_rgba.green * 65535), 0, 65535);
-                        fg_blue = CLAMP((gint)(fg_rgba.blue * 65535), 0, 65535);
-                        bg_red = CLAMP((gint)(bg_rgba.red * 65535), 0, 65535);
-                        bg_green =
-                            CLAMP((gint)(bg_rgba.green * 65535), 0, 65535);
-                        bg_blue = CLAMP((gint)(bg_rgba.blue * 65535), 0, 65535);
-                    }
-                }
-
-                if (!hasColor) {
-                    fg_red = 0xffff;
-                    fg_green = 0xffff;
-                    fg_blue = 0xffff;
-                    bg_red = 0x43ff;
-                    bg_green = 0xacff;
-                    bg_blue = 0xe8ff;
-                }
-
-                pango_attr =
-                    pango_attr_foreground_new(fg_red, fg_green, fg_blue);
-                pango_attr->start_index = bytelen;
-                pango_attr->end_index = bytelen + strlen(s);
-                pango_attr_list_insert(context->attrlist, pango_attr);
-                pango_attr =
-                    pango_attr_background_new(bg_red, bg_green, bg_blue);
-                pango_attr->start_index = bytelen;
-                pango_attr->end_index = bytelen + strlen(s);
-                pango_attr_list_insert(context->attrlist, pango_attr);
+                PangoColor fg, bg;
+                _fcitx_im_context_get_highlight_colors(context, &fg, &bg);
+                insert_attr(
+                    pango_attr_foreground_new(fg.red, fg.green, fg.blue), start,
+                    end);
+                insert_attr(
+                    pango_attr_background_new(bg.red, bg.green, bg.blue), start,
+                    end);
             }
-            gstr = g_string_append(gstr, s);
             if ((type & (guint32)fcitx::FcitxTextFormatFlag_DontCommit) == 0) {
-                commit_gstr = g_string_append(commit_gstr, s);
+                g_string_append_len(commit_gstr, s, end - start);
             }
         }
     }
 
-    char *str = g_string_free(gstr, FALSE);
-
-    context->preedit_string = str;
-    context->commit_preedit_string = g_string_free(commit_gstr, FALSE);
-    context->cursor_pos = g_utf8_pointer_to_offset(str, str + cursor_pos);
+    context->cursor_pos =
+        g_utf8_pointer_to_offset(gstr->str, gstr->str + cursor_pos);
 
-    if (context->preedit_string != NULL && context->preedit_string[0] == 0) {
-        g_clear_pointer(&context->preedit_string, g_free);
+    if (gstr->len) {
+        context->preedit_string = g_strndup(gstr->str, gstr->len);
     }
-    if (context->commit_preedit_string != NULL &&
-        context->commit_preedit_string[0] == 0) {
-        g_clear_pointer(&context->commit_preedit_string, g_free);
+    if (commit_gstr->len) {
+        context->commit_preedit_string =
+            g_strndup(commit_gstr->str, commit_gstr->len);
     }
 }
 
@@ -662,20 +935,14 @@ static void _fcitx_im_context_update_formatted_preedit_cb(FcitxGClient *,
                                                           int cursor_pos,
                                                           void *user_data) {
     FcitxIMContext *context = FCITX_IM_CONTEXT(user_data);
-
-    gboolean visible = false;
+    _fcitx_im_context_run_idle_work(context, IdleWorkCommit);
+    context->server_needs_reset = TRUE;
 
     if (cursor_pos < 0) {
         cursor_pos = 0;
     }
 
-    if (context->preedit_string != NULL) {
-        if (strlen(context->preedit_string) != 0) {
-            visible = true;
-        }
-
-        g_clear_pointer(&context->preedit_string, g_free);
-    }
+    g_clear_pointer(&context->preedit_string, g_free);
     g_clear_pointer(&context->commit_preedit_string, g_free);
     g_clear_pointer(&context->attrlist, pango_attr_list_unref);
 
@@ -683,7 +950,44 @@ static void _fcitx_im_context_update_formatted_preedit_cb(FcitxGClient *,
         _fcitx_im_context_update_preedit(context, array, cursor_pos);
     }
 
+    context->preedit_pending = TRUE;
+
+    /* Engines often update the preedit several times for one key. Only tell
+     * the widget about the last one, right before it is painted. A widget
+     * that is not mapped is never painted, so tell it right away. */
+    GdkFrameClock *clock = nullptr;
+    if (context->client_widget &&
+        gtk_widget_get_mapped(context->client_widget)) {
+        clock = gtk_widget_get_frame_clock(context->client_widget);
+    }
+    if (!clock) {
+        _fcitx_im_context_flush_preedit(context);
+        return;
+    }
+    if (context->preedit_clock) {
+        return;
+    }
+    context->preedit_clock = GDK_FRAME_CLOCK(g_object_ref(clock));
+    context->preedit_clock_signal = g_signal_connect_swapped(
+        clock, "before-paint", G_CALLBACK(_fcitx_im_context_flush_preedit),
+        context);
+    gdk_frame_clock_request_phase(clock, GDK_FRAME_CLOCK_PHASE_BEFORE_PAINT);
+}
+
+static void _fcitx_im_context_flush_preedit(FcitxIMContext *context) {
+    if (context->preedit_clock) {
+        g_clear_signal_handler(&context->preedit_clock_signal,
+                               context->preedit_clock);
+        g_clear_object(&context->preedit_clock);
+    }
+    if (!context->preedit_pending) {
+        return;
+    }
+    context->preedit_pending = FALSE;
+
+    gboolean visible = context->preedit_visible;
     gboolean new_visible = context->preedit_string != NULL;
+    context->preedit_visible = new_visible;
 
     gboolean flag = new_visible != visible;
 
@@ -723,7 +1027,11 @@ static void fcitx_im_context_focus_in(GtkIMContext *context) {
         return;
     }
 
+    _fcitx_im_context_run_idle_work(fcitxcontext, IdleWorkCommit);
+    _fcitx_im_context_flush_preedit(fcitxcontext);
     _fcitx_im_context_set_capability(fcitxcontext, FALSE);
+    // Replays that went to another widget will never come back.
+    fcitxcontext->ignored_keys.clear();
 
     fcitxcontext->has_focus = true;
 
@@ -739,27 +1047,42 @@ static void fcitx_im_context_focus_in(GtkIMContext *context) {
     }
 #endif
 
-    if (fcitx_g_client_is_valid(fcitxcontext->client)) {
+    if ((fcitxcontext->idle_work & IdleWorkFocusOut) &&
+        fcitxcontext->server_focus_serial == _focus_in_serial &&
+        !fcitxcontext->focus_out_dropped_preedit) {
+        // Focus is back before the server was told it was lost.
+        fcitxcontext->idle_work &= ~IdleWorkFocusOut;
+        fcitxcontext->skipped_calls += 2;
+    } else {
+        _fcitx_im_context_run_idle_work(fcitxcontext, IdleWorkFocusOut);
+        // The input context is created on first focus in if it does not
+        // exist.
         fcitx_g_client_focus_in(fcitxcontext->client);
+        fcitxcontext->server_needs_reset = TRUE;
+        fcitxcontext->server_focus_serial = ++_focus_in_serial;
     }
+    fcitxcontext->focus_out_dropped_preedit = FALSE;
 
-    gtk_im_context_focus_in(fcitxcontext->slave);
+    if (fcitxcontext->slave) {
+        gtk_im_context_focus_in(fcitxcontext->slave);
+    }
 
     if (fcitxcontext->candidate_window && fcitxcontext->has_rect) {
         fcitxcontext->candidate_window->setCursorRect(fcitxcontext->area);
     }
     /* set_cursor_location_internal() will get origin from X server,
      * it blocks UI. So delay it to idle callback. */
-    g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
-                    (GSourceFunc)_set_cursor_location_internal,
-                    g_object_ref(fcitxcontext), (GDestroyNotify)g_object_unref);
+    _fcitx_im_context_schedule_idle(fcitxcontext, IdleWorkCursorLocation);
+
+    fcitxcontext->surrounding_dirty = TRUE;
+    if (auto *owner = _fcitx_im_context_surrounding_owner(fcitxcontext)) {
+        g_object_set_qdata(owner, _surrounding_unsupported_quark, NULL);
+    }
 
     /* _request_surrounding_text may trigger freeze in Libreoffice. After
      * focus in, the request is not as urgent as key event. Delay it to main
      * idle callback. */
-    g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
-                    (GSourceFunc)_defer_request_surrounding_text,
-                    g_object_ref(fcitxcontext), (GDestroyNotify)g_object_unref);
+    _fcitx_im_context_schedule_idle(fcitxcontext, IdleWorkSurroundingText);
 
     g_object_add_weak_pointer((GObject *)context,
                               (gpointer *)&_focus_im_context);
@@ -770,17 +1093,18 @@ static void fcitx_im_context_focus_in(GtkIMContext *context) {
 
 static void fcitx_im_context_commit_string(FcitxIMContext *context,
                                            const gchar *str) {
+    _fcitx_im_context_flush_preedit(context);
     context->ignore_reset = TRUE;
     g_signal_emit(context, _signal_commit_id, 0, str);
     context->ignore_reset = FALSE;
 
     // Better request surrounding after commit.
-    g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
-                    (GSourceFunc)_defer_request_surrounding_text,
-                    g_object_ref(context), (GDestroyNotify)g_object_unref);
+    context->surrounding_dirty = TRUE;
+    _fcitx_im_context_schedule_idle(context, IdleWorkSurroundingText);
 }
 
 static void fcitx_im_context_commit_preedit(FcitxIMContext *context) {
+    _fcitx_im_context_run_idle_work(context, IdleWorkCommit);
     if (!context->has_focus) {
         return;
     }
@@ -791,6 +1115,7 @@ static void fcitx_im_context_commit_preedit(FcitxIMContext *context) {
 
     _fcitx_im_context_update_formatted_preedit_cb(context->client, nullptr, 0,
                                                   context);
+    _fcitx_im_context_flush_preedit(context);
 }
 
 static void fcitx_im_context_focus_out(GtkIMContext *context) {
@@ -804,17 +1129,25 @@ static void fcitx_im_context_focus_out(GtkIMContext *context) {
                                  (gpointer *)&_focus_im_context);
     _focus_im_context = NULL;
 
+    // Keys typed before the focus change are processed before the preedit
+    // is committed. Unhandled ones are not replayed to the next widget.
+    _fcitx_im_context_flush_held_keys(fcitxcontext);
+
+    fcitxcontext->focus_out_dropped_preedit =
+        fcitxcontext->preedit_string || fcitxcontext->commit_preedit_string;
     fcitx_im_context_commit_preedit(fcitxcontext);
 
     fcitxcontext->has_focus = false;
     fcitxcontext->last_key_code = 0;
     fcitxcontext->last_is_release = false;
 
-    if (fcitx_g_client_is_valid(fcitxcontext->client)) {
-        fcitx_g_client_focus_out(fcitxcontext->client);
-    }
+    /* Sent from the idle callback, so that focus coming right back, like
+     * with popovers, sends nothing at all. */
+    _fcitx_im_context_schedule_idle(fcitxcontext, IdleWorkFocusOut);
 
-    gtk_im_context_focus_out(fcitxcontext->slave);
+    if (fcitxcontext->slave) {
+        gtk_im_context_focus_out(fcitxcontext->slave);
+    }
 
     return;
 }
@@ -832,6 +1165,8 @@ static void fcitx_im_context_set_cursor_location(GtkIMContext *context,
     }
     fcitxcontext->has_rect = TRUE;
     fcitxcontext->area = *area;
+    // Widgets move the cursor location along with the text cursor.
+    fcitxcontext->surrounding_dirty = TRUE;
     if (fcitxcontext->candidate_window) {
         fcitxcontext->candidate_window->setCursorRect(fcitxcontext->area);
     }
@@ -839,7 +1174,9 @@ static void fcitx_im_context_set_cursor_location(GtkIMContext *context,
     if (fcitx_g_client_is_valid(fcitxcontext->client)) {
         _set_cursor_location_internal(fcitxcontext);
     }
-    gtk_im_context_set_cursor_location(fcitxcontext->slave, area);
+    if (fcitxcontext->slave) {
+        gtk_im_context_set_cursor_location(fcitxcontext->slave, area);
+    }
 
     return;
 }
@@ -915,6 +1252,19 @@ static gboolean _set_cursor_location_internal(FcitxIMContext *fcitxcontext) {
     area.width *= scale;
     area.height *= scale;
 
+    if (fcitxcontext->server_has_rect &&
+        fcitxcontext->server_rect_scale == scale &&
+        fcitxcontext->server_rect.x == area.x &&
+        fcitxcontext->server_rect.y == area.y &&
+        fcitxcontext->server_rect.width == area.width &&
+        fcitxcontext->server_rect.height == area.height) {
+        fcitxcontext->skipped_calls++;
+        return FALSE;
+    }
+    fcitxcontext->server_has_rect = TRUE;
+    fcitxcontext->server_rect = area;
+    fcitxcontext->server_rect_scale = scale;
+
     // We don't really need this check, but we can keep certain level of
     // compatibility for fcitx 4.
     if (fcitxcontext->is_wayland) {
@@ -928,9 +1278,63 @@ static gboolean _set_cursor_location_internal(FcitxIMContext *fcitxcontext) {
     return FALSE;
 }
 
-static gboolean _defer_request_surrounding_text(FcitxIMContext *fcitxcontext) {
-    _request_surrounding_text(&fcitxcontext);
-    return FALSE;
+static gboolean _fcitx_im_context_idle_cb(FcitxIMContext *context) {
+    context->idle_id = 0;
+    _fcitx_im_context_run_idle_work(context, context->idle_work);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Queue work for the idle callback of the context. Each context has at most
+ * one idle source, which does all work queued until it runs once.
+ */
+static void _fcitx_im_context_schedule_idle(FcitxIMContext *context,
+                                            guint work) {
+    context->idle_work |= work;
+    // Commits must reach the widget before it is painted again.
+    gint priority = (context->idle_work & IdleWorkCommit)
+                        ? G_PRIORITY_HIGH_IDLE
+                        : G_PRIORITY_DEFAULT_IDLE;
+    if (context->idle_id) {
+        if (priority == G_PRIORITY_HIGH_IDLE) {
+            g_source_set_priority(
+                g_main_context_find_source_by_id(NULL, context->idle_id),
+                priority);
+        }
+        return;
+    }
+    context->idle_id = g_idle_add_full(
+        priority, (GSourceFunc)_fcitx_im_context_idle_cb, g_object_ref(context),
+        (GDestroyNotify)g_object_unref);
+}
+
+// Do the given work now if it is queued, instead of waiting for the idle.
+static void _fcitx_im_context_run_idle_work(FcitxIMContext *context,
+                                            guint work) {
+    work &= context->idle_work;
+    context->idle_work &= ~work;
+
+    if (work & IdleWorkCommit) {
+        // Emitting commit may run anything, so take the text first.
+        gchar *str = g_string_free(context->pending_commit, FALSE);
+        context->pending_commit = nullptr;
+        fcitx_im_context_commit_string(context, str);
+        g_free(str);
+    }
+    if (work & IdleWorkFocusOut) {
+        fcitx_g_client_focus_out(context->client);
+    }
+    if (work & IdleWorkCapability) {
+        _fcitx_im_context_set_capability(context, FALSE);
+    }
+    if (work & IdleWorkCursorLocation) {
+        _set_cursor_location_internal(context);
+    }
+    if (work & IdleWorkSurroundingText) {
+        _request_surrounding_text_if_dirty(&context, NULL);
+    }
+    /* The source is left to run even if nothing is queued anymore. It may
+     * hold the last reference to the context, which callers still use. */
 }
 
 ///
@@ -939,9 +1343,11 @@ static void fcitx_im_context_set_use_preedit(GtkIMContext *context,
     FcitxIMContext *fcitxcontext = FCITX_IM_CONTEXT(context);
 
     fcitxcontext->use_preedit = _use_preedit && use_preedit;
-    _fcitx_im_context_set_capability(fcitxcontext, FALSE);
+    _fcitx_im_context_schedule_idle(fcitxcontext, IdleWorkCapability);
 
-    gtk_im_context_set_use_preedit(fcitxcontext->slave, use_preedit);
+    if (fcitxcontext->slave) {
+        gtk_im_context_set_use_preedit(fcitxcontext->slave, use_preedit);
+    }
 }
 
 static guint get_selection_anchor_point(FcitxIMContext *fcitxcontext,
@@ -998,6 +1404,55 @@ static guint get_selection_anchor_point(FcitxIMContext *fcitxcontext,
     return anchor;
 }
 
+static void _fcitx_im_context_update_surrounding(FcitxIMContext *fcitxcontext,
+                                                 const char *text, gsize len,
+                                                 gsize cursor_index,
+                                                 gsize anchor_index) {
+    // Only the text around the cursor is of interest, and widgets like
+    // GtkTextView may pass a whole paragraph of any size.
+    gsize begin, end;
+    surrounding_text_window(text, len, cursor_index, _surrounding_text_window,
+                            &begin, &end);
+    const char *window = text + begin;
+    gsize window_len = end - begin;
+
+    char *p = nullptr;
+    if (!fcitxcontext->surrounding_text ||
+        fcitxcontext->surrounding_text_len != window_len ||
+        memcmp(fcitxcontext->surrounding_text, window, window_len) != 0) {
+        // It is sent over D-Bus, which only accepts valid UTF-8.
+        if (!utf8_validate(window, window_len)) {
+            return;
+        }
+        p = g_strndup(window, window_len);
+        g_free(fcitxcontext->surrounding_text);
+        fcitxcontext->surrounding_text = p;
+        fcitxcontext->surrounding_text_len = window_len;
+        fcitxcontext->surrounding_offsets.reset(p, window_len);
+    }
+
+    auto &offsets = fcitxcontext->surrounding_offsets;
+    const char *stored = fcitxcontext->surrounding_text;
+    int cursor_pos = offsets.charOffset(stored, cursor_index - begin);
+    int anchor_pos;
+    if (anchor_index == cursor_index) {
+        anchor_pos = get_selection_anchor_point(fcitxcontext, cursor_pos,
+                                                offsets.length());
+    } else {
+        // Clamp the selection to the window.
+        anchor_index = CLAMP(anchor_index, begin, end);
+        anchor_pos = offsets.charOffset(stored, anchor_index - begin);
+    }
+
+    if (p || fcitxcontext->last_cursor_pos != cursor_pos ||
+        fcitxcontext->last_anchor_pos != anchor_pos) {
+        fcitxcontext->last_cursor_pos = cursor_pos;
+        fcitxcontext->last_anchor_pos = anchor_pos;
+        fcitx_g_client_set_surrounding_text(fcitxcontext->client, p,
+                                            cursor_pos, anchor_pos);
+    }
+}
+
 static void fcitx_im_context_set_surrounding_with_selection(
     GtkIMContext *context, const char *text, int l, int cursor_index,
     int anchor_index) {
@@ -1017,38 +1472,72 @@ static void fcitx_im_context_set_surrounding_with_selection(
     if (fcitx_g_client_is_valid(fcitxcontext->client) &&
         !(fcitxcontext->last_updated_capability &
           (guint64)fcitx::FcitxCapabilityFlag_Password)) {
-        int cursor_pos;
-        guint utf8_len;
-        char *p;
-
-        p = g_strndup(text, len);
-        cursor_pos = g_utf8_strlen(p, cursor_index);
-        utf8_len = g_utf8_strlen(p, len);
-
-        int anchor_pos;
-        if (anchor_index == cursor_index) {
-            anchor_pos =
-                get_selection_anchor_point(fcitxcontext, cursor_pos, utf8_len);
-        } else {
-            anchor_pos = g_utf8_strlen(p, anchor_index);
+        _fcitx_im_context_update_surrounding(fcitxcontext, text, len,
+                                             cursor_index, anchor_index);
+    }
+    if (fcitxcontext->slave) {
+        gtk_im_context_set_surrounding_with_selection(
+            fcitxcontext->slave, text, l, cursor_index, anchor_index);
+    }
+}
+
+static void
+_fcitx_im_context_watch_client_surface(FcitxIMContext *fcitxcontext,
+                                       GdkSurface *surface) {
+    if (fcitxcontext->client_surface == surface) {
+        return;
+    }
+    if (fcitxcontext->client_surface) {
+        g_clear_signal_handler(&fcitxcontext->client_surface_mapped_signal,
+                               fcitxcontext->client_surface);
+        g_clear_object(&fcitxcontext->client_surface);
+    }
+    if (surface) {
+        fcitxcontext->client_surface = GDK_SURFACE(g_object_ref(surface));
+        fcitxcontext->client_surface_mapped_signal = g_signal_connect_swapped(
+            surface, "notify::mapped",
+            G_CALLBACK(_fcitx_im_context_client_changed_cb), fcitxcontext);
+    }
+}
+
+/*
+ * Capability flags derived from the client widget. They are cached until the
+ * client widget changes, is mapped, unmapped or changes its visibility, or the
+ * surface it is shown in is mapped or unmapped.
+ */
+static guint64
+_fcitx_im_context_client_capability(FcitxIMContext *fcitxcontext) {
+    if (fcitxcontext->client_capability_valid) {
+        return fcitxcontext->client_capability;
+    }
+
+    guint64 flags = 0;
+    GdkSurface *surface = nullptr;
+    if (fcitxcontext->client_widget) {
+        if (auto native = gtk_widget_get_native(fcitxcontext->client_widget)) {
+            surface = gtk_native_get_surface(native);
         }
-        if (g_strcmp0(fcitxcontext->surrounding_text, p) == 0) {
-            g_clear_pointer(&p, g_free);
-        } else {
-            g_free(fcitxcontext->surrounding_text);
-            fcitxcontext->surrounding_text = p;
+        if (surface && gdk_surface_get_mapped(surface)) {
+            flags |= (guint64)fcitx::FcitxCapabilityFlag_ClientSideInputPanel;
         }
 
-        if (p || fcitxcontext->last_cursor_pos != cursor_pos ||
-            fcitxcontext->last_anchor_pos != anchor_pos) {
-            fcitxcontext->last_cursor_pos = cursor_pos;
-            fcitxcontext->last_anchor_pos = anchor_pos;
-            fcitx_g_client_set_surrounding_text(fcitxcontext->client, p,
-                                                cursor_pos, anchor_pos);
+        // always run this code against all gtk version
+        // seems visibility != PASSWORD hint
+        if (GTK_IS_TEXT(fcitxcontext->client_widget) &&
+            !gtk_text_get_visibility(GTK_TEXT(fcitxcontext->client_widget))) {
+            flags |= (guint64)fcitx::FcitxCapabilityFlag_Password;
         }
     }
-    gtk_im_context_set_surrounding_with_selection(fcitxcontext->slave, text, l,
-                                                  cursor_index, anchor_index);
+    _fcitx_im_context_watch_client_surface(fcitxcontext, surface);
+
+    fcitxcontext->client_capability = flags;
+    fcitxcontext->client_capability_valid = TRUE;
+    return flags;
+}
+
+static void _fcitx_im_context_client_changed_cb(FcitxIMContext *context) {
+    context->client_capability_valid = FALSE;
+    _fcitx_im_context_schedule_idle(context, IdleWorkCapability);
 }
 
 void _fcitx_im_context_set_capability(FcitxIMContext *fcitxcontext,
@@ -1067,45 +1556,21 @@ void _fcitx_im_context_set_capability(FcitxIMContext *fcitxcontext,
         if (fcitxcontext->is_wayland) {
             flags |= (guint64)fcitx::FcitxCapabilityFlag_RelativeRect;
         }
-        do {
-            if (!fcitxcontext->client_widget) {
-                break;
-            }
-            auto native = gtk_widget_get_native(fcitxcontext->client_widget);
-            if (!native) {
-                break;
-            }
-            auto parentSurface = gtk_native_get_surface(native);
-            if (!parentSurface) {
-                break;
-            }
-
-            if (gdk_surface_get_mapped(parentSurface)) {
-                flags |=
-                    (guint64)fcitx::FcitxCapabilityFlag_ClientSideInputPanel;
-            }
-        } while (0);
         flags |= (guint64)fcitx::FcitxCapabilityFlag_ReportKeyRepeat;
         flags |= (guint64)fcitx::FcitxCapabilityFlag_ClientUnfocusCommit;
-
-        // always run this code against all gtk version
-        // seems visibility != PASSWORD hint
-        if (fcitxcontext->client_widget != NULL) {
-            if (GTK_IS_TEXT(fcitxcontext->client_widget) &&
-                !gtk_text_get_visibility(
-                    GTK_TEXT(fcitxcontext->client_widget))) {
-                flags |= (guint64)fcitx::FcitxCapabilityFlag_Password;
-            }
-        }
+        flags |= _fcitx_im_context_client_capability(fcitxcontext);
 
         gboolean update = FALSE;
         if (G_UNLIKELY(fcitxcontext->last_updated_capability != flags)) {
             fcitxcontext->last_updated_capability = flags;
             update = TRUE;
         }
-        if (G_UNLIKELY(update || force))
+        if (G_UNLIKELY(update || force)) {
             fcitx_g_client_set_capability(
                 fcitxcontext->client, fcitxcontext->last_updated_capability);
+        } else {
+            fcitxcontext->skipped_calls++;
+        }
     }
 }
 
@@ -1117,16 +1582,26 @@ static void fcitx_im_context_reset(GtkIMContext *context) {
         return;
     }
     fcitx_im_context_commit_preedit(fcitxcontext);
+    fcitxcontext->surrounding_dirty = TRUE;
 
     if (fcitx_g_client_is_valid(fcitxcontext->client)) {
-        fcitx_g_client_reset(fcitxcontext->client);
+        // Nothing was typed since the last reset, so there is nothing to
+        // reset. This is the common case for clicks in a widget.
+        if (fcitxcontext->server_needs_reset) {
+            fcitxcontext->server_needs_reset = FALSE;
+            fcitx_g_client_reset(fcitxcontext->client);
+        } else {
+            fcitxcontext->skipped_calls++;
+        }
     }
 
     if (fcitxcontext->xkbComposeState) {
         xkb_compose_state_reset(fcitxcontext->xkbComposeState);
     }
 
-    gtk_im_context_reset(fcitxcontext->slave);
+    if (fcitxcontext->slave) {
+        gtk_im_context_reset(fcitxcontext->slave);
+    }
 }
 
 static void fcitx_im_context_get_preedit_string(GtkIMContext *context,
@@ -1134,6 +1609,10 @@ static void fcitx_im_context_get_preedit_string(GtkIMContext *context,
                                                 PangoAttrList **attrs,
                                                 int *cursor_pos) {
     FcitxIMContext *fcitxcontext = FCITX_IM_CONTEXT(context);
+    // A preedit still waiting for the frame clock was not announced yet.
+    // Announce it first, so the widget is never handed one it does not
+    // know about.
+    _fcitx_im_context_flush_preedit(fcitxcontext);
 
     if (fcitx_g_client_is_valid(fcitxcontext->client)) {
         if (str) {
@@ -1143,26 +1622,33 @@ static void fcitx_im_context_get_preedit_string(GtkIMContext *context,
         }
         if (attrs) {
             if (fcitxcontext->attrlist == NULL) {
-                *attrs = pango_attr_list_new();
-
-                if (str) {
-                    PangoAttribute *pango_attr;
-                    pango_attr =
-                        pango_attr_underline_new(PANGO_UNDERLINE_SINGLE);
-                    pango_attr->start_index = 0;
-                    pango_attr->end_index = strlen(*str);
-                    pango_attr_list_insert(*attrs, pango_attr);
-                }
-            } else {
-                *attrs = pango_attr_list_ref(fcitxcontext->attrlist);
+                // Kept until the preedit changes, like the formatted one.
+                fcitxcontext->attrlist = pango_attr_list_new();
+                PangoAttribute *pango_attr =
+                    pango_attr_underline_new(PANGO_UNDERLINE_SINGLE);
+                pango_attr->start_index = 0;
+                const char *preedit = fcitxcontext->preedit_string;
+                pango_attr->end_index = preedit ? strlen(preedit) : 0;
+                pango_attr_list_insert(fcitxcontext->attrlist, pango_attr);
             }
+            *attrs = pango_attr_list_ref(fcitxcontext->attrlist);
         }
         if (cursor_pos)
             *cursor_pos = fcitxcontext->cursor_pos;
 
-    } else {
+    } else if (fcitxcontext->slave) {
         gtk_im_context_get_preedit_string(fcitxcontext->slave, str, attrs,
                                           cursor_pos);
+    } else {
+        if (str) {
+            *str = g_strdup("");
+        }
+        if (attrs) {
+            *attrs = pango_attr_list_new();
+        }
+        if (cursor_pos) {
+            *cursor_pos = 0;
+        }
     }
     return;
 }
@@ -1219,10 +1705,20 @@ static gboolean _slave_delete_surrounding_cb(GtkIMContext *,
     return return_value;
 }
 
+/*
+ * Engines may commit several pieces in a row. They are emitted as a single
+ * commit from the idle callback, or right before anything that has to come
+ * after them.
+ */
 void _fcitx_im_context_commit_string_cb(FcitxGClient *, char *str,
                                         void *user_data) {
     FcitxIMContext *context = FCITX_IM_CONTEXT(user_data);
-    fcitx_im_context_commit_string(context, str);
+    if (context->pending_commit) {
+        g_string_append(context->pending_commit, str);
+    } else {
+        context->pending_commit = g_string_new(str);
+    }
+    _fcitx_im_context_schedule_idle(context, IdleWorkCommit);
 }
 
 void _fcitx_im_context_forward_key_cb(FcitxGClient *, guint, guint, gboolean,
@@ -1233,9 +1729,11 @@ static void _fcitx_im_context_delete_surrounding_text_cb(FcitxGClient *,
                                                          guint nchars,
                                                          void *user_data) {
     FcitxIMContext *context = FCITX_IM_CONTEXT(user_data);
+    _fcitx_im_context_run_idle_work(context, IdleWorkCommit);
     gboolean return_value;
     g_signal_emit(context, _signal_delete_surrounding_id, 0, offset_from_cursor,
                   nchars, &return_value);
+    context->surrounding_dirty = TRUE;
 }
 
 #ifdef GDK_WINDOWING_X11
@@ -1290,14 +1788,22 @@ void _fcitx_im_context_connect_cb(FcitxGClient *im G_GNUC_UNUSED,
 #endif
 
     _fcitx_im_context_set_capability(context, TRUE);
+    // A new input context on the server side knows no surrounding text yet.
+    context->surrounding_dirty = TRUE;
+    context->server_needs_reset = TRUE;
+    context->server_has_rect = FALSE;
     if (context->has_focus && _focus_im_context == (GtkIMContext *)context &&
-        fcitx_g_client_is_valid(context->client))
+        fcitx_g_client_is_valid(context->client)) {
         fcitx_g_client_focus_in(context->client);
+        context->server_focus_serial = ++_focus_in_serial;
+    }
     /* set_cursor_location_internal() will get origin from X server,
      * it blocks UI. So delay it to idle callback. */
-    g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
-                    (GSourceFunc)_set_cursor_location_internal,
-                    g_object_ref(context), (GDestroyNotify)g_object_unref);
+    _fcitx_im_context_schedule_idle(context, IdleWorkCursorLocation);
+}
+
+static GObject *_fcitx_im_context_surrounding_owner(FcitxIMContext *context) {
+    return (GObject *)context->client_widget;
 }
 
 static void _request_surrounding_text(FcitxIMContext **context) {
@@ -1315,6 +1821,11 @@ static void _request_surrounding_text(FcitxIMContext **context) {
                                          (gpointer *)context);
         else
             return;
+        (*context)->surrounding_dirty = FALSE;
+        if (auto *owner = _fcitx_im_context_surrounding_owner(*context)) {
+            g_object_set_qdata(owner, _surrounding_unsupported_quark,
+                               return_value ? NULL : GINT_TO_POINTER(TRUE));
+        }
         if (return_value) {
             (*context)->support_surrounding_text = TRUE;
             _fcitx_im_context_set_capability(*context, FALSE);
@@ -1325,6 +1836,30 @@ static void _request_surrounding_text(FcitxIMContext **context) {
     }
 }
 
+/*
+ * Only ask the widget for the surrounding text when it may have changed since
+ * the last time, and not for widgets that turned out not to provide it.
+ */
+static void _request_surrounding_text_if_dirty(FcitxIMContext **context,
+                                               GdkEvent *event) {
+    if (event && !_key_may_edit_text(event)) {
+        return;
+    }
+    if (!(*context)->surrounding_dirty) {
+        return;
+    }
+    auto *owner = _fcitx_im_context_surrounding_owner(*context);
+    if (owner && g_object_get_qdata(owner, _surrounding_unsupported_quark)) {
+        (*context)->surrounding_dirty = FALSE;
+        if ((*context)->support_surrounding_text) {
+            (*context)->support_surrounding_text = FALSE;
+            _fcitx_im_context_set_capability(*context, FALSE);
+        }
+        return;
+    }
+    _request_surrounding_text(context);
+}
+
 guint _update_auto_repeat_state(FcitxIMContext *context, GdkEvent *event) {
     // GDK calls to XkbSetDetectableAutoRepeat by default, so normal there will
     // be no key release. But it might be also override by the application
@@ -1395,7 +1930,7 @@ void _fcitx_im_context_input_purpose_changed_cb(GObject *gobject, GParamSpec *,
         break;
     }
 
-    _fcitx_im_context_set_capability(fcitxcontext, FALSE);
+    _fcitx_im_context_schedule_idle(fcitxcontext, IdleWorkCapability);
 }
 
 void _fcitx_im_context_input_hints_changed_cb(GObject *gobject, GParamSpec *,
@@ -1427,7 +1962,7 @@ void _fcitx_im_context_input_hints_changed_cb(GObject *gobject, GParamSpec *,
     CHECK_HINTS(GTK_INPUT_HINT_INHIBIT_OSK,
                 fcitx::FcitxCapabilityFlag_NoOnScreenKeyboard)
 
-    _fcitx_im_context_set_capability(fcitxcontext, FALSE);
+    _fcitx_im_context_schedule_idle(fcitxcontext, IdleWorkCapability);
 }
 }
 
@@ -9,11 +9,217 @@
 
 #include "fcitximcontext.h"
 #include "gtk4inputwindow.h"
+#include "utf8.h"
+#include <cstdint>
+
+namespace fcitx::gtk {
+
+enum class KeyEventState : uint8_t { None, Pending, Handled };
+
+/*
+ * Key events a context has sent to the server and is waiting for, or has
+ * already handled. This is a fixed size open addressing table with linear
+ * probing, living inside the context. Handled events are evicted in FIFO order
+ * once there are more than MAX_CACHED_HANDLED_EVENT of them.
+ *
+ * It is constructed in fcitx_im_context_init(), and clear() must be called
+ * before it is destroyed in fcitx_im_context_finalize().
+ */
+class KeyEventTable {
+public:
+    static constexpr unsigned int CapacityBits = 6;
+    static constexpr unsigned int Capacity = 1u << CapacityBits;
+    static constexpr unsigned int MaxHandled = MAX_CACHED_HANDLED_EVENT;
+
+    KeyEventState state(GdkEvent *event) const {
+        auto index = find(event);
+        return index < Capacity ? entries_[index].state : KeyEventState::None;
+    }
+
+    // Returns false if the table is full of pending events.
+    bool addPending(GdkEvent *event) {
+        if (find(event) < Capacity) {
+            return true;
+        }
+        if (!reserve()) {
+            return false;
+        }
+        insert(event, KeyEventState::Pending);
+        return true;
+    }
+
+    void markHandled(GdkEvent *event) {
+        auto index = find(event);
+        if (index < Capacity &&
+            entries_[index].state == KeyEventState::Handled) {
+            return;
+        }
+        if (handledCount_ == MaxHandled) {
+            evictHandled();
+            index = find(event);
+        }
+        if (index < Capacity) {
+            entries_[index].state = KeyEventState::Handled;
+        } else if (reserve()) {
+            insert(event, KeyEventState::Handled);
+        } else {
+            return;
+        }
+        handled_[(handledHead_ + handledCount_) % MaxHandled] = event;
+        handledCount_++;
+    }
+
+    void clear() {
+        for (auto &entry : entries_) {
+            if (entry.event) {
+                gdk_event_unref(entry.event);
+            }
+            entry = Entry();
+        }
+        size_ = 0;
+        handledHead_ = 0;
+        handledCount_ = 0;
+    }
+
+private:
+    struct Entry {
+        GdkEvent *event = nullptr;
+        KeyEventState state = KeyEventState::None;
+    };
+
+    static unsigned int slot(GdkEvent *event) {
+        auto hash = static_cast<uint32_t>(GPOINTER_TO_SIZE(event) >> 4);
+        return (hash * 2654435769u) >> (32 - CapacityBits);
+    }
+
+    unsigned int find(GdkEvent *event) const {
+        for (auto index = slot(event); entries_[index].event;
+             index = (index + 1) % Capacity) {
+            if (entries_[index].event == event) {
+                return index;
+            }
+        }
+        return Capacity;
+    }
+
+    // Keep at least one empty slot so that probing always terminates.
+    bool reserve() {
+        if (size_ + 1 < Capacity) {
+            return true;
+        }
+        if (!handledCount_) {
+            return false;
+        }
+        evictHandled();
+        return true;
+    }
+
+    void insert(GdkEvent *event, KeyEventState state) {
+        auto index = slot(event);
+        while (entries_[index].event) {
+            index = (index + 1) % Capacity;
+        }
+        entries_[index].event = gdk_event_ref(event);
+        entries_[index].state = state;
+        size_++;
+    }
+
+    void evictHandled() {
+        auto *event = handled_[handledHead_];
+        handledHead_ = (handledHead_ + 1) % MaxHandled;
+        handledCount_--;
+        auto index = find(event);
+        if (index < Capacity) {
+            remove(index);
+        }
+    }
+
+    // Backward shift deletion, no tombstones are left behind.
+    void remove(unsigned int hole) {
+        gdk_event_unref(entries_[hole].event);
+        size_--;
+        for (auto next = (hole + 1) % Capacity; entries_[next].event;
+             next = (next + 1) % Capacity) {
+            auto home = slot(entries_[next].event);
+            bool reachable = hole < next ? (home > hole && home <= next)
+                                         : (home > hole || home <= next);
+            if (!reachable) {
+                entries_[hole] = entries_[next];
+                hole = next;
+            }
+        }
+        entries_[hole] = Entry();
+    }
+
+    Entry entries_[Capacity];
+    GdkEvent *handled_[MaxHandled] = {};
+    unsigned int size_ = 0;
+    unsigned int handledHead_ = 0;
+    unsigned int handledCount_ = 0;
+};
+
+/*
+ * Keys that arrived while an earlier key of the context was still waiting for
+ * its verdict, in arrival order, along with their state. Constructed and
+ * destroyed along with the context like KeyEventTable.
+ */
+class HeldKeyQueue {
+public:
+    static constexpr unsigned int Capacity = 32;
+
+    bool empty() const { return size_ == 0; }
+
+    GdkEvent *front() const { return size_ ? entries_[head_].event : nullptr; }
+
+    bool push(GdkEvent *event, guint32 state) {
+        if (size_ == Capacity) {
+            return false;
+        }
+        auto &entry = entries_[(head_ + size_) % Capacity];
+        entry.event = gdk_event_ref(event);
+        entry.state = state;
+        size_++;
+        return true;
+    }
+
+    // Transfers the reference of the event to the caller.
+    GdkEvent *pop(guint32 *state) {
+        auto &entry = entries_[head_];
+        GdkEvent *event = entry.event;
+        *state = entry.state;
+        entry = Entry();
+        head_ = (head_ + 1) % Capacity;
+        size_--;
+        return event;
+    }
+
+    void clear() {
+        guint32 state;
+        while (!empty()) {
+            gdk_event_unref(pop(&state));
+        }
+        head_ = 0;
+    }
+
+private:
+    struct Entry {
+        GdkEvent *event = nullptr;
+        guint32 state = 0;
+    };
+
+    Entry entries_[Capacity];
+    unsigned int head_ = 0;
+    unsigned int size_ = 0;
+};
+
+} // namespace fcitx::gtk
 
 struct _FcitxIMContext {
     GtkIMContext parent;
 
     GtkWidget *client_widget;
+    GtkSettings *theme_settings;
+    gulong theme_changed_signal;
     bool has_rect;
     GdkRectangle area;
     FcitxGClient *client;
@@ -24,22 +230,56 @@ struct _FcitxIMContext {
     bool last_is_release;
     gboolean use_preedit;
     gboolean support_surrounding_text;
+    gboolean surrounding_dirty;
+    guint idle_id;
+    guint idle_work;
+    GString *pending_commit;
     gboolean is_inpreedit;
     gboolean is_wayland;
     char *preedit_string;
     char *commit_preedit_string;
     char *surrounding_text;
+    gsize surrounding_text_len;
+    fcitx::gtk::Utf8OffsetCache surrounding_offsets;
     int cursor_pos;
     guint64 capability_from_toolkit;
     guint64 last_updated_capability;
+    guint64 client_capability;
+    gboolean client_capability_valid;
+    GdkSurface *client_surface;
+    gulong client_surface_mapped_signal;
+    /* What the server already knows, to skip calls that change nothing. */
+    gboolean server_needs_reset;
+    guint server_focus_serial;
+    /* Focus out dropped a preedit the server still has, so it has to be
+     * told about the focus change even if focus comes right back. */
+    gboolean focus_out_dropped_preedit;
+    gboolean server_has_rect;
+    GdkRectangle server_rect;
+    int server_rect_scale;
+    guint skipped_calls;
     PangoAttrList *attrlist;
+    GString *preedit_buffer;
+    GString *commit_preedit_buffer;
+    PangoColor highlight_fg;
+    PangoColor highlight_bg;
+    gboolean highlight_colors_valid;
+    gboolean preedit_visible;
+    gboolean preedit_pending;
+    GdkFrameClock *preedit_clock;
+    gulong preedit_clock_signal;
     int last_cursor_pos;
     int last_anchor_pos;
     struct xkb_compose_state *xkbComposeState;
 
-    GHashTable *pending_events;
-    GHashTable *handled_events;
-    GQueue *handled_events_list;
+    fcitx::gtk::KeyEventTable key_events;
+    fcitx::gtk::HeldKeyQueue held_keys;
+    // Held keys the server did not handle, replayed to the widget. GTK4
+    // events are immutable, so they are recognized by identity instead of
+    // an ignored modifier bit.
+    fcitx::gtk::HeldKeyQueue ignored_keys;
+    GdkEvent *inflight_key;
+    guint inflight_timeout;
 
     gboolean ignore_reset;
 
@@ -0,0 +1 @@
+../gtk3/immodule-bench.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../gtk3/utf8.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../gtk3/utf8.h
\ No newline at end of file